@@ -0,0 +1,25 @@
+import zlib,struct,sys
+d=open('out.png','rb').read()
+pos=8; idat=b''
+while pos<len(d):
+    l,=struct.unpack('>I',d[pos:pos+4]); t=d[pos+4:pos+8]; body=d[pos+8:pos+8+l]; crc,=struct.unpack('>I',d[pos+8+l:pos+12+l])
+    assert zlib.crc32(t+body)&0xffffffff==crc, 'crc'
+    if t==b'IHDR': w,h=struct.unpack('>II',body[:8])
+    if t==b'IDAT': idat+=body
+    pos+=12+l
+raw=zlib.decompress(idat)
+# unfilter
+rs=w*3; out=bytearray(); prev=bytearray(rs)
+for y in range(h):
+    ft=raw[y*(rs+1)]; row=bytearray(raw[y*(rs+1)+1:(y+1)*(rs+1)])
+    for i in range(rs):
+        a=row[i-3] if i>=3 else 0; b=prev[i]; c=prev[i-3] if i>=3 else 0
+        if ft==1: row[i]=(row[i]+a)&255
+        elif ft==2: row[i]=(row[i]+b)&255
+        elif ft==3: row[i]=(row[i]+(a+b)//2)&255
+        elif ft==4:
+            p=a+b-c; pa,pb,pc=abs(p-a),abs(p-b),abs(p-c)
+            pr=a if pa<=pb and pa<=pc else (b if pb<=pc else c)
+            row[i]=(row[i]+pr)&255
+    out+=row; prev=row
+print('match', bytes(out)==open('raw.bin','rb').read(), len(d))
@@ -13,7 +13,7 @@ class Sphere : public Surface
 {
 public:
     Sphere() {}
-    virtual Intersection Sphere::Intersect(const Ray& ray, bool inverted) const override
+    virtual Intersection Intersect(const Ray& ray, bool inverted) const override
     {
         float a = glm::dot(ray.direction, ray.direction);
         float b = glm::dot(ray.direction, ray.origin);
@@ -108,7 +108,7 @@ class Plane : public Surface
 {
 public:
     Plane() {}
-    virtual Intersection Plane::Intersect(const Ray& ray, bool inverted) const override
+    virtual Intersection Intersect(const Ray& ray, bool inverted) const override
     {
         Intersection intersection;
         glm::dvec3 vertices[4] = {
@@ -0,0 +1,369 @@
+#include "Renderer.h"
+#include "glm/gtc/constants.hpp"
+
+#include <algorithm>
+
+using namespace glm;
+
+namespace
+{
+    // First bounces of the random numbers of the light subpath and of the connections,
+    // so they never share numbers with the camera subpath
+    const std::uint32_t light_bounces = 256;
+    const std::uint32_t connection_bounces = 512;
+}
+
+void BidirectionalPathTracer::Render(uvec2 res)
+{
+    cameraRotation = camera.GetRotateMatrix();
+    PrepareShadowRays();
+    lightCdf.clear();
+    double total_power = 0.0;
+    for (auto& light : scene->lights)
+    {
+        total_power += (light.color.x + light.color.y + light.color.z) / 3.0;
+        lightCdf.push_back(total_power);
+    }
+    splats.assign(size_t(res.x) * res.y, vec3(0.0f));
+
+    // The rows can be written only after the light of all tiles is splatted
+    ImageWriter* stream = imageStream;
+    imageStream = nullptr;
+    RayTracer::Render(res);
+    imageStream = stream;
+
+    float scale = 1.0f / glm::max(samplesPerPixel, 1);
+    for (unsigned y = 0; y < resolution.y; y++)
+    {
+        for (unsigned x = 0; x < resolution.x; x++)
+            framebuffer.Set(x, y, framebuffer.Get(x, y) + splats[y * resolution.x + x] * scale);
+    }
+    framebuffer.FlushRegion(uvec2(0), resolution);
+    std::vector<vec3>().swap(splats);
+
+    if (!imageStream)
+        return;
+    std::vector<unsigned char> rgb;
+    for (unsigned first = 0; first < resolution.y; first += tileSize)
+    {
+        unsigned row_count = glm::min(tileSize, resolution.y - first);
+        ConvertRows(first, row_count, rgb);
+        imageStream->WriteRows(rgb.data(), row_count);
+    }
+}
+
+int BidirectionalPathTracer::RenderChanged(const SceneEntities&)
+{
+    if (tiles.empty())
+        return 0;
+    Render(resolution);
+    return static_cast<int>(tiles.size());
+}
+
+dvec3 BidirectionalPathTracer::TraceSample(const Ray& ray, uvec2 pixel, int sample, SceneEntities* touched)
+{
+    RandomStream random(std::uint64_t(pixel.y) * resolution.x + pixel.x, sample, sampler.seed);
+
+    std::vector<PathVertex> camera_path(1);
+    camera_path[0].position = camera.position;
+    camera_path[0].beta = dvec3(1.0);
+    camera_path[0].pdf_forward = 1.0;
+    camera_path[0].insides = ray.current_object_insides;
+    double cos_theta = glm::dot(ray.direction, cameraRotation * dvec3(0.0, 0.0, 1.0));
+    random.SetBounce(0);
+    dvec3 color = RandomWalk(ray, dvec3(1.0), CameraPdf(cos_theta), maxRenderStep + 1, false, random, camera_path, touched);
+
+    std::vector<PathVertex> light_path;
+    if (!lightCdf.empty() && lightCdf.back() > 0.0)
+    {
+        // A point light emits its intensity of pi times its color uniformly in all directions
+        const double pi = glm::pi<double>();
+        random.SetBounce(light_bounces);
+        double probability;
+        const PointLight& light = scene->lights[PickLight(random.Next(), probability)];
+        double u = random.Next(), v = random.Next();
+
+        light_path.resize(1);
+        light_path[0].position = light.center;
+        light_path[0].beta = light.color * (pi / probability);
+        light_path[0].pdf_forward = probability;
+        light_path[0].insides.push(&scene->empty_object);
+
+        Ray emitted(light.center, ProjectionMap::Direction(u, v));
+        emitted.current_object_insides = light_path[0].insides;
+        double pdf = 1.0 / (4.0 * pi);
+        random.SetBounce(light_bounces + 1);
+        RandomWalk(emitted, light_path[0].beta / pdf, pdf, maxRenderStep + 1, true, random, light_path, nullptr);
+    }
+
+    // Every pair of the subpath lengths makes a path of s + t - 2 bounces
+    for (int t = 1; t <= static_cast<int>(camera_path.size()); t++)
+    {
+        for (int s = 1; s <= static_cast<int>(light_path.size()); s++)
+        {
+            if ((s == 1 && t == 1) || s + t - 2 > maxRenderStep)
+                continue;
+            random.SetBounce(connection_bounces + t);
+            color += Connect(light_path, s, camera_path, t, random);
+        }
+    }
+    return color;
+}
+
+dvec3 BidirectionalPathTracer::RandomWalk(Ray ray, dvec3 beta, double pdf, int max_vertices, bool from_light,
+    RandomStream& random, std::vector<PathVertex>& path, SceneEntities* touched)
+{
+    std::uint32_t first_bounce = random.bounce;
+    for (int bounce = 0; static_cast<int>(path.size()) < max_vertices; bounce++)
+    {
+        random.SetBounce(first_bounce + bounce);
+
+        Intersection intersection;
+        Object3D* intersected_object = FindIntersection(ray, intersection);
+        if (!intersection)
+            return from_light ? dvec3(0.0) : beta * backgroundColor;
+        if (!intersection.material)
+            break;
+        if (glm::dot(ray.direction, intersection.normal) > 0.0)
+            intersection.normal = -intersection.normal;
+
+        SurfacePassage passage = PassSurface(ray, intersection, intersected_object);
+        if (touched)
+        {
+            touched->objects.insert(intersected_object);
+            touched->surface_materials.insert(intersection.material);
+            touched->inside_materials.insert(ray.current_object_insides.top()->material);
+            touched->inside_materials.insert(passage.insides.top()->material);
+        }
+
+        PathVertex vertex;
+        vertex.position = intersection.coord;
+        vertex.normal = intersection.normal;
+        vertex.incoming = ray.direction;
+        vertex.material = intersection.material;
+        vertex.lobes = GetLobes(*intersection.material, passage);
+        vertex.insides = ray.current_object_insides;
+        vertex.beta = beta;
+        vertex.pdf_forward = ToArea(pdf, path.back().position, vertex.position, vertex.normal);
+        path.push_back(std::move(vertex));
+        if (static_cast<int>(path.size()) >= max_vertices)
+            break;
+
+        Ray next;
+        dvec3 weight;
+        if (!Scatter(*intersection.material, path.back().lobes, ray, intersection, passage, random, next, weight, pdf))
+            break;
+
+        // The density of going back along the path, zero after mirror reflection and refraction
+        PathVertex& current = path.back();
+        PathVertex& previous = path[path.size() - 2];
+        current.delta = pdf == 0.0;
+        double reverse_pdf = current.delta ? 0.0 :
+            Pdf(*current.material, current.lobes, current.normal, -next.direction, -ray.direction);
+        previous.pdf_reverse = ToArea(reverse_pdf, current.position, previous.position, previous.normal);
+
+        beta *= weight;
+        if (static_cast<int>(path.size()) - 1 >= rouletteDepth)
+        {
+            double survival = glm::min(0.95, MaxComponent(beta));
+            if (random.Next() >= survival)
+                break;
+            beta /= survival;
+        }
+        ray = next;
+    }
+    return dvec3(0.0);
+}
+
+dvec3 BidirectionalPathTracer::Connect(const std::vector<PathVertex>& light_path, int s,
+    const std::vector<PathVertex>& camera_path, int t, RandomStream& random)
+{
+    const double pi = glm::pi<double>();
+    ConnectionDensities densities;
+
+    if (t == 1)
+    {
+        // Light tracing: the light vertex is seen through the pinhole of the camera
+        const PathVertex& y = light_path[s - 1];
+        dvec2 image_pos;
+        double cos_camera;
+        if (y.delta || !y.material || !Project(y.position, image_pos, cos_camera))
+            return dvec3(0.0);
+        dvec3 offset = camera.position - y.position;
+        double distance2 = glm::dot(offset, offset), distance = glm::sqrt(distance2);
+        dvec3 to_camera = offset / distance;
+        double cos_y = glm::dot(y.normal, to_camera);
+        if (cos_y <= 0.0 || !Visible(y.position, to_camera, distance, y.insides))
+            return dvec3(0.0);
+
+        dvec3 light = y.beta * Evaluate(*y.material, y.normal, y.incoming, to_camera) *
+            (cos_y * cos_camera / distance2 * CameraImportance(cos_camera));
+
+        densities.light_end_forward = y.pdf_forward;
+        densities.light_end_reverse = CameraPdf(cos_camera) * cos_y / distance2;
+        if (s > 1)
+        {
+            densities.light_previous_reverse = ToArea(Pdf(*y.material, y.lobes, y.normal, -to_camera, -y.incoming),
+                y.position, light_path[s - 2].position, light_path[s - 2].normal);
+        }
+
+        double weight = MisWeight(light_path, s, camera_path, t, densities);
+        uvec2 pixel = glm::min(uvec2(image_pos), resolution - uvec2(1));
+        vec3& splat = splats[pixel.y * resolution.x + pixel.x];
+        vec3 splatted(light * weight);
+        #pragma omp atomic
+        splat.x += splatted.x;
+        #pragma omp atomic
+        splat.y += splatted.y;
+        #pragma omp atomic
+        splat.z += splatted.z;
+        return dvec3(0.0);
+    }
+
+    const PathVertex& z = camera_path[t - 1];
+    if (z.delta || !z.material)
+        return dvec3(0.0);
+
+    dvec3 light;
+    dvec3 light_position;
+    double distance2;
+    dvec3 to_light;
+    if (s == 1)
+    {
+        // Next event estimation: a light picked again by its power
+        double probability;
+        int index = PickLight(random.Next(), probability);
+        const PointLight& picked = scene->lights[index];
+        light_position = picked.center;
+        dvec3 offset = light_position - z.position;
+        distance2 = glm::dot(offset, offset);
+        double distance = glm::sqrt(distance2);
+        to_light = offset / distance;
+        double cos_z = glm::dot(z.normal, to_light);
+        if (cos_z <= 0.0 || !Visible(z.position, to_light, distance, z.insides, index))
+            return dvec3(0.0);
+
+        light = z.beta * Evaluate(*z.material, z.normal, z.incoming, to_light) * picked.color *
+            (pi * cos_z / (distance2 * probability));
+
+        densities.light_end_forward = probability;
+        densities.camera_end_reverse = cos_z / (4.0 * pi * distance2);
+    }
+    else
+    {
+        const PathVertex& y = light_path[s - 1];
+        if (y.delta || !y.material)
+            return dvec3(0.0);
+        light_position = y.position;
+        dvec3 offset = y.position - z.position;
+        distance2 = glm::dot(offset, offset);
+        double distance = glm::sqrt(distance2);
+        to_light = offset / distance;
+        double cos_z = glm::dot(z.normal, to_light), cos_y = -glm::dot(y.normal, to_light);
+        // The surface of the light vertex itself must not hide it
+        if (cos_z <= 0.0 || cos_y <= 0.0 || !Visible(z.position, to_light, distance * (1.0 - 1e-6), z.insides))
+            return dvec3(0.0);
+
+        light = z.beta * Evaluate(*z.material, z.normal, z.incoming, to_light) *
+            Evaluate(*y.material, y.normal, y.incoming, -to_light) * y.beta * (cos_z * cos_y / distance2);
+
+        densities.light_end_forward = y.pdf_forward;
+        densities.camera_end_reverse = ToArea(Pdf(*y.material, y.lobes, y.normal, y.incoming, -to_light),
+            y.position, z.position, z.normal);
+        densities.light_previous_reverse = ToArea(Pdf(*y.material, y.lobes, y.normal, to_light, -y.incoming),
+            y.position, light_path[s - 2].position, light_path[s - 2].normal);
+    }
+    if (MaxComponent(light) <= 0.0)
+        return dvec3(0.0);
+
+    densities.light_end_reverse = ToArea(Pdf(*z.material, z.lobes, z.normal, z.incoming, to_light),
+        z.position, light_position, s == 1 ? dvec3(0.0) : light_path[s - 1].normal);
+    densities.camera_previous_reverse = ToArea(Pdf(*z.material, z.lobes, z.normal, -to_light, -z.incoming),
+        z.position, camera_path[t - 2].position, camera_path[t - 2].normal);
+
+    return light * MisWeight(light_path, s, camera_path, t, densities);
+}
+
+double BidirectionalPathTracer::MisWeight(const std::vector<PathVertex>& light_path, int s,
+    const std::vector<PathVertex>& camera_path, int t, const ConnectionDensities& densities) const
+{
+    if (s + t == 2)
+        return 1.0;
+
+    // Ratios of the densities of the same path made by the other connections to the density of this one;
+    // the densities of the mirror reflections and refractions are zero and left out
+    auto remap = [](double pdf) { return pdf != 0.0 ? pdf : 1.0; };
+    double sum = 0.0, ratio = 1.0;
+    for (int i = t - 1; i > 0; i--)
+    {
+        double reverse = i == t - 1 ? densities.camera_end_reverse :
+            (i == t - 2 ? densities.camera_previous_reverse : camera_path[i].pdf_reverse);
+        ratio *= remap(reverse) / remap(camera_path[i].pdf_forward);
+        bool delta = i != t - 1 && camera_path[i].delta;
+        if (!delta && !camera_path[i - 1].delta)
+            sum += ratio;
+    }
+
+    ratio = 1.0;
+    for (int i = s - 1; i >= 0; i--)
+    {
+        double reverse = i == s - 1 ? densities.light_end_reverse :
+            (i == s - 2 ? densities.light_previous_reverse : light_path[i].pdf_reverse);
+        double forward = i == s - 1 ? densities.light_end_forward : light_path[i].pdf_forward;
+        ratio *= remap(reverse) / remap(forward);
+        // The lights are points, which no camera subpath can reach
+        bool delta = i != s - 1 && light_path[i].delta;
+        bool previous_delta = i == 0 || light_path[i - 1].delta;
+        if (!delta && !previous_delta)
+            sum += ratio;
+    }
+    return 1.0 / (1.0 + sum);
+}
+
+double BidirectionalPathTracer::ToArea(double pdf, const dvec3& from, const dvec3& to, const dvec3& to_normal)
+{
+    dvec3 offset = to - from;
+    double distance2 = glm::dot(offset, offset);
+    if (distance2 <= 0.0)
+        return 0.0;
+    pdf /= distance2;
+    if (to_normal != dvec3(0.0))
+        pdf *= std::abs(glm::dot(to_normal, offset)) / glm::sqrt(distance2);
+    return pdf;
+}
+
+bool BidirectionalPathTracer::Project(const dvec3& point, dvec2& image_pos, double& cos_theta) const
+{
+    // Inverse of MakeRay: the image plane is at the distance focal in the camera space and resolution.x pixels wide
+    dvec3 local = glm::transpose(cameraRotation) * (point - camera.position);
+    if (local.z <= 0.0)
+        return false;
+    double focal = 0.5 / atan(camera.viewAngle / 2.0);
+    image_pos.x = local.x / local.z * focal * resolution.x + resolution.x / 2.0;
+    image_pos.y = local.y / local.z * focal * resolution.x + resolution.y / 2.0;
+    cos_theta = local.z / glm::length(local);
+    return image_pos.x >= 0.0 && image_pos.y >= 0.0 && image_pos.x < resolution.x && image_pos.y < resolution.y;
+}
+
+double BidirectionalPathTracer::CameraPdf(double cos_theta) const
+{
+    // The rays are spread uniformly over the image plane of the area resolution.y / resolution.x at the distance focal
+    double focal = 0.5 / atan(camera.viewAngle / 2.0);
+    double area = double(resolution.y) / resolution.x;
+    return focal * focal / (area * cos_theta * cos_theta * cos_theta);
+}
+
+double BidirectionalPathTracer::CameraImportance(double cos_theta) const
+{
+    return CameraPdf(cos_theta) / cos_theta;
+}
+
+int BidirectionalPathTracer::PickLight(double u, double& probability) const
+{
+    double target = u * lightCdf.back();
+    int index = static_cast<int>(std::upper_bound(lightCdf.begin(), lightCdf.end(), target) - lightCdf.begin());
+    index = glm::min(index, static_cast<int>(lightCdf.size()) - 1);
+    double previous = index > 0 ? lightCdf[index - 1] : 0.0;
+    probability = (lightCdf[index] - previous) / lightCdf.back();
+    return index;
+}
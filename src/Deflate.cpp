@@ -0,0 +1,508 @@
+#include "Deflate.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace
+{
+    const int window_size = 32768;
+    const int min_match = 3;
+    const int max_match = 258;
+    const int max_chain = 48;
+    const int hash_bits = 15;
+    const size_t max_block_tokens = 65536;
+
+    const int length_base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    const int length_extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    const int distance_base[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    const int distance_extra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    // Order in which the lengths of the code length code are stored
+    const int code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    // Literal (distance == 0) or match of the LZ77 stage
+    struct Token
+    {
+        uint16_t length;
+        uint16_t distance;
+    };
+
+    // Writes bits starting from the least significant one, as deflate requires
+    class BitWriter
+    {
+    public:
+        BitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+        void Put(uint32_t bits, int count)
+        {
+            buffer |= static_cast<uint64_t>(bits) << bit_count;
+            bit_count += count;
+            while (bit_count >= 8)
+            {
+                out.push_back(static_cast<unsigned char>(buffer & 0xff));
+                buffer >>= 8;
+                bit_count -= 8;
+            }
+        }
+
+        // Huffman codes are stored starting from the most significant bit
+        void PutCode(uint32_t code, int length)
+        {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; i++)
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            Put(reversed, length);
+        }
+
+        void Align()
+        {
+            if (bit_count > 0)
+                Put(0, 8 - bit_count);
+        }
+
+    private:
+        std::vector<unsigned char>& out;
+        uint64_t buffer = 0;
+        int bit_count = 0;
+    };
+
+    int LengthSymbol(int length)
+    {
+        int symbol = 0;
+        while (symbol < 28 && length_base[symbol + 1] <= length)
+            symbol++;
+        return symbol;
+    }
+
+    int DistanceSymbol(int distance)
+    {
+        int symbol = 0;
+        while (symbol < 29 && distance_base[symbol + 1] <= distance)
+            symbol++;
+        return symbol;
+    }
+
+    // LZ77 stage: greedy matching with hash chains
+    std::vector<Token> FindMatches(const unsigned char* data, size_t size)
+    {
+        std::vector<Token> tokens;
+        tokens.reserve(size / 2 + 16);
+
+        std::vector<int> head(1 << hash_bits, -1);
+        std::vector<int> previous(window_size, -1);
+        auto hash = [&](size_t pos)
+        {
+            uint32_t h = (data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2];
+            return static_cast<int>((h * 2654435761u) >> (32 - hash_bits));
+        };
+        auto insert = [&](size_t pos)
+        {
+            if (pos + min_match > size)
+                return;
+            int h = hash(pos);
+            previous[pos % window_size] = head[h];
+            head[h] = static_cast<int>(pos);
+        };
+
+        size_t pos = 0;
+        while (pos < size)
+        {
+            int best_length = 0, best_distance = 0;
+            if (pos + min_match <= size)
+            {
+                int max_length = static_cast<int>(std::min<size_t>(max_match, size - pos));
+                int candidate = head[hash(pos)];
+                for (int chain = 0; chain < max_chain && candidate >= 0; chain++)
+                {
+                    int distance = static_cast<int>(pos) - candidate;
+                    if (distance > window_size)
+                        break;
+
+                    const unsigned char* a = data + pos;
+                    const unsigned char* b = data + candidate;
+                    if (b[best_length] == a[best_length])
+                    {
+                        int length = 0;
+                        while (length < max_length && a[length] == b[length])
+                            length++;
+                        if (length > best_length)
+                        {
+                            best_length = length;
+                            best_distance = distance;
+                            if (length == max_length)
+                                break;
+                        }
+                    }
+
+                    int next = previous[candidate % window_size];
+                    if (next >= candidate)
+                        break;
+                    candidate = next;
+                }
+            }
+
+            if (best_length >= min_match)
+            {
+                tokens.push_back({ static_cast<uint16_t>(best_length), static_cast<uint16_t>(best_distance) });
+                for (int i = 0; i < best_length; i++)
+                    insert(pos + i);
+                pos += best_length;
+            }
+            else
+            {
+                tokens.push_back({ data[pos], 0 });
+                insert(pos);
+                pos++;
+            }
+        }
+        return tokens;
+    }
+
+    // Lengths of Huffman codes for the symbols with the specified frequencies,
+    // limited by max_bits
+    std::vector<int> BuildCodeLengths(std::vector<uint32_t> frequencies, int max_bits)
+    {
+        int symbol_count = static_cast<int>(frequencies.size());
+
+        // Trees of a single symbol are not allowed, add a second one
+        int used = 0;
+        for (auto frequency : frequencies)
+            used += frequency > 0;
+        for (int s = 0; used < 2 && s < symbol_count; s++)
+        {
+            if (frequencies[s] == 0)
+            {
+                frequencies[s] = 1;
+                used++;
+            }
+        }
+
+        // Plain Huffman tree
+        struct Node
+        {
+            uint64_t weight;
+            int index;
+            bool operator>(const Node& other) const
+            {
+                return weight > other.weight || (weight == other.weight && index > other.index);
+            }
+        };
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        std::vector<int> parent(symbol_count, -1);
+        for (int s = 0; s < symbol_count; s++)
+        {
+            if (frequencies[s] > 0)
+                queue.push({ frequencies[s], s });
+        }
+        int next_index = symbol_count;
+        while (queue.size() > 1)
+        {
+            Node a = queue.top(); queue.pop();
+            Node b = queue.top(); queue.pop();
+            parent.push_back(-1);
+            parent[a.index] = parent[b.index] = next_index;
+            queue.push({ a.weight + b.weight, next_index++ });
+        }
+
+        std::vector<int> depth(parent.size(), 0);
+        for (int node = static_cast<int>(parent.size()) - 2; node >= 0; node--)
+        {
+            if (parent[node] >= 0)
+                depth[node] = depth[parent[node]] + 1;
+        }
+
+        // Count codes of every length, moving too long codes to max_bits
+        std::vector<int> length_counts(max_bits + 1, 0);
+        for (int s = 0; s < symbol_count; s++)
+        {
+            if (frequencies[s] > 0)
+                length_counts[std::min(depth[s], max_bits)]++;
+        }
+
+        // Restore Kraft inequality by lengthening some of the shorter codes
+        uint64_t kraft = 0;
+        for (int length = 1; length <= max_bits; length++)
+            kraft += static_cast<uint64_t>(length_counts[length]) << (max_bits - length);
+        while (kraft > (1ull << max_bits))
+        {
+            length_counts[max_bits]--;
+            for (int length = max_bits - 1; length > 0; length--)
+            {
+                if (length_counts[length] > 0)
+                {
+                    length_counts[length]--;
+                    length_counts[length + 1] += 2;
+                    break;
+                }
+            }
+            kraft--;
+        }
+
+        // The most frequent symbols get the shortest codes
+        std::vector<int> symbols;
+        for (int s = 0; s < symbol_count; s++)
+        {
+            if (frequencies[s] > 0)
+                symbols.push_back(s);
+        }
+        std::stable_sort(symbols.begin(), symbols.end(), [&](int a, int b)
+        {
+            return frequencies[a] > frequencies[b];
+        });
+
+        std::vector<int> lengths(symbol_count, 0);
+        size_t next = 0;
+        for (int length = 1; length <= max_bits; length++)
+        {
+            for (int i = 0; i < length_counts[length]; i++)
+                lengths[symbols[next++]] = length;
+        }
+        return lengths;
+    }
+
+    // Canonical Huffman codes for the specified code lengths
+    std::vector<uint32_t> BuildCodes(const std::vector<int>& lengths)
+    {
+        int max_bits = *std::max_element(lengths.begin(), lengths.end());
+        std::vector<uint32_t> length_counts(max_bits + 1, 0), next_code(max_bits + 2, 0);
+        for (int length : lengths)
+        {
+            if (length > 0)
+                length_counts[length]++;
+        }
+        uint32_t code = 0;
+        for (int length = 1; length <= max_bits; length++)
+        {
+            code = (code + length_counts[length - 1]) << 1;
+            next_code[length] = code;
+        }
+        std::vector<uint32_t> codes(lengths.size(), 0);
+        for (size_t s = 0; s < lengths.size(); s++)
+        {
+            if (lengths[s] > 0)
+                codes[s] = next_code[lengths[s]]++;
+        }
+        return codes;
+    }
+
+    // Run-length encoding of code lengths by the symbols 16, 17 and 18
+    // Every item is (symbol, extra bits value)
+    std::vector<std::pair<int, int>> EncodeCodeLengths(const std::vector<int>& lengths)
+    {
+        std::vector<std::pair<int, int>> items;
+        size_t i = 0;
+        while (i < lengths.size())
+        {
+            int length = lengths[i];
+            size_t run = 1;
+            while (i + run < lengths.size() && lengths[i + run] == length)
+                run++;
+
+            if (length == 0)
+            {
+                size_t left = run;
+                while (left >= 11)
+                {
+                    size_t count = std::min<size_t>(left, 138);
+                    items.push_back({ 18, static_cast<int>(count - 11) });
+                    left -= count;
+                }
+                if (left >= 3)
+                {
+                    items.push_back({ 17, static_cast<int>(left - 3) });
+                    left = 0;
+                }
+                for (; left > 0; left--)
+                    items.push_back({ 0, 0 });
+            }
+            else
+            {
+                items.push_back({ length, 0 });
+                size_t left = run - 1;
+                while (left >= 3)
+                {
+                    size_t count = std::min<size_t>(left, 6);
+                    items.push_back({ 16, static_cast<int>(count - 3) });
+                    left -= count;
+                }
+                for (; left > 0; left--)
+                    items.push_back({ length, 0 });
+            }
+            i += run;
+        }
+        return items;
+    }
+
+    // Write tokens as one non-final block with dynamic Huffman codes
+    void WriteBlock(BitWriter& writer, const Token* tokens, size_t count)
+    {
+        std::vector<uint32_t> literal_frequencies(286, 0), distance_frequencies(30, 0);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (tokens[i].distance == 0)
+            {
+                literal_frequencies[tokens[i].length]++;
+            }
+            else
+            {
+                literal_frequencies[257 + LengthSymbol(tokens[i].length)]++;
+                distance_frequencies[DistanceSymbol(tokens[i].distance)]++;
+            }
+        }
+        literal_frequencies[256] = 1; // end of block
+
+        std::vector<int> literal_lengths = BuildCodeLengths(literal_frequencies, 15);
+        std::vector<int> distance_lengths = BuildCodeLengths(distance_frequencies, 15);
+        std::vector<uint32_t> literal_codes = BuildCodes(literal_lengths);
+        std::vector<uint32_t> distance_codes = BuildCodes(distance_lengths);
+
+        int literal_count = 286;
+        while (literal_count > 257 && literal_lengths[literal_count - 1] == 0)
+            literal_count--;
+        int distance_count = 30;
+        while (distance_count > 1 && distance_lengths[distance_count - 1] == 0)
+            distance_count--;
+
+        // Both code length sequences are compressed together by the code length code
+        std::vector<int> all_lengths(literal_lengths.begin(), literal_lengths.begin() + literal_count);
+        all_lengths.insert(all_lengths.end(), distance_lengths.begin(), distance_lengths.begin() + distance_count);
+        auto items = EncodeCodeLengths(all_lengths);
+
+        std::vector<uint32_t> code_length_frequencies(19, 0);
+        for (const auto& item : items)
+            code_length_frequencies[item.first]++;
+        std::vector<int> code_length_lengths = BuildCodeLengths(code_length_frequencies, 7);
+        std::vector<uint32_t> code_length_codes = BuildCodes(code_length_lengths);
+
+        int code_length_count = 19;
+        while (code_length_count > 4 && code_length_lengths[code_length_order[code_length_count - 1]] == 0)
+            code_length_count--;
+
+        // Block header
+        writer.Put(0, 1); // not final
+        writer.Put(2, 2); // dynamic Huffman codes
+        writer.Put(literal_count - 257, 5);
+        writer.Put(distance_count - 1, 5);
+        writer.Put(code_length_count - 4, 4);
+        for (int i = 0; i < code_length_count; i++)
+            writer.Put(code_length_lengths[code_length_order[i]], 3);
+        for (const auto& item : items)
+        {
+            writer.PutCode(code_length_codes[item.first], code_length_lengths[item.first]);
+            if (item.first == 16)
+                writer.Put(item.second, 2);
+            else if (item.first == 17)
+                writer.Put(item.second, 3);
+            else if (item.first == 18)
+                writer.Put(item.second, 7);
+        }
+
+        // Compressed data
+        for (size_t i = 0; i < count; i++)
+        {
+            const Token& token = tokens[i];
+            if (token.distance == 0)
+            {
+                writer.PutCode(literal_codes[token.length], literal_lengths[token.length]);
+                continue;
+            }
+            int length_symbol = LengthSymbol(token.length);
+            writer.PutCode(literal_codes[257 + length_symbol], literal_lengths[257 + length_symbol]);
+            writer.Put(token.length - length_base[length_symbol], length_extra[length_symbol]);
+
+            int distance_symbol = DistanceSymbol(token.distance);
+            writer.PutCode(distance_codes[distance_symbol], distance_lengths[distance_symbol]);
+            writer.Put(token.distance - distance_base[distance_symbol], distance_extra[distance_symbol]);
+        }
+        writer.PutCode(literal_codes[256], literal_lengths[256]);
+    }
+}
+
+void DeflateSegment(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+    std::vector<Token> tokens = FindMatches(data, size);
+
+    BitWriter writer(out);
+    for (size_t first = 0; first < tokens.size(); first += max_block_tokens)
+        WriteBlock(writer, tokens.data() + first, std::min(max_block_tokens, tokens.size() - first));
+
+    // Empty stored block aligns the segment to the byte boundary (like zlib's sync flush)
+    writer.Put(0, 1);
+    writer.Put(0, 2);
+    writer.Align();
+    const unsigned char empty_stored[4] = { 0x00, 0x00, 0xff, 0xff };
+    out.insert(out.end(), empty_stored, empty_stored + 4);
+}
+
+void DeflateFinish(std::vector<unsigned char>& out)
+{
+    // Final empty stored block
+    const unsigned char final_block[5] = { 0x01, 0x00, 0x00, 0xff, 0xff };
+    out.insert(out.end(), final_block, final_block + 5);
+}
+
+uint32_t Adler32(const unsigned char* data, size_t size, uint32_t adler)
+{
+    const uint32_t base = 65521;
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0)
+    {
+        // Sums do not overflow for 5552 bytes
+        size_t chunk = std::min<size_t>(size, 5552);
+        for (size_t i = 0; i < chunk; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= base;
+        b %= base;
+        data += chunk;
+        size -= chunk;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    const uint32_t base = 65521;
+    uint32_t remainder = static_cast<uint32_t>(size2 % base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (remainder * sum1) % base;
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= (base << 1)) sum2 -= (base << 1);
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+uint32_t Crc32(const unsigned char* data, size_t size, uint32_t crc)
+{
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
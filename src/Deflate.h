@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+    Deflate.h
+    Deflate compression (RFC 1951) and checksums used by the image writers
+    Author: Artyom Bishev
+*/
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Compress data to a sequence of non-final deflate blocks
+// The blocks do not refer to any data outside of the segment and end on a byte boundary,
+// so independently compressed segments may be concatenated into one deflate stream
+void DeflateSegment(const unsigned char* data, size_t size, std::vector<unsigned char>& out);
+
+// Append the final (empty) block that terminates a stream of segments
+void DeflateFinish(std::vector<unsigned char>& out);
+
+// Adler-32 checksum (used by zlib streams)
+uint32_t Adler32(const unsigned char* data, size_t size, uint32_t adler = 1);
+
+// Adler-32 checksum of the concatenation of two buffers
+// adler2 is the checksum of the second buffer which has the size size2
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+// CRC-32 checksum (used by PNG chunks)
+uint32_t Crc32(const unsigned char* data, size_t size, uint32_t crc = 0);
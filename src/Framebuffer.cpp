@@ -0,0 +1,382 @@
+#include "Framebuffer.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+namespace
+{
+    std::string Extension(const std::string& filename)
+    {
+        std::string extension = filename.substr(filename.find_last_of('.') + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension;
+    }
+
+    // Binary values are written in little endian byte order, as both PFM (with negative scale)
+    // and EXR require, which is also the byte order of the supported platforms
+    template<typename T>
+    void Append(std::vector<char>& out, const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    void AppendString(std::vector<char>& out, const std::string& value)
+    {
+        out.insert(out.end(), value.begin(), value.end());
+        out.push_back('\0');
+    }
+
+    // EXR header attribute
+    void AppendAttribute(std::vector<char>& out, const std::string& name, const std::string& type,
+        const std::vector<char>& value)
+    {
+        AppendString(out, name);
+        AppendString(out, type);
+        Append(out, static_cast<int32_t>(value.size()));
+        out.insert(out.end(), value.begin(), value.end());
+    }
+}
+
+void Framebuffer::Allocate(glm::uvec2 new_resolution, PixelFormat new_format)
+{
+    resolution = new_resolution;
+    format = new_format;
+    tile_size = 0;
+    tiles_per_row = 0;
+    mapped_file.Close();
+    size_t count = static_cast<size_t>(resolution.x) * resolution.y;
+
+    float_pixels.clear();
+    half_pixels.clear();
+    if (format == PixelFormat::Float32)
+        float_pixels.assign(count, glm::vec3(0.0f));
+    else
+        half_pixels.assign(count, glm::hvec3(glm::vec3(0.0f)));
+    float_data = float_pixels.data();
+    half_data = half_pixels.data();
+}
+
+bool Framebuffer::AllocateMapped(glm::uvec2 new_resolution, PixelFormat new_format, const std::string& filename,
+    unsigned new_tile_size)
+{
+    float_pixels.clear();
+    float_pixels.shrink_to_fit();
+    half_pixels.clear();
+    half_pixels.shrink_to_fit();
+
+    resolution = new_resolution;
+    format = new_format;
+    tile_size = (glm::max(new_tile_size, 1u) + 15) / 16 * 16;
+    tiles_per_row = (resolution.x + tile_size - 1) / tile_size;
+    unsigned tiles_per_column = (resolution.y + tile_size - 1) / tile_size;
+
+    // Border tiles are stored in full size, as tiled image formats require
+    size_t count = static_cast<size_t>(tiles_per_row) * tiles_per_column * tile_size * tile_size;
+    if (!mapped_file.Create(filename, count * PixelSize()))
+    {
+        float_data = nullptr;
+        half_data = nullptr;
+        return false;
+    }
+
+    // Zero bytes of the new file are black in both formats
+    char* data = mapped_file.GetData();
+    float_data = reinterpret_cast<glm::vec3*>(data);
+    half_data = reinterpret_cast<glm::hvec3*>(data);
+    return true;
+}
+
+void Framebuffer::FlushRegion(glm::uvec2 origin, glm::uvec2 size)
+{
+    if (tile_size == 0 || size.x == 0 || size.y == 0)
+        return;
+
+    // Every row of tiles covered by the region is a contiguous range of the file
+    const size_t tile_bytes = static_cast<size_t>(tile_size) * tile_size * PixelSize();
+    glm::uvec2 first = origin / tile_size;
+    glm::uvec2 last = (origin + size - 1u) / tile_size;
+    for (unsigned tile_y = first.y; tile_y <= last.y; tile_y++)
+    {
+        size_t offset = (static_cast<size_t>(tile_y) * tiles_per_row + first.x) * tile_bytes;
+        size_t length = (last.x - first.x + 1) * tile_bytes;
+        mapped_file.Flush(offset, length);
+        mapped_file.Evict(offset, length);
+    }
+}
+
+bool Framebuffer::IsFloatFormat(const std::string& filename)
+{
+    std::string extension = Extension(filename);
+    return extension == "pfm" || extension == "exr" || extension == "tif" || extension == "tiff";
+}
+
+bool Framebuffer::SaveToFile(const std::string& filename) const
+{
+    std::string extension = Extension(filename);
+    if (extension == "pfm")
+        return SavePfm(filename);
+    if (extension == "exr")
+        return SaveExr(filename);
+    if (extension == "tif" || extension == "tiff")
+        return SaveTiff(filename);
+    return false;
+}
+
+bool Framebuffer::SavePfm(const std::string& filename) const
+{
+    std::ofstream fout(filename, std::ios::binary);
+    // Negative scale means little endian data
+    fout << "PF\n" << resolution.x << " " << resolution.y << "\n-1.0\n";
+
+    // PFM stores rows from the bottom to the top
+    std::vector<glm::vec3> row(resolution.x);
+    for (unsigned y = resolution.y; y-- > 0;)
+    {
+        for (unsigned x = 0; x < resolution.x; x++)
+            row[x] = Get(x, y);
+        fout.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(glm::vec3));
+    }
+    return static_cast<bool>(fout);
+}
+
+bool Framebuffer::SaveExr(const std::string& filename) const
+{
+    const bool half = (format == PixelFormat::Float16);
+    const int32_t pixel_type = half ? 1 : 2; // HALF or FLOAT
+    const size_t channel_size = half ? 2 : 4;
+    const int32_t width = resolution.x, height = resolution.y;
+
+    std::vector<char> header;
+    Append(header, static_cast<int32_t>(20000630)); // magic number
+    Append(header, static_cast<int32_t>(2)); // version 2, single part scanline file
+
+    // Channels are stored in alphabetical order
+    std::vector<char> channels;
+    const char* channel_names[3] = { "B", "G", "R" };
+    for (const char* name : channel_names)
+    {
+        AppendString(channels, name);
+        Append(channels, pixel_type);
+        Append(channels, static_cast<int32_t>(0)); // pLinear and reserved bytes
+        Append(channels, static_cast<int32_t>(1)); // x sampling
+        Append(channels, static_cast<int32_t>(1)); // y sampling
+    }
+    channels.push_back('\0');
+    AppendAttribute(header, "channels", "chlist", channels);
+    AppendAttribute(header, "compression", "compression", std::vector<char>(1, 0));
+
+    std::vector<char> window;
+    Append(window, static_cast<int32_t>(0));
+    Append(window, static_cast<int32_t>(0));
+    Append(window, width - 1);
+    Append(window, height - 1);
+    AppendAttribute(header, "dataWindow", "box2i", window);
+    AppendAttribute(header, "displayWindow", "box2i", window);
+    AppendAttribute(header, "lineOrder", "lineOrder", std::vector<char>(1, 0));
+
+    std::vector<char> value;
+    Append(value, 1.0f);
+    AppendAttribute(header, "pixelAspectRatio", "float", value);
+    AppendAttribute(header, "screenWindowWidth", "float", value);
+    value.clear();
+    Append(value, 0.0f);
+    Append(value, 0.0f);
+    AppendAttribute(header, "screenWindowCenter", "v2f", value);
+    header.push_back('\0');
+
+    // Offset table: every uncompressed scanline is a block of its own
+    const size_t line_data_size = channel_size * 3 * width;
+    const size_t block_size = 8 + line_data_size;
+    uint64_t offset = header.size() + 8 * static_cast<uint64_t>(height);
+    for (int32_t y = 0; y < height; y++)
+        Append(header, offset + block_size * y);
+
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(header.data(), header.size());
+
+    std::vector<char> block;
+    block.reserve(block_size);
+    for (int32_t y = 0; y < height; y++)
+    {
+        block.clear();
+        Append(block, y);
+        Append(block, static_cast<int32_t>(line_data_size));
+        for (int channel = 2; channel >= 0; channel--)
+        {
+            for (int32_t x = 0; x < width; x++)
+            {
+                size_t index = Index(x, y);
+                if (half)
+                    Append(block, half_data[index][channel]._data());
+                else
+                    Append(block, float_data[index][channel]);
+            }
+        }
+        fout.write(block.data(), block.size());
+    }
+    return static_cast<bool>(fout);
+}
+
+bool Framebuffer::SaveTiff(const std::string& filename) const
+{
+    static_assert(sizeof(glm::vec3) == 12 && sizeof(glm::hvec3) == 6, "pixels must be tightly packed");
+
+    // Tiles of the mapped framebuffer are written as they are stored,
+    // tiles of the in-memory one are gathered from the rows
+    const unsigned out_tile_size = tile_size ? tile_size : 64;
+    const unsigned tiles_x = (resolution.x + out_tile_size - 1) / out_tile_size;
+    const unsigned tiles_y = (resolution.y + out_tile_size - 1) / out_tile_size;
+    const size_t tile_count = static_cast<size_t>(tiles_x) * tiles_y;
+    const size_t tile_bytes = static_cast<size_t>(out_tile_size) * out_tile_size * PixelSize();
+
+    // Images over 4 GB need 64-bit offsets of BigTIFF
+    const bool big = tile_count * tile_bytes > 0xF0000000ull;
+    const size_t header_size = big ? 16 : 8;
+
+    std::ofstream fout(filename, std::ios::binary);
+    std::vector<char> header;
+    header.push_back('I');
+    header.push_back('I');
+    if (big)
+    {
+        Append(header, static_cast<uint16_t>(43));
+        Append(header, static_cast<uint16_t>(8));  // size of offsets
+        Append(header, static_cast<uint16_t>(0));
+        Append(header, static_cast<uint64_t>(0)); // offset of the directory, written at the end
+    }
+    else
+    {
+        Append(header, static_cast<uint16_t>(42));
+        Append(header, static_cast<uint32_t>(0));
+    }
+    fout.write(header.data(), header.size());
+
+    std::vector<char> tile;
+    for (unsigned tile_y = 0; tile_y < tiles_y; tile_y++)
+    {
+        for (unsigned tile_x = 0; tile_x < tiles_x; tile_x++)
+        {
+            if (tile_size)
+            {
+                size_t offset = (static_cast<size_t>(tile_y) * tiles_x + tile_x) * tile_bytes;
+                fout.write(mapped_file.GetData() + offset, tile_bytes);
+                mapped_file.Evict(offset, tile_bytes);
+                continue;
+            }
+
+            tile.assign(tile_bytes, 0);
+            glm::uvec2 origin(tile_x * out_tile_size, tile_y * out_tile_size);
+            glm::uvec2 size = glm::min(glm::uvec2(out_tile_size), resolution - origin);
+            for (unsigned y = 0; y < size.y; y++)
+            {
+                const char* row = format == PixelFormat::Float32 ?
+                    reinterpret_cast<const char*>(&float_data[Index(origin.x, origin.y + y)]) :
+                    reinterpret_cast<const char*>(&half_data[Index(origin.x, origin.y + y)]);
+                std::copy(row, row + size.x * PixelSize(), tile.begin() + y * out_tile_size * PixelSize());
+            }
+            fout.write(tile.data(), tile.size());
+        }
+    }
+
+    // Directory entries: tag, type, count and the value itself if it fits in the entry
+    const uint16_t short_type = 3, long_type = 4, long8_type = 16;
+    const size_t value_size = big ? 8 : 4;
+    const uint64_t data_end = header_size + tile_count * tile_bytes;
+    std::vector<char> external;  // values which do not fit, stored before the directory
+    std::vector<char> directory;
+    int entry_count = 0;
+
+    auto add_entry = [&](uint16_t tag, uint16_t type, uint64_t count, const std::vector<char>& value)
+    {
+        Append(directory, tag);
+        Append(directory, type);
+        if (big)
+            Append(directory, count);
+        else
+            Append(directory, static_cast<uint32_t>(count));
+
+        std::vector<char> field(value_size, 0);
+        if (value.size() <= value_size)
+        {
+            std::copy(value.begin(), value.end(), field.begin());
+        }
+        else
+        {
+            uint64_t offset = data_end + external.size();
+            std::copy(reinterpret_cast<const char*>(&offset), reinterpret_cast<const char*>(&offset) + value_size,
+                field.begin());
+            external.insert(external.end(), value.begin(), value.end());
+            if (external.size() % 2)
+                external.push_back(0);
+        }
+        directory.insert(directory.end(), field.begin(), field.end());
+        entry_count++;
+    };
+    auto shorts = [](std::vector<uint16_t> values)
+    {
+        std::vector<char> out;
+        for (uint16_t value : values)
+            Append(out, value);
+        return out;
+    };
+    auto longs = [](uint32_t value)
+    {
+        std::vector<char> out;
+        Append(out, value);
+        return out;
+    };
+
+    std::vector<char> offsets, byte_counts;
+    for (size_t i = 0; i < tile_count; i++)
+    {
+        uint64_t offset = header_size + i * tile_bytes;
+        if (big)
+        {
+            Append(offsets, offset);
+            Append(byte_counts, static_cast<uint64_t>(tile_bytes));
+        }
+        else
+        {
+            Append(offsets, static_cast<uint32_t>(offset));
+            Append(byte_counts, static_cast<uint32_t>(tile_bytes));
+        }
+    }
+
+    const uint16_t bits = format == PixelFormat::Float32 ? 32 : 16;
+    add_entry(256, long_type, 1, longs(resolution.x));  // image width
+    add_entry(257, long_type, 1, longs(resolution.y));  // image length
+    add_entry(258, short_type, 3, shorts({ bits, bits, bits }));  // bits per sample
+    add_entry(259, short_type, 1, shorts({ 1 }));  // no compression
+    add_entry(262, short_type, 1, shorts({ 2 }));  // RGB
+    add_entry(277, short_type, 1, shorts({ 3 }));  // samples per pixel
+    add_entry(284, short_type, 1, shorts({ 1 }));  // interleaved channels
+    add_entry(322, long_type, 1, longs(out_tile_size));  // tile width
+    add_entry(323, long_type, 1, longs(out_tile_size));  // tile length
+    add_entry(324, big ? long8_type : long_type, tile_count, offsets);
+    add_entry(325, big ? long8_type : long_type, tile_count, byte_counts);
+    add_entry(339, short_type, 3, shorts({ 3, 3, 3 }));  // floating point samples
+
+    std::vector<char> entries;
+    if (big)
+        Append(entries, static_cast<uint64_t>(entry_count));
+    else
+        Append(entries, static_cast<uint16_t>(entry_count));
+    entries.insert(entries.end(), directory.begin(), directory.end());
+    entries.insert(entries.end(), value_size, 0);  // no next directory
+
+    uint64_t directory_offset = data_end + external.size();
+    fout.write(external.data(), external.size());
+    fout.write(entries.data(), entries.size());
+
+    fout.seekp(big ? 8 : 4);
+    std::vector<char> offset_field;
+    if (big)
+        Append(offset_field, directory_offset);
+    else
+        Append(offset_field, static_cast<uint32_t>(directory_offset));
+    fout.write(offset_field.data(), offset_field.size());
+    return static_cast<bool>(fout);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+/*
+    Framebuffer.h
+    Linear HDR image produced by renderers
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include "glm/gtc/half_float.hpp"
+#include "MappedFile.h"
+#include <vector>
+#include <string>
+
+// Layout of pixels in the framebuffer
+enum class PixelFormat
+{
+    Float32,  // 12 bytes per pixel
+    Float16   // 6 bytes per pixel, glm::hvec3
+};
+
+// Linear RGB image
+// Colors are stored as they are computed by the renderer, without tone mapping and gamma,
+// so the image can be saved as floating point file and graded later
+// The image is either kept in memory row by row or, for images larger than RAM,
+// in a memory-mapped file tile by tile
+class Framebuffer
+{
+public:
+    // Resize the framebuffer and fill it with black
+    void Allocate(glm::uvec2 resolution, PixelFormat format = PixelFormat::Float32);
+
+    // Keep the image in the file (which is created or overwritten) as a sequence of square tiles,
+    // tile_size is rounded up to a multiple of 16
+    // Tiles are loaded to memory when they are used and may be evicted by FlushRegion
+    bool AllocateMapped(glm::uvec2 resolution, PixelFormat format, const std::string& filename,
+        unsigned tile_size);
+
+    void Set(unsigned x, unsigned y, const glm::vec3& color)
+    {
+        size_t index = Index(x, y);
+        if (format == PixelFormat::Float32)
+            float_data[index] = color;
+        else
+            half_data[index] = glm::hvec3(color);
+    }
+
+    glm::vec3 Get(unsigned x, unsigned y) const
+    {
+        size_t index = Index(x, y);
+        if (format == PixelFormat::Float32)
+            return float_data[index];
+        return glm::vec3(half_data[index]);
+    }
+
+    // Row of the row-major Float32 framebuffer as 3 floats per pixel, nullptr for other layouts
+    const float* FloatRow(unsigned y) const
+    {
+        if (format != PixelFormat::Float32 || tile_size != 0)
+            return nullptr;
+        return &float_data[static_cast<size_t>(y) * resolution.x].x;
+    }
+
+    // Copy a row to 3 floats per pixel
+    void ReadRow(unsigned y, float* out) const
+    {
+        for (unsigned x = 0; x < resolution.x; x++)
+        {
+            glm::vec3 color = Get(x, y);
+            out[x * 3] = color.x;
+            out[x * 3 + 1] = color.y;
+            out[x * 3 + 2] = color.z;
+        }
+    }
+
+    // Write the finished region of the mapped framebuffer to its file and release its memory
+    // Does nothing for framebuffers kept in memory
+    void FlushRegion(glm::uvec2 origin, glm::uvec2 size);
+
+    glm::uvec2 GetResolution() const
+    {
+        return resolution;
+    }
+
+    PixelFormat GetFormat() const
+    {
+        return format;
+    }
+
+    // Save the image to floating point file: .pfm (32-bit), .exr (uncompressed, 16 or 32-bit
+    // depending on the pixel format) or .tif (tiled, 16 or 32-bit)
+    bool SaveToFile(const std::string& filename) const;
+
+    // Check whether the file name has an extension of a floating point format
+    static bool IsFloatFormat(const std::string& filename);
+
+private:
+    size_t Index(unsigned x, unsigned y) const
+    {
+        if (tile_size == 0)
+            return static_cast<size_t>(y) * resolution.x + x;
+        size_t tile = static_cast<size_t>(y / tile_size) * tiles_per_row + x / tile_size;
+        return tile * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size;
+    }
+
+    size_t PixelSize() const
+    {
+        return format == PixelFormat::Float32 ? sizeof(glm::vec3) : sizeof(glm::hvec3);
+    }
+
+    bool SavePfm(const std::string& filename) const;
+    bool SaveExr(const std::string& filename) const;
+    bool SaveTiff(const std::string& filename) const;
+
+    glm::uvec2 resolution;
+    PixelFormat format = PixelFormat::Float32;
+    std::vector<glm::vec3> float_pixels;
+    std::vector<glm::hvec3> half_pixels;
+
+    // Pixels of the current format, either in the vectors or in the mapped file
+    glm::vec3* float_data = nullptr;
+    glm::hvec3* half_data = nullptr;
+
+    MappedFile mapped_file;
+    unsigned tile_size = 0;  // 0 for row-major layout
+    unsigned tiles_per_row = 0;
+};
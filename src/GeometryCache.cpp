@@ -0,0 +1,119 @@
+#include "GeometryCache.h"
+#include "Mesh.h"
+
+GeometryCache::GeometryCache(size_t budget) : budget(budget)
+{
+}
+
+std::shared_ptr<const MeshOctree> GeometryCache::Find(const void* owner, uint32_t index)
+{
+    Key key = { owner, index };
+    Shard& shard = ShardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto found = shard.index.find(key);
+    if (found == shard.index.end())
+        return nullptr;
+    shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+    found->second->last_use = ++use_clock;
+    ++shard.hits;
+    return found->second->cluster;
+}
+
+std::shared_ptr<const MeshOctree> GeometryCache::Insert(const void* owner, uint32_t index,
+    std::unique_ptr<const MeshOctree> cluster, size_t size)
+{
+    Key key = { owner, index };
+    Shard& shard = ShardOf(key);
+    std::shared_ptr<const MeshOctree> inserted;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto found = shard.index.find(key);
+        if (found != shard.index.end())
+        {
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            found->second->last_use = ++use_clock;
+            return found->second->cluster;
+        }
+
+        shard.entries.push_front(Entry{ key, std::shared_ptr<const MeshOctree>(std::move(cluster)), size, ++use_clock });
+        shard.index[key] = shard.entries.begin();
+        ++shard.loads;
+        inserted = shard.entries.front().cluster;
+    }
+
+    // Make room for the new cluster, which is the most recently used one; the shard lock is released,
+    // since the victims may be in any shard
+    // A cluster larger than the budget is still kept, but only until the next insertion
+    resident_bytes += size;
+    while (resident_bytes > budget && resident_bytes > size && EvictOldest())
+    {
+    }
+    return inserted;
+}
+
+bool GeometryCache::EvictOldest()
+{
+    // Find the shard whose least recently used entry is the oldest
+    int oldest = -1;
+    uint64_t oldest_use = 0;
+    for (int i = 0; i < shard_count; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        if (!shards[i].entries.empty() && (oldest < 0 || shards[i].entries.back().last_use < oldest_use))
+        {
+            oldest = i;
+            oldest_use = shards[i].entries.back().last_use;
+        }
+    }
+    if (oldest < 0)
+        return false;
+
+    // The entry may have been used or evicted meanwhile, then the next one is evicted instead
+    Shard& shard = shards[oldest];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.entries.empty())
+        return true;
+    const Entry& victim = shard.entries.back();
+    resident_bytes -= victim.size;
+    shard.index.erase(victim.key);
+    shard.entries.pop_back();
+    ++shard.evictions;
+    return true;
+}
+
+void GeometryCache::Remove(const void* owner)
+{
+    for (Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto entry = shard.entries.begin(); entry != shard.entries.end();)
+        {
+            if (entry->key.owner == owner)
+            {
+                resident_bytes -= entry->size;
+                shard.index.erase(entry->key);
+                entry = shard.entries.erase(entry);
+            }
+            else
+            {
+                ++entry;
+            }
+        }
+    }
+}
+
+GeometryCache::Statistics GeometryCache::GetStatistics() const
+{
+    Statistics statistics;
+    for (const Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        statistics.hits += shard.hits;
+        statistics.loads += shard.loads;
+        statistics.evictions += shard.evictions;
+    }
+    statistics.resident_bytes = resident_bytes;
+    return statistics;
+}
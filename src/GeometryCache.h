@@ -0,0 +1,119 @@
+#pragma once
+
+/*
+    GeometryCache.h
+    Memory budget for geometry loaded from disk while rendering
+    Author: Artyom Bishev
+*/
+
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+class MeshOctree;
+
+// Least recently used clusters of mesh geometry, limited by the total size in bytes
+// Entries are identified by their owner (e.g. a mesh) and an index inside of the owner
+// All methods may be called by several threads at once; evicted clusters stay alive
+// while some thread still holds them
+class GeometryCache
+{
+public:
+    explicit GeometryCache(size_t budget = 1024 * 1024 * 1024);
+
+    GeometryCache(const GeometryCache&) = delete;
+    GeometryCache& operator=(const GeometryCache&) = delete;
+
+    // Limit of the size of the cached clusters; exceeding clusters are evicted on the next insertion
+    void SetBudget(size_t bytes)
+    {
+        budget = bytes;
+    }
+
+    size_t GetBudget() const
+    {
+        return budget;
+    }
+
+    // Cached cluster, nullptr if it is not loaded
+    std::shared_ptr<const MeshOctree> Find(const void* owner, uint32_t index);
+
+    // Put the loaded cluster of the specified size to the cache and return it
+    // If another thread has inserted the same cluster meanwhile, its copy is returned instead
+    std::shared_ptr<const MeshOctree> Insert(const void* owner, uint32_t index,
+        std::unique_ptr<const MeshOctree> cluster, size_t size);
+
+    // Drop all clusters of the owner
+    void Remove(const void* owner);
+
+    struct Statistics
+    {
+        uint64_t hits = 0;
+        uint64_t loads = 0;
+        uint64_t evictions = 0;
+        size_t resident_bytes = 0;
+    };
+
+    Statistics GetStatistics() const;
+
+private:
+    struct Key
+    {
+        const void* owner;
+        uint32_t index;
+        bool operator==(const Key& other) const
+        {
+            return owner == other.owner && index == other.index;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<const void*>()(key.owner) ^ (static_cast<size_t>(key.index) * 0x9E3779B97F4A7C15ull);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        std::shared_ptr<const MeshOctree> cluster;
+        size_t size;
+        uint64_t last_use;  // value of the use clock at the last access
+    };
+
+    // The cache is split into shards with their own locks, so threads reading different clusters
+    // rarely wait for each other; the budget is shared by all shards, and the insertions evict
+    // the least recently used clusters of the whole cache
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::list<Entry> entries;  // the most recently used entry is the first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        uint64_t hits = 0;
+        uint64_t loads = 0;
+        uint64_t evictions = 0;
+    };
+
+    static const int shard_count = 16;
+
+    Shard& ShardOf(const Key& key)
+    {
+        return shards[(KeyHash()(key) >> 8) % shard_count];
+    }
+
+    // Evict the least recently used cluster of all shards
+    // Returns false if the cache is empty
+    bool EvictOldest();
+
+    std::atomic<size_t> budget;
+    std::atomic<size_t> resident_bytes{ 0 };  // total size of the clusters of all shards
+    std::atomic<uint64_t> use_clock{ 0 };  // incremented by every access
+    Shard shards[shard_count];
+};
@@ -0,0 +1,204 @@
+#include "ImageWriter.h"
+#include "Deflate.h"
+#include "Threads.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cctype>
+
+namespace
+{
+    void AppendBigEndian(std::vector<unsigned char>& out, uint32_t value)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back(static_cast<unsigned char>(value >> shift));
+    }
+
+    unsigned char PaethPredictor(int a, int b, int c)
+    {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return static_cast<unsigned char>(a);
+        if (pb <= pc)
+            return static_cast<unsigned char>(b);
+        return static_cast<unsigned char>(c);
+    }
+
+    // Apply the PNG filter which gives the smallest sum of absolute differences
+    // and write the filter type followed by the filtered row to out
+    void FilterRow(const unsigned char* row, const unsigned char* previous, size_t size, unsigned char* out)
+    {
+        const int bpp = 3;
+        bool chosen = false;
+        uint64_t best_cost = 0;
+        std::vector<unsigned char> candidate(size);
+
+        for (int type = 0; type < 5; type++)
+        {
+            uint64_t cost = 0;
+            for (size_t i = 0; i < size; i++)
+            {
+                int left = i >= bpp ? row[i - bpp] : 0;
+                int up = previous ? previous[i] : 0;
+                int up_left = (previous && i >= bpp) ? previous[i - bpp] : 0;
+                int predicted = 0;
+                switch (type)
+                {
+                case 1: predicted = left; break;
+                case 2: predicted = up; break;
+                case 3: predicted = (left + up) / 2; break;
+                case 4: predicted = PaethPredictor(left, up, up_left); break;
+                }
+                candidate[i] = static_cast<unsigned char>(row[i] - predicted);
+                cost += std::abs(static_cast<signed char>(candidate[i]));
+            }
+            if (!chosen || cost < best_cost)
+            {
+                chosen = true;
+                best_cost = cost;
+                out[0] = static_cast<unsigned char>(type);
+                std::copy(candidate.begin(), candidate.end(), out + 1);
+            }
+        }
+    }
+}
+
+bool PpmWriter::Open(const std::string& filename, glm::uvec2 res)
+{
+    resolution = res;
+    rows_written = 0;
+    fout.open(filename, std::ios::binary);
+    fout << "P6\n" << resolution.x << " " << resolution.y << "\n255\n";
+    return static_cast<bool>(fout);
+}
+
+bool PpmWriter::WriteRows(const unsigned char* rgb, unsigned row_count)
+{
+    fout.write(reinterpret_cast<const char*>(rgb), static_cast<std::streamsize>(row_count) * resolution.x * 3);
+    rows_written += row_count;
+    return static_cast<bool>(fout);
+}
+
+bool PpmWriter::Close()
+{
+    fout.close();
+    return rows_written == resolution.y && !fout.fail();
+}
+
+bool PngWriter::Open(const std::string& filename, glm::uvec2 res)
+{
+    resolution = res;
+    rows_written = 0;
+    previous_row.clear();
+    adler = 1;
+
+    fout.open(filename, std::ios::binary);
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fout.write(reinterpret_cast<const char*>(signature), 8);
+
+    std::vector<unsigned char> header;
+    AppendBigEndian(header, resolution.x);
+    AppendBigEndian(header, resolution.y);
+    header.push_back(8); // bit depth
+    header.push_back(2); // RGB
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+    WriteChunk("IHDR", header);
+    return static_cast<bool>(fout);
+}
+
+bool PngWriter::WriteRows(const unsigned char* rgb, unsigned row_count)
+{
+    if (row_count == 0)
+        return true;
+
+    size_t row_size = resolution.x * 3;
+    unsigned segment_rows = std::max(min_segment_rows, (row_count + MaxThreads() - 1) / MaxThreads());
+    int segment_count = static_cast<int>((row_count + segment_rows - 1) / segment_rows);
+
+    std::vector<std::vector<unsigned char>> compressed(segment_count);
+    std::vector<uint32_t> checksums(segment_count);
+    std::vector<size_t> sizes(segment_count);
+
+    // Segments are filtered, deflated and checksummed independently
+    #pragma omp parallel for schedule(dynamic)
+    for (int segment = 0; segment < segment_count; segment++)
+    {
+        unsigned first = segment * segment_rows;
+        unsigned count = std::min(segment_rows, row_count - first);
+
+        std::vector<unsigned char> filtered(count * (row_size + 1));
+        for (unsigned i = 0; i < count; i++)
+        {
+            const unsigned char* row = rgb + (first + i) * row_size;
+            const unsigned char* previous = nullptr;
+            if (first + i > 0)
+                previous = row - row_size;
+            else if (!previous_row.empty())
+                previous = previous_row.data();
+            FilterRow(row, previous, row_size, filtered.data() + i * (row_size + 1));
+        }
+
+        DeflateSegment(filtered.data(), filtered.size(), compressed[segment]);
+        checksums[segment] = Adler32(filtered.data(), filtered.size());
+        sizes[segment] = filtered.size();
+    }
+
+    std::vector<unsigned char> data;
+    if (rows_written == 0)
+    {
+        // zlib header: deflate with 32K window, no dictionary
+        data.push_back(0x78);
+        data.push_back(0x01);
+    }
+    for (int segment = 0; segment < segment_count; segment++)
+    {
+        data.insert(data.end(), compressed[segment].begin(), compressed[segment].end());
+        adler = Adler32Combine(adler, checksums[segment], sizes[segment]);
+    }
+    WriteChunk("IDAT", data);
+
+    previous_row.assign(rgb + (row_count - 1) * row_size, rgb + row_count * row_size);
+    rows_written += row_count;
+    return static_cast<bool>(fout);
+}
+
+bool PngWriter::Close()
+{
+    std::vector<unsigned char> data;
+    if (rows_written == 0)
+    {
+        data.push_back(0x78);
+        data.push_back(0x01);
+    }
+    DeflateFinish(data);
+    AppendBigEndian(data, adler);
+    WriteChunk("IDAT", data);
+    WriteChunk("IEND", std::vector<unsigned char>());
+
+    fout.close();
+    return rows_written == resolution.y && !fout.fail();
+}
+
+void PngWriter::WriteChunk(const char* type, const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> chunk;
+    AppendBigEndian(chunk, static_cast<uint32_t>(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    AppendBigEndian(chunk, Crc32(chunk.data() + 4, chunk.size() - 4));
+    fout.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+std::unique_ptr<ImageWriter> MakeImageWriter(const std::string& filename)
+{
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "png")
+        return std::make_unique<PngWriter>();
+    if (extension == "ppm")
+        return std::make_unique<PpmWriter>();
+    return nullptr;
+}
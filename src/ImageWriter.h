@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+    ImageWriter.h
+    Portable writers of 8-bit RGB images which accept the image row by row
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <cstdint>
+
+// Base class for image writers
+// Rows are passed from top to bottom, 3 bytes (R, G, B) per pixel, without padding
+class ImageWriter
+{
+public:
+    // Create the file and write the header
+    virtual bool Open(const std::string& filename, glm::uvec2 resolution) = 0;
+
+    // Write the next row_count rows of the image
+    virtual bool WriteRows(const unsigned char* rgb, unsigned row_count) = 0;
+
+    // Finish the file; all rows must be written before
+    virtual bool Close() = 0;
+
+    virtual ~ImageWriter() {}
+};
+
+// Binary PPM (P6) writer
+class PpmWriter : public ImageWriter
+{
+public:
+    bool Open(const std::string& filename, glm::uvec2 resolution) override;
+    bool WriteRows(const unsigned char* rgb, unsigned row_count) override;
+    bool Close() override;
+
+private:
+    std::ofstream fout;
+    glm::uvec2 resolution;
+    unsigned rows_written = 0;
+};
+
+// PNG writer
+// Every portion of rows is split into segments which are filtered and deflated in parallel
+class PngWriter : public ImageWriter
+{
+public:
+    bool Open(const std::string& filename, glm::uvec2 resolution) override;
+    bool WriteRows(const unsigned char* rgb, unsigned row_count) override;
+    bool Close() override;
+
+    unsigned min_segment_rows = 8;  // Minimal number of rows compressed by one thread
+
+private:
+    void WriteChunk(const char* type, const std::vector<unsigned char>& data);
+
+    std::ofstream fout;
+    glm::uvec2 resolution;
+    unsigned rows_written = 0;
+    std::vector<unsigned char> previous_row; // last written row, used by PNG filters
+    uint32_t adler = 1; // checksum of the whole zlib stream
+};
+
+// Make writer which suits the extension of the file (.ppm or .png)
+// Returns nullptr for unknown extensions
+std::unique_ptr<ImageWriter> MakeImageWriter(const std::string& filename);
@@ -0,0 +1,82 @@
+#include "IrradianceCache.h"
+
+#include <mutex>
+
+void IrradianceCache::SetAccuracy(double new_accuracy, double new_max_radius)
+{
+    Clear();
+    accuracy = new_accuracy;
+    cell_size = new_accuracy * new_max_radius;
+}
+
+bool IrradianceCache::Interpolate(const glm::dvec3& position, const glm::dvec3& normal, glm::dvec3& irradiance) const
+{
+    glm::dvec3 sum(0.0);
+    double weight_sum = 0.0;
+    glm::ivec3 center = CellOf(position);
+    for (int dx = -1; dx <= 1; ++dx)
+    {
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dz = -1; dz <= 1; ++dz)
+            {
+                glm::ivec3 cell = center + glm::ivec3(dx, dy, dz);
+                const Shard& shard = ShardOf(cell);
+                std::shared_lock<std::shared_mutex> lock(shard.mutex);
+                auto found = shard.cells.find(cell);
+                if (found == shard.cells.end())
+                    continue;
+
+                for (const IrradianceRecord& record : found->second)
+                {
+                    glm::dvec3 offset = position - record.position;
+
+                    // Points in front of the record may see surfaces hidden from it
+                    if (glm::dot(offset, (normal + record.normal) * 0.5) < -0.05 * record.radius)
+                        continue;
+
+                    // Error estimate of Ward: the records are used while the weight exceeds 1 / accuracy
+                    double error = glm::length(offset) / record.radius +
+                        glm::sqrt(glm::max(0.0, 1.0 - glm::dot(normal, record.normal)));
+                    if (error >= accuracy)
+                        continue;
+                    double weight = 1.0 / glm::max(error, 1e-9);
+
+                    glm::dvec3 rotation = glm::cross(record.normal, normal);
+                    glm::dvec3 value = record.irradiance;
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        value[k] += glm::dot(rotation, record.rotational_gradient[k]) +
+                            glm::dot(offset, record.translational_gradient[k]);
+                    }
+                    sum += weight * glm::max(value, glm::dvec3(0.0));
+                    weight_sum += weight;
+                }
+            }
+        }
+    }
+
+    if (weight_sum == 0.0)
+        return false;
+    irradiance = sum / weight_sum;
+    return true;
+}
+
+void IrradianceCache::Insert(const IrradianceRecord& record)
+{
+    glm::ivec3 cell = CellOf(record.position);
+    Shard& shard = ShardOf(cell);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.cells[cell].push_back(record);
+    ++record_count;
+}
+
+void IrradianceCache::Clear()
+{
+    for (Shard& shard : shards)
+    {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.cells.clear();
+    }
+    record_count = 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+/*
+    IrradianceCache.h
+    Sparse irradiance records interpolated over diffuse surfaces
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <atomic>
+#include <cstdint>
+
+// Irradiance sampled over the hemisphere of a point with its gradients (Ward and Heckbert)
+struct IrradianceRecord
+{
+    glm::dvec3 position;
+    glm::dvec3 normal;
+    glm::dvec3 irradiance;
+    double radius;  // harmonic mean distance to the surfaces seen from the point
+
+    // Change of each color channel with the rotation of the normal and with the translation of the point
+    glm::dvec3 rotational_gradient[3];
+    glm::dvec3 translational_gradient[3];
+};
+
+// Irradiance records in a uniform grid of cells split into shards with their own locks,
+// so rendering threads may look up and add records at once
+// A record is used within accuracy * radius of its position, so each record is found
+// through the cells neighbouring its own one
+class IrradianceCache
+{
+public:
+    // Maximal interpolation error; also limits the distance at which the records are used
+    // The size of the cells is accuracy * max_radius, so records must not be larger than max_radius
+    void SetAccuracy(double new_accuracy, double new_max_radius);
+
+    double GetAccuracy() const
+    {
+        return accuracy;
+    }
+
+    // Interpolate the irradiance at the point of the surface with the specified normal
+    // Returns false if no record is close enough
+    bool Interpolate(const glm::dvec3& position, const glm::dvec3& normal, glm::dvec3& irradiance) const;
+
+    void Insert(const IrradianceRecord& record);
+
+    void Clear();
+
+    size_t Size() const
+    {
+        return record_count;
+    }
+
+private:
+    struct CellHash
+    {
+        size_t operator()(const glm::ivec3& cell) const
+        {
+            return (size_t(uint32_t(cell.x)) * 73856093u) ^ (size_t(uint32_t(cell.y)) * 19349663u) ^
+                (size_t(uint32_t(cell.z)) * 83492791u);
+        }
+    };
+
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<glm::ivec3, std::vector<IrradianceRecord>, CellHash> cells;
+    };
+
+    static const int shard_count = 16;
+
+    glm::ivec3 CellOf(const glm::dvec3& position) const
+    {
+        return glm::ivec3(glm::floor(position / cell_size));
+    }
+
+    Shard& ShardOf(const glm::ivec3& cell)
+    {
+        return shards[CellHash()(cell) % shard_count];
+    }
+
+    const Shard& ShardOf(const glm::ivec3& cell) const
+    {
+        return shards[CellHash()(cell) % shard_count];
+    }
+
+    double accuracy = 0.2;
+    double cell_size = 0.2;
+    std::atomic<size_t> record_count{ 0 };
+    Shard shards[shard_count];
+};
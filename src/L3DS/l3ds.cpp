@@ -2,6 +2,7 @@
 //#include "stdafx.h"
 
 #include "l3ds.h"
+#include "../MappedFile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,43 @@ typedef unsigned long ulong;
 
 #define SEEK_START           1900
 #define SEEK_CURSOR          1901
+
+// 3ds files are little endian; the values are read with memcpy, since they are not aligned,
+// and the bytes are swapped only on big endian hosts
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define L3DS_BIG_ENDIAN_HOST
+#endif
+
+static inline unsigned short LoadShort(const unsigned char *p)
+{
+    unsigned short value;
+    memcpy(&value, p, sizeof(value));
+#ifdef L3DS_BIG_ENDIAN_HOST
+    value = (unsigned short)((value >> 8) | (value << 8));
+#endif
+    return value;
+}
+
+static inline unsigned int LoadInt(const unsigned char *p)
+{
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+#ifdef L3DS_BIG_ENDIAN_HOST
+    value = (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+#endif
+    return value;
+}
+
+static inline float LoadFloat(const unsigned char *p)
+{
+#ifdef L3DS_BIG_ENDIAN_HOST
+    unsigned char bytes[4] = { p[3], p[2], p[1], p[0] };
+    p = bytes;
+#endif
+    float value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
              
 // common chunks
 // colors
@@ -423,6 +461,8 @@ void LMesh::SetTriangleArraySize(uint value)
 {
     m_triangles.resize(value);
     m_tris.resize(value);
+    for (uint i=0; i<value; i++)
+        m_tris[i].materialId = LNoMaterial;
 }
 
 const LVector4& LMesh::GetVertex(uint index)
@@ -810,6 +850,49 @@ void LMesh::SetTri(const LTri &tri, uint index)
     m_tris[index] = tri;
 }
 
+void LMesh::SetPackedVertices(const byte *data, uint count)
+{
+    if (count > m_vertices.size())
+        count = m_vertices.size();
+    LVector4 *vertices = m_vertices.data();
+    for (uint i=0; i<count; i++)
+    {
+        const byte *p = data + i*12;
+        vertices[i].x = LoadFloat(p);
+        vertices[i].y = LoadFloat(p + 4);
+        vertices[i].z = LoadFloat(p + 8);
+        vertices[i].w = 1.0f;
+    }
+}
+
+void LMesh::SetPackedUVs(const byte *data, uint count)
+{
+    if (count > m_uv.size())
+        count = m_uv.size();
+    LVector2 *uv = m_uv.data();
+    for (uint i=0; i<count; i++)
+    {
+        uv[i].x = LoadFloat(data + i*8);
+        uv[i].y = LoadFloat(data + i*8 + 4);
+    }
+}
+
+void LMesh::SetPackedTris(const byte *data, uint count)
+{
+    if (count > m_tris.size())
+        count = m_tris.size();
+    for (uint i=0; i<count; i++)
+    {
+        // the fourth short holds the edge visibility flags, which are not used
+        const byte *p = data + i*8;
+        m_tris[i].a = LoadShort(p);
+        m_tris[i].b = LoadShort(p + 2);
+        m_tris[i].c = LoadShort(p + 4);
+        m_tris[i].smoothingGroups = 1;
+        m_tris[i].materialId = LNoMaterial;
+    }
+}
+
 LTri& LMesh::GetTri(uint index)
 {
     return m_tris[index];
@@ -1026,40 +1109,28 @@ L3DS::L3DS(const char *filename)
 
 L3DS::~L3DS()
 {
-    if (m_bufferSize > 0)
-        free(m_buffer);
 }
 
 bool L3DS::LoadFile(const char *filename)
 {
-    FILE *f;
-    f = fopen(filename, "rb");
-    if (f == 0)
+    // the file is mapped instead of being read, so only the pages of the used chunks are loaded
+    MappedFile file;
+    if (!file.Open(filename))
     {
         ErrorMsg("L3DS::LoadFile - cannot open file");
         return false;
     }
-    fseek(f, 0, SEEK_END);
-    m_bufferSize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    m_buffer = (unsigned char*) calloc(m_bufferSize, 1);
-    if (m_buffer == 0)
-    {
-        ErrorMsg("L3DS::LoadFile - not enough memory (malloc failed)");
-        return false;
-    }
-    if (fread(m_buffer, m_bufferSize, 1, f) != 1)
-    {
-        fclose(f);
-        free(m_buffer);
-        m_bufferSize = 0;
-        ErrorMsg("L3DS::LoadFile - error reading from file");
-        return false;
-    }
-    fclose(f);
+    return LoadFromMemory(file.GetData(), (uint)file.GetSize());
+}
+
+bool L3DS::LoadFromMemory(const void *data, uint size)
+{
+    m_buffer = (const unsigned char*) data;
+    m_bufferSize = size;
+    m_pos = 0;
+    m_eof = false;
     Clear();
     bool res = Read3DS();
-    free(m_buffer);
     m_buffer = 0;
     m_bufferSize = 0;
     return res;
@@ -1149,6 +1220,18 @@ int L3DS::ReadASCIIZ(char *buf, int max_count)
     return count;
 }
 
+const byte* L3DS::ReadBlock(uint size)
+{
+    if ((m_buffer==0) || (m_pos > m_bufferSize) || (size > m_bufferSize - m_pos))
+    {
+        m_eof = true;
+        return 0;
+    }
+    const byte *block = m_buffer + m_pos;
+    m_pos += size;
+    return block;
+}
+
 void L3DS::Seek(int offset, int origin)
 {
     if (origin == SEEK_START)
@@ -1372,11 +1455,8 @@ void L3DS::ReadLight(const LChunk &parent)
 
 void L3DS::ReadMesh(const LChunk &parent)
 {
-    unsigned short count, i;
-    LVector4 p;
+    unsigned short count;
     LMatrix4 m;
-    LVector2 t;
-    p.w = 1.0f;
     LMesh mesh;
     mesh.SetName(m_objName);
     GotoChunk(parent);
@@ -1388,24 +1468,16 @@ void L3DS::ReadMesh(const LChunk &parent)
         case TRI_VERTEXLIST:
             count = ReadShort();
             mesh.SetVertexArraySize(count);
-            for (i=0; i < count; i++)
-            {
-                p.x = ReadFloat();
-                p.y = ReadFloat();
-                p.z = ReadFloat();
-                mesh.SetVertex(p, i);
-            }
+            // the whole array is checked once and decoded in place
+            if (const byte *data = ReadBlock(count*12))
+                mesh.SetPackedVertices(data, count);
             break;
         case TRI_FACEMAPPING:
             count = ReadShort();
             if (mesh.GetVertexCount() == 0)
                 mesh.SetVertexArraySize(count);
-            for (i=0; i < count; i++)
-            {
-                t.x = ReadFloat();
-                t.y = ReadFloat();
-                mesh.SetUV(t, i);
-            }
+            if (const byte *data = ReadBlock(count*8))
+                mesh.SetPackedUVs(data, count);
             break;
         case TRI_FACELIST:
             ReadFaceList(chunk, mesh);
@@ -1440,7 +1512,6 @@ void L3DS::ReadFaceList(const LChunk &chunk, LMesh &mesh)
     // variables 
     unsigned short count, t;    
     uint i;
-    LTri tri;
     LChunk ch;
     char str[20];
     //uint mat;
@@ -1452,18 +1523,11 @@ void L3DS::ReadFaceList(const LChunk &chunk, LMesh &mesh)
         return;
     }
     GotoChunk(chunk);
-    tri.smoothingGroups = 1;
     // read the number of faces
     count = ReadShort();
     mesh.SetTriangleArraySize(count);
-    for (i=0; i<count; i++)
-    {
-        tri.a = ReadShort();
-        tri.b = ReadShort();
-        tri.c = ReadShort();
-        ReadShort();
-        mesh.SetTri(tri, i);
-    }
+    if (const byte *data = ReadBlock(count*8))
+        mesh.SetPackedTris(data, count);
     // now read the optional chunks
     ch = ReadChunk();
     while (ch.end <= chunk.end)
@@ -1472,19 +1536,27 @@ void L3DS::ReadFaceList(const LChunk &chunk, LMesh &mesh)
         {
         case TRI_MAT_GROUP: {
                ReadASCIIZ(str, 20);
-               int mat_id = FindMaterial(str)->GetID();
+               // groups of materials missing from the file are skipped
+               LMaterial *mat = FindMaterial(str);
+               if (!mat)
+                   break;
+               int mat_id = mat->GetID();
                mesh.AddMaterial(mat_id);
                count = ReadShort();
-               for (i=0; i<count; i++) {
-                   t = ReadShort();
-                   mesh.GetTri(t).materialId = mat_id;
+               const byte *faces = ReadBlock(count*2);
+               for (i=0; faces && i<count; i++) {
+                   t = LoadShort(faces + i*2);
+                   if (t < mesh.GetTriangleCount())
+                       mesh.GetTri(t).materialId = mat_id;
                }
             }
             break;
 
-        case TRI_SMOOTH_GROUP:
-            for (i=0; i<mesh.GetTriangleCount(); i++)
-                mesh.GetTri(i).smoothingGroups = (ulong) ReadInt();
+        case TRI_SMOOTH_GROUP: {
+               const byte *groups = ReadBlock(mesh.GetTriangleCount()*4);
+               for (i=0; groups && i<mesh.GetTriangleCount(); i++)
+                   mesh.GetTri(i).smoothingGroups = (ulong) LoadInt(groups + i*4);
+            }
             break;
         }
         SkipChunk(ch);
@@ -69,6 +69,9 @@ namespace Loader3ds
         uint end;
     };
 
+    // materialId of the triangles which are in no material group of their mesh
+    const uint LNoMaterial = 0xFFFFFFFF;
+
     struct LTri
     {
         unsigned short a;
@@ -275,6 +278,12 @@ namespace Loader3ds
         void Optimize(LOptimizationLevel value);
         // sets an internal triangle structure with index "index" - for internal use only
         void SetTri(const LTri &tri, uint index);
+        // sets the vertices from "count" packed little endian xyz floats - for internal use
+        void SetPackedVertices(const byte *data, uint count);
+        // sets the texture coordinates from "count" packed little endian uv floats - for internal use
+        void SetPackedUVs(const byte *data, uint count);
+        // sets the triangles from "count" packed little endian (a, b, c, flags) shorts - for internal use
+        void SetPackedTris(const byte *data, uint count);
         // returns the pointer to the internal triangle structure - for internal use only
         LTri& GetTri(uint index);
         // returns the material id with a given index for the mesh
@@ -414,13 +423,15 @@ namespace Loader3ds
         virtual ~L3DS();
         // load 3ds file 
         virtual bool LoadFile(const char *filename);
+        // load 3ds file from memory, the data is parsed in place
+        bool LoadFromMemory(const void *data, uint size);
     protected:
         // used internally for reading
         char m_objName[100];
         // true if end of file is reached
         bool m_eof;
-        // buffer for loading, used for speedup
-        unsigned char *m_buffer;
+        // the file mapped to memory or the data passed to LoadFromMemory
+        const unsigned char *m_buffer;
         // the size of the buffer
         uint m_bufferSize;
         // the current cursor position in the buffer
@@ -438,6 +449,9 @@ namespace Loader3ds
         byte ReadByte();
         //reads an asciiz string 
         int ReadASCIIZ(char *buf, int max_count);
+        // returns the pointer to the next "size" bytes of the buffer and skips them,
+        // or 0 if the buffer is shorter
+        const byte* ReadBlock(uint size);
         // seek wihtin the buffer
         void Seek(int offset, int origin);
         // returns the position of the cursor
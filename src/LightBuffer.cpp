@@ -0,0 +1,157 @@
+#include "LightBuffer.h"
+#include "Mesh.h"
+#include "glm/gtc/constants.hpp"
+
+#include <algorithm>
+#include <limits>
+
+using namespace glm;
+
+namespace
+{
+    // Bounds of the object in the world space; false if they are not known
+    bool WorldBounds(const Object3D& object, BoundingBox& box)
+    {
+        auto* model = dynamic_cast<Model*>(object.surface);
+        if (!model || !model->surface)
+            return false;
+        BoundingBox local;
+        if (dynamic_cast<const Sphere*>(model->surface))
+            local = { { dvec3(-1.0), dvec3(1.0) } };
+        else if (dynamic_cast<const Plane*>(model->surface))
+            local = { { dvec3(-0.5, -0.5, 0.0), dvec3(0.5, 0.5, 0.0) } };
+        else if (auto* mesh = dynamic_cast<const Mesh*>(model->surface))
+            local = mesh->GetBoundingBox();
+        else
+            return false;
+
+        const double inf = std::numeric_limits<double>::infinity();
+        box = { { dvec3(inf), dvec3(-inf) } };
+        for (int corner = 0; corner < 8; corner++)
+        {
+            dvec3 point(local.bounds[corner & 1].x, local.bounds[(corner >> 1) & 1].y, local.bounds[(corner >> 2) & 1].z);
+            point = model->GetModelMatrix() * point + model->GetPosition();
+            box.bounds[0] = glm::min(box.bounds[0], point);
+            box.bounds[1] = glm::max(box.bounds[1], point);
+        }
+        return true;
+    }
+
+    double Angle(const dvec3& a, const dvec3& b)
+    {
+        return std::acos(glm::clamp(glm::dot(a, b), -1.0, 1.0));
+    }
+}
+
+dvec3 LightBuffer::FaceDirection(int face, double u, double v)
+{
+    int axis = face / 2;
+    dvec3 direction;
+    direction[axis] = face % 2 == 0 ? 1.0 : -1.0;
+    direction[(axis + 1) % 3] = u;
+    direction[(axis + 2) % 3] = v;
+    return direction;
+}
+
+int LightBuffer::Cell(const dvec3& direction) const
+{
+    dvec3 size = glm::abs(direction);
+    int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+    if (size[axis] == 0.0)
+        return 0;
+    int face = 2 * axis + (direction[axis] < 0.0 ? 1 : 0);
+    double u = direction[(axis + 1) % 3] / size[axis], v = direction[(axis + 2) % 3] / size[axis];
+    int i = glm::clamp(static_cast<int>((u + 1.0) * 0.5 * resolution), 0, resolution - 1);
+    int j = glm::clamp(static_cast<int>((v + 1.0) * 0.5 * resolution), 0, resolution - 1);
+    return (face * resolution + j) * resolution + i;
+}
+
+void LightBuffer::Build(const dvec3& light_position, std::vector<Object3D>& objects, int new_resolution)
+{
+    const double pi = glm::pi<double>();
+    // Tolerance of the angles, so rays along the borders of the bounds are never missed
+    const double margin = 1e-6;
+    resolution = glm::max(new_resolution, 1);
+    int cell_count = 6 * resolution * resolution;
+
+    // Every cell is bounded by the cone around the direction of its center through its farthest corner
+    std::vector<dvec3> cell_axes(cell_count);
+    std::vector<double> cell_angles(cell_count);
+    double step = 2.0 / resolution;
+    for (int face = 0; face < 6; face++)
+    {
+        for (int j = 0; j < resolution; j++)
+        {
+            for (int i = 0; i < resolution; i++)
+            {
+                int cell = (face * resolution + j) * resolution + i;
+                double u = -1.0 + i * step, v = -1.0 + j * step;
+                dvec3 axis = glm::normalize(FaceDirection(face, u + step * 0.5, v + step * 0.5));
+                double angle = 0.0;
+                for (int corner = 0; corner < 4; corner++)
+                {
+                    dvec3 direction = FaceDirection(face, u + step * (corner & 1), v + step * (corner >> 1));
+                    angle = glm::max(angle, Angle(axis, glm::normalize(direction)));
+                }
+                cell_axes[cell] = axis;
+                cell_angles[cell] = angle;
+            }
+        }
+    }
+
+    // Every object is bounded by the cone of the sphere around its box, as it is seen from the light;
+    // the objects around the light or without bounds are seen in all directions
+    struct Bounded
+    {
+        Object3D* object;
+        dvec3 axis;
+        double angle;
+        double distance;  // from the light to the sphere
+    };
+    std::vector<Bounded> bounded;
+    for (auto& object : objects)
+    {
+        BoundingBox box;
+        if (!WorldBounds(object, box))
+        {
+            bounded.push_back({ &object, dvec3(0.0), pi, 0.0 });
+            continue;
+        }
+        dvec3 center = (box.bounds[0] + box.bounds[1]) * 0.5;
+        double radius = glm::length(box.bounds[1] - box.bounds[0]) * 0.5;
+        double distance = glm::distance(center, light_position);
+        if (distance <= radius * (1.0 + margin))
+            bounded.push_back({ &object, dvec3(0.0), pi, 0.0 });
+        else
+            bounded.push_back({ &object, (center - light_position) / distance, std::asin(radius / distance), distance - radius });
+    }
+    std::stable_sort(bounded.begin(), bounded.end(), [](const Bounded& a, const Bounded& b) {
+        return a.distance < b.distance;
+    });
+
+    std::vector<std::vector<Object3D*>> cells(cell_count);
+    for (auto& item : bounded)
+    {
+        for (int cell = 0; cell < cell_count; cell++)
+        {
+            if (item.angle >= pi || Angle(item.axis, cell_axes[cell]) <= item.angle + cell_angles[cell] + margin)
+                cells[cell].push_back(item.object);
+        }
+    }
+
+    offsets.assign(1, 0);
+    candidates.clear();
+    for (auto& cell : cells)
+    {
+        candidates.insert(candidates.end(), cell.begin(), cell.end());
+        offsets.push_back(static_cast<uint32_t>(candidates.size()));
+    }
+}
+
+LightBuffer::Candidates LightBuffer::Find(const dvec3& direction) const
+{
+    if (offsets.empty())
+        return { nullptr, nullptr };
+    int cell = Cell(direction);
+    return { candidates.data() + offsets[cell], candidates.data() + offsets[cell + 1] };
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+    LightBuffer.h
+    Cube of directions around a point light listing the objects which may block its light (Haines and Greenberg)
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include "Object3D.h"
+#include <vector>
+#include <cstdint>
+
+// Light buffer: every face of a cube around the light is split into resolution x resolution cells,
+// and every cell lists the objects whose bounds are seen from the light in its solid angle, nearest first
+// Only these candidates can block a shadow ray arriving at the light from the directions of the cell
+// The objects without known bounds are listed in all cells
+class LightBuffer
+{
+public:
+    // Objects of a cell
+    struct Candidates
+    {
+        Object3D* const* first;
+        Object3D* const* last;
+        Object3D* const* begin() const
+        {
+            return first;
+        }
+        Object3D* const* end() const
+        {
+            return last;
+        }
+    };
+
+    // Sort the objects into the cells around the light position
+    void Build(const glm::dvec3& light_position, std::vector<Object3D>& objects, int resolution);
+
+    // Candidates of the cell of the direction from the light (not necessarily normalized)
+    Candidates Find(const glm::dvec3& direction) const;
+
+private:
+    // Index of the cell of the direction
+    int Cell(const glm::dvec3& direction) const;
+
+    // Direction of the point of the face with the coordinates in [-1, 1]
+    static glm::dvec3 FaceDirection(int face, double u, double v);
+
+    int resolution = 0;
+    std::vector<uint32_t> offsets;  // candidates of cell i are from offsets[i] to offsets[i + 1]
+    std::vector<Object3D*> candidates;
+};
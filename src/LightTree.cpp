@@ -0,0 +1,123 @@
+#include "LightTree.h"
+
+#include <algorithm>
+
+void LightTree::Build(const std::vector<PointLight>& lights)
+{
+    nodes.clear();
+    if (lights.empty())
+        return;
+
+    std::vector<int> indices(lights.size());
+    for (int i = 0; i < static_cast<int>(lights.size()); i++)
+        indices[i] = i;
+    nodes.reserve(2 * lights.size() - 1);
+    BuildRange(indices, 0, static_cast<int>(indices.size()), lights);
+}
+
+int LightTree::BuildRange(std::vector<int>& indices, int begin, int end, const std::vector<PointLight>& lights)
+{
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    Node node;
+    node.lower = node.upper = lights[indices[begin]].center;
+    node.power = 0.0;
+    for (int i = begin; i < end; i++)
+    {
+        const PointLight& light = lights[indices[i]];
+        node.lower = glm::min(node.lower, light.center);
+        node.upper = glm::max(node.upper, light.center);
+        node.power += (light.color.x + light.color.y + light.color.z) / 3.0;
+    }
+    node.right = -1;
+    node.light = indices[begin];
+
+    if (end - begin > 1)
+    {
+        glm::dvec3 extent = node.upper - node.lower;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        int median = begin + (end - begin) / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + median, indices.begin() + end,
+            [&lights, axis](int a, int b) { return lights[a].center[axis] < lights[b].center[axis]; });
+
+        BuildRange(indices, begin, median, lights);
+        node.right = BuildRange(indices, median, end, lights);
+    }
+    nodes[index] = node;
+    return index;
+}
+
+double LightTree::Importance(const Node& node, const glm::dvec3& position, const glm::dvec3& normal,
+    double& bound) const
+{
+    bound = 0.0;
+    if (node.power <= 0.0)
+        return 0.0;
+
+    // The cosine at the point is bounded by the cone of directions to the bounding sphere of the box
+    glm::dvec3 center = (node.lower + node.upper) * 0.5;
+    double radius2 = glm::dot(node.upper - center, node.upper - center);
+    glm::dvec3 offset = center - position;
+    double distance2 = glm::dot(offset, offset);
+    double cos_bound = 1.0;
+    if (distance2 > radius2)
+    {
+        double cos_center = glm::dot(normal, offset) / glm::sqrt(distance2);
+        double sin_center = glm::sqrt(glm::max(0.0, 1.0 - cos_center * cos_center));
+        double sin_cone = glm::sqrt(radius2 / distance2), cos_cone = glm::sqrt(1.0 - sin_cone * sin_cone);
+        // cos(max(0, angle to the center - angle of the cone))
+        if (cos_center < cos_cone)
+            cos_bound = cos_center * cos_cone + sin_center * sin_cone;
+        if (cos_bound <= 0.0)
+            return 0.0;
+    }
+
+    glm::dvec3 nearest = glm::clamp(position, node.lower, node.upper);
+    double nearest2 = glm::max(glm::dot(nearest - position, nearest - position), 1e-12);
+    bound = node.power * cos_bound / nearest2;
+
+    // The distance to the center is not allowed under the size of the node,
+    // so the nodes around the point share its importance evenly
+    return node.power * cos_bound / glm::max(distance2, radius2);
+}
+
+int LightTree::Sample(const glm::dvec3& position, const glm::dvec3& normal, double cull_fraction,
+    double u, double& probability) const
+{
+    probability = 1.0;
+    double bound;
+    if (nodes.empty() || Importance(nodes[0], position, normal, bound) == 0.0)
+        return -1;
+
+    int index = 0;
+    while (nodes[index].right >= 0)
+    {
+        int left = index + 1, right = nodes[index].right;
+        double left_bound, right_bound;
+        double left_importance = Importance(nodes[left], position, normal, left_bound);
+        double right_importance = Importance(nodes[right], position, normal, right_bound);
+        if (left_bound < cull_fraction * right_importance)
+            left_importance = 0.0;
+        else if (right_bound < cull_fraction * left_importance)
+            right_importance = 0.0;
+        double total = left_importance + right_importance;
+        if (total == 0.0)
+            return -1;
+
+        // The random number is rescaled to the chosen part, so one number is enough for the whole descent
+        double left_probability = left_importance / total;
+        if (u < left_probability)
+        {
+            u = glm::min(u / left_probability, 1.0 - 1e-12);
+            probability *= left_probability;
+            index = left;
+        }
+        else
+        {
+            u = glm::min((u - left_probability) / (1.0 - left_probability), 1.0 - 1e-12);
+            probability *= 1.0 - left_probability;
+            index = right;
+        }
+    }
+    return nodes[index].light;
+}
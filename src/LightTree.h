@@ -0,0 +1,56 @@
+#pragma once
+
+/*
+    LightTree.h
+    Hierarchy of the point lights used to sample a few of many lights
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include "Types.h"
+#include <vector>
+
+// Binary tree of the point lights built by the median splits of the widest axis of their positions
+// Every node keeps the bounding box and the total power of its lights, which bound the light
+// the node may bring to a point; a light is picked by descending from the root to a leaf
+// choosing the child by its estimated contribution
+class LightTree
+{
+public:
+    // Build the tree of the lights; the lights must stay alive and unchanged while the tree is used
+    void Build(const std::vector<PointLight>& lights);
+
+    void Clear()
+    {
+        nodes.clear();
+    }
+
+    bool Empty() const
+    {
+        return nodes.empty();
+    }
+
+    // Pick a light for the surface point with the specified normal by the random number u in [0, 1)
+    // A node is culled when even its nearest point can bring less than cull_fraction of the light
+    // estimated for its sibling, so the lights far behind the near ones are never picked
+    // Returns the index of the light and the probability it was picked with, or -1 if no light faces the point
+    int Sample(const glm::dvec3& position, const glm::dvec3& normal, double cull_fraction,
+        double u, double& probability) const;
+
+private:
+    struct Node
+    {
+        glm::dvec3 lower, upper;  // bounds of the light positions
+        double power;  // sum of the mean color components of the lights
+        int right;  // index of the right child (the left one follows the node), or -1 for a leaf
+        int light;  // index of the light of a leaf
+    };
+
+    int BuildRange(std::vector<int>& indices, int begin, int end, const std::vector<PointLight>& lights);
+
+    // Estimated light of the node at the point and its upper bound by the nearest point of the node,
+    // both zero if the lights are behind the surface
+    double Importance(const Node& node, const glm::dvec3& position, const glm::dvec3& normal, double& bound) const;
+
+    std::vector<Node> nodes;
+};
@@ -1,20 +1,246 @@
 #include "Renderer.h"
 #include "SceneParser.h"
+#include "SceneBundle.h"
 #include "fstream"
 #include "iostream"
+#include <cstdlib>
+#include <memory>
 
-void main(int argc, char** argv)
+namespace
 {
-    RayTracer tracer;
+    // Copy the materials of the edited scene which differ from the materials of the same names to the scene
+    // Returns the changed materials of the scene
+    SceneEntities CopyChangedMaterials(const Scene& edited, Scene& scene)
+    {
+        SceneEntities changes;
+        for (const auto& material : edited.surface_materials)
+        {
+            auto found = scene.surface_materials.find(material.first);
+            if (found != scene.surface_materials.end() && !(*found->second == *material.second))
+            {
+                *found->second = *material.second;
+                changes.surface_materials.insert(found->second.get());
+            }
+        }
+        for (const auto& material : edited.inside_materials)
+        {
+            auto found = scene.inside_materials.find(material.first);
+            if (found != scene.inside_materials.end() && !(*found->second == *material.second))
+            {
+                *found->second = *material.second;
+                changes.inside_materials.insert(found->second.get());
+            }
+        }
+        return changes;
+    }
+
+    // Tone mapping operator of the specified name
+    // Returns false if the name is unknown
+    bool ParseToneMapping(const std::string& name, ToneMapping& tone_mapping)
+    {
+        static const std::pair<const char*, ToneMapping> names[] = {
+            { "clamp", ToneMapping::Clamp },
+            { "reinhard", ToneMapping::Reinhard },
+            { "reinhard-extended", ToneMapping::ReinhardExtended },
+            { "filmic", ToneMapping::Filmic },
+            { "aces", ToneMapping::Aces }
+        };
+        for (const auto& entry : names)
+        {
+            if (name == entry.first)
+            {
+                tone_mapping = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+// Usage: RayTracer [--compile bundle | --bundle bundle] [--geometry-budget megabytes] [--photons count] [--caustic-photons count] [--progressive passes] [--irradiance-cache samples] [--light-samples count] [--path-tracing samples [--path-guiding]] [--bidirectional samples] [--light-buffer cells] [--numa [--numa-replicate]] [--background r g b] [--output image] [--half] [--framebuffer-file file] [--exposure stops] [--tone-map operator [--white-point value]] [--dither] [--rerender scene] [config]
+// --compile writes scene.txt with built octrees to the bundle file and exits,
+// --bundle renders the compiled bundle instead of scene.txt,
+// --geometry-budget limits the memory used by the clusters of streamed meshes,
+// --photons enables the indirect illumination by a photon map of the specified number of emitted photons,
+// --caustic-photons enables the caustics by a photon map of the photons emitted towards specular objects,
+// --progressive renders by progressive photon mapping with the specified number of passes (of --photons photons),
+// --irradiance-cache enables the indirect diffuse light by irradiance records of the specified number of rays,
+// --light-samples samples the specified number of lights per point from the light tree instead of summing all lights,
+// --path-tracing renders by path tracing with the specified number of samples per pixel,
+// --path-guiding makes the path tracer learn the incident light in passes and sample its bounces by it,
+// --bidirectional renders by bidirectional path tracing with the specified number of samples per pixel,
+// --light-buffer makes the shadow rays of the path tracers test only the objects listed by light buffers
+//   of the specified number of cells along a cube edge,
+// --numa pins the render threads to NUMA nodes in contiguous blocks,
+// --numa-replicate also copies the mesh octrees to the memory of every node (once per scene),
+// --background sets the color of the background (the sky of the path tracer),
+// --output sets the image file (Result.png by default): .png and .ppm are written row by row during rendering,
+//   .pfm, .exr and .tif keep the linear colors and are saved after rendering,
+// --half keeps the linear colors as 16-bit floats (also in .exr and .tif files),
+// --framebuffer-file keeps the framebuffer in the specified memory-mapped file tile by tile,
+//   for images larger than RAM (best saved to a tiled .tif),
+// --exposure corrects the exposure of 8-bit images by the specified number of stops,
+// --tone-map maps the colors of 8-bit images by clamp (default), reinhard, reinhard-extended, filmic or aces,
+// --white-point sets the smallest value mapped to white by reinhard-extended and filmic,
+// --dither adds blue noise to 8-bit images before quantization to hide banding,
+// --rerender takes the materials changed in the specified scene file after the image is rendered
+//   and rerenders only the tiles which see them to the output image
+int main(int argc, char** argv)
+{
+    std::string compile_path, bundle_path, config_path, rerender_path, framebuffer_path, output_path = "Result.png";
+    size_t geometry_budget = 0;
+    int photon_count = 0, caustic_photon_count = 0, progressive_passes = 0, irradiance_samples = 0, light_samples = 0, path_samples = 0, bidirectional_samples = 0;
+    int light_buffer_resolution = 0;
+    bool path_guiding = false, numa_aware = false, numa_replicate = false, half_floats = false;
+    PostProcessor post_process;
+    glm::dvec3 background(0.0);
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--compile" && i + 1 < argc)
+            compile_path = argv[++i];
+        else if (arg == "--bundle" && i + 1 < argc)
+            bundle_path = argv[++i];
+        else if (arg == "--geometry-budget" && i + 1 < argc)
+            geometry_budget = static_cast<size_t>(std::atof(argv[++i]) * 1024 * 1024);
+        else if (arg == "--photons" && i + 1 < argc)
+            photon_count = std::atoi(argv[++i]);
+        else if (arg == "--caustic-photons" && i + 1 < argc)
+            caustic_photon_count = std::atoi(argv[++i]);
+        else if (arg == "--progressive" && i + 1 < argc)
+            progressive_passes = std::atoi(argv[++i]);
+        else if (arg == "--irradiance-cache" && i + 1 < argc)
+            irradiance_samples = std::atoi(argv[++i]);
+        else if (arg == "--light-samples" && i + 1 < argc)
+            light_samples = std::atoi(argv[++i]);
+        else if (arg == "--path-tracing" && i + 1 < argc)
+            path_samples = std::atoi(argv[++i]);
+        else if (arg == "--path-guiding")
+            path_guiding = true;
+        else if (arg == "--bidirectional" && i + 1 < argc)
+            bidirectional_samples = std::atoi(argv[++i]);
+        else if (arg == "--light-buffer" && i + 1 < argc)
+            light_buffer_resolution = std::atoi(argv[++i]);
+        else if (arg == "--numa")
+            numa_aware = true;
+        else if (arg == "--numa-replicate")
+            numa_aware = numa_replicate = true;
+        else if (arg == "--output" && i + 1 < argc)
+            output_path = argv[++i];
+        else if (arg == "--half")
+            half_floats = true;
+        else if (arg == "--framebuffer-file" && i + 1 < argc)
+            framebuffer_path = argv[++i];
+        else if (arg == "--exposure" && i + 1 < argc)
+            post_process.exposure = std::atof(argv[++i]);
+        else if (arg == "--tone-map" && i + 1 < argc)
+        {
+            if (!ParseToneMapping(argv[++i], post_process.tone_mapping))
+            {
+                std::cout << "Unknown tone mapping operator \"" << argv[i] << "\"\n";
+                return 1;
+            }
+        }
+        else if (arg == "--white-point" && i + 1 < argc)
+            post_process.white_point = std::atof(argv[++i]);
+        else if (arg == "--dither")
+            post_process.dither = true;
+        else if (arg == "--rerender" && i + 1 < argc)
+            rerender_path = argv[++i];
+        else if (arg == "--background" && i + 3 < argc)
+        {
+            for (int k = 0; k < 3; k++)
+                background[k] = std::atof(argv[++i]);
+        }
+        else
+            config_path = arg;
+    }
+
+    std::unique_ptr<RayTracer> tracer;
+    if (progressive_passes > 0)
+    {
+        auto progressive = std::make_unique<ProgressivePhotonMapper>();
+        progressive->passCount = progressive_passes;
+        if (photon_count > 0)
+            progressive->photonsPerPass = photon_count;
+        tracer = std::move(progressive);
+    }
+    else if (bidirectional_samples > 0)
+    {
+        tracer = std::make_unique<BidirectionalPathTracer>();
+        tracer->samplesPerPixel = bidirectional_samples;
+    }
+    else if (path_samples > 0)
+    {
+        auto unidirectional = std::make_unique<PathTracer>();
+        unidirectional->samplesPerPixel = path_samples;
+        unidirectional->pathGuiding = path_guiding;
+        tracer = std::move(unidirectional);
+    }
+    else
+    {
+        tracer = std::make_unique<RayTracer>();
+        tracer->photonCount = photon_count;
+        tracer->causticPhotonCount = caustic_photon_count;
+        tracer->irradianceCaching = irradiance_samples > 0;
+        if (irradiance_samples > 0)
+            tracer->irradianceSamples = irradiance_samples;
+    }
+    tracer->backgroundColor = background;
+    tracer->numaAware = numa_aware;
+    tracer->numaReplicateScene = numa_replicate;
+    tracer->trackTileDependencies = !rerender_path.empty();
+    tracer->pixelFormat = half_floats ? PixelFormat::Float16 : PixelFormat::Float32;
+    tracer->framebufferFile = framebuffer_path;
+    tracer->postProcess = post_process;
+    tracer->lightTreeSampling = light_samples > 0;
+    if (light_samples > 0)
+        tracer->lightSamples = light_samples;
+    auto* path_tracer = dynamic_cast<PathTracer*>(tracer.get());
+    if (path_tracer)
+        path_tracer->lightBufferResolution = light_buffer_resolution;
     Scene scene;
-    SceneParser parser;
-    parser.Parse("scene.txt", &scene);
+    SceneBundle bundle;
+    if (geometry_budget != 0)
+        scene.geometry_cache.SetBudget(geometry_budget);
+    if (!bundle_path.empty())
+    {
+        if (!bundle.Read(bundle_path, &scene))
+        {
+            std::cout << bundle.GetError() << "\n";
+            return 1;
+        }
+    }
+    else
+    {
+        try
+        {
+            SceneParser parser;
+            parser.Parse("scene.txt", &scene);
+        }
+        catch (const SyntaxError& error)
+        {
+            std::cout << error.what() << "\n";
+            return 1;
+        }
+    }
+
+    if (!compile_path.empty())
+    {
+        if (!bundle.Write(&scene, compile_path))
+        {
+            std::cout << bundle.GetError() << "\n";
+            return 1;
+        }
+        std::cout << "Scene was compiled to \"" << compile_path << "\"\n";
+        return 0;
+    }
 
     glm::uvec2 resolution = glm::uvec2(800, 600);  // Default resolution
 
-    if(argc == 2) // There is input file in parameters
+    if (!config_path.empty()) // There is input file in parameters
     {
-        std::ifstream filestream(argv[1]);
+        std::ifstream filestream(config_path);
         if (filestream)
         {
             filestream >> resolution.x >> resolution.y;
@@ -26,9 +252,57 @@ void main(int argc, char** argv)
     else
         printf("No config! Using default parameters.\r\n");
 
-    tracer.scene = &scene;
-    tracer.camera.position = glm::dvec3(0.0, 0.0, 0.0);
-    tracer.camera.orientation = glm::dvec3(5.0, 0.0, 0.0);
-    tracer.Render(resolution);
-    tracer.SaveImageToFile("Result.png");
+    tracer->scene = &scene;
+    tracer->camera.position = glm::dvec3(0.0, 0.0, 0.0);
+    tracer->camera.orientation = glm::dvec3(5.0, 0.0, 0.0);
+
+    // Rows of 8-bit images are written as soon as they are rendered, floating point images are saved after rendering
+    bool float_output = Framebuffer::IsFloatFormat(output_path);
+    std::unique_ptr<ImageWriter> output;
+    if (!float_output)
+    {
+        output = MakeImageWriter(output_path);
+        if (output && output->Open(output_path, resolution))
+            tracer->imageStream = output.get();
+        else
+            std::cout << "Cannot create " << output_path << "\n";
+    }
+
+    tracer->Render(resolution);
+    if (tracer->imageStream)
+        output->Close();
+    else if (float_output && !tracer->SaveImageToFile(output_path))
+        std::cout << "Cannot create " << output_path << "\n";
+
+    if (!rerender_path.empty())
+    {
+        Scene edited;
+        try
+        {
+            SceneParser parser;
+            parser.Parse(rerender_path, &edited);
+        }
+        catch (const SyntaxError& error)
+        {
+            std::cout << error.what() << "\n";
+            return 1;
+        }
+        int changed_tiles = tracer->RenderChanged(CopyChangedMaterials(edited, scene));
+        std::cout << "Rerendered " << changed_tiles << " of " << tracer->tiles.size() << " tiles\n";
+        if (!tracer->SaveImageToFile(output_path))
+            std::cout << "Cannot create " << output_path << "\n";
+    }
+
+    if (tracer->irradianceCaching)
+        std::cout << "Irradiance cache: " << tracer->irradianceCache.Size() << " records\n";
+    if (path_tracer && path_tracer->pathGuiding)
+        std::cout << "Path guiding: " << path_tracer->guidingTree.LeafCount() << " spatial leaves\n";
+
+    GeometryCache::Statistics statistics = scene.geometry_cache.GetStatistics();
+    if (statistics.loads != 0)
+    {
+        std::cout << "Mesh clusters: " << statistics.loads << " loads, " << statistics.hits << " hits, "
+            << statistics.evictions << " evictions, " << statistics.resident_bytes / (1024 * 1024) << " MB resident\n";
+    }
+    return 0;
 }
@@ -0,0 +1,228 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+    size_t PageSize()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string& filename)
+{
+    Close();
+    file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE)
+    {
+        file_handle = nullptr;
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size))
+    {
+        Close();
+        return false;
+    }
+    size = static_cast<size_t>(file_size.QuadPart);
+    is_open = true;
+    if (size == 0)
+        return true;
+
+    mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_handle)
+        data = static_cast<char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if (!data)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool MappedFile::Create(const std::string& filename, size_t new_size)
+{
+    Close();
+    file_handle = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE)
+    {
+        file_handle = nullptr;
+        return false;
+    }
+    size = new_size;
+    writable = true;
+    is_open = true;
+    if (size == 0)
+        return true;
+
+    // The mapping extends the file to its size, the new part is filled with zeros
+    unsigned long long mapping_size = size;
+    mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(mapping_size >> 32), static_cast<DWORD>(mapping_size), nullptr);
+    if (mapping_handle)
+        data = static_cast<char*>(MapViewOfFile(mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!data)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data)
+    {
+        if (writable)
+            FlushViewOfFile(data, 0);
+        UnmapViewOfFile(data);
+    }
+    if (mapping_handle)
+        CloseHandle(mapping_handle);
+    if (file_handle)
+        CloseHandle(file_handle);
+
+    data = nullptr;
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+    size = 0;
+    is_open = false;
+    writable = false;
+}
+
+void MappedFile::Flush(size_t offset, size_t length)
+{
+    if (writable && AlignRange(offset, length))
+        FlushViewOfFile(data + offset, length);
+}
+
+void MappedFile::Evict(size_t offset, size_t length) const
+{
+    // Unlocking pages which are not locked removes them from the working set of the process
+    if (AlignRange(offset, length))
+        VirtualUnlock(data + offset, length);
+}
+
+#else
+
+bool MappedFile::Open(const std::string& filename)
+{
+    Close();
+    file_descriptor = open(filename.c_str(), O_RDONLY);
+    if (file_descriptor < 0)
+        return false;
+
+    struct stat file_stat;
+    if (fstat(file_descriptor, &file_stat) != 0)
+    {
+        Close();
+        return false;
+    }
+    size = static_cast<size_t>(file_stat.st_size);
+    is_open = true;
+    if (size == 0)
+        return true;
+
+    void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    if (address == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    data = static_cast<char*>(address);
+    return true;
+}
+
+bool MappedFile::Create(const std::string& filename, size_t new_size)
+{
+    Close();
+    file_descriptor = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_descriptor < 0)
+        return false;
+
+    // Extending the file does not allocate its blocks, so untouched parts take no disk space
+    if (ftruncate(file_descriptor, static_cast<off_t>(new_size)) != 0)
+    {
+        Close();
+        return false;
+    }
+    size = new_size;
+    writable = true;
+    is_open = true;
+    if (size == 0)
+        return true;
+
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+    if (address == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    data = static_cast<char*>(address);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data)
+        munmap(data, size);
+    if (file_descriptor >= 0)
+        close(file_descriptor);
+
+    data = nullptr;
+    file_descriptor = -1;
+    size = 0;
+    is_open = false;
+    writable = false;
+}
+
+void MappedFile::Flush(size_t offset, size_t length)
+{
+    if (writable && AlignRange(offset, length))
+        msync(data + offset, length, MS_ASYNC);
+}
+
+void MappedFile::Evict(size_t offset, size_t length) const
+{
+    // Pages of shared mappings are dropped without losing the data, it stays in the file
+    if (AlignRange(offset, length))
+        madvise(data + offset, length, MADV_DONTNEED);
+}
+
+#endif
+
+bool MappedFile::AlignRange(size_t& offset, size_t& length) const
+{
+    if (!data || offset >= size)
+        return false;
+
+    size_t page = PageSize();
+    size_t end = offset + length < size ? offset + length : size;
+    offset -= offset % page;
+    length = end - offset;
+    return length > 0;
+}
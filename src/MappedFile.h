@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+    MappedFile.h
+    Files mapped to memory, for data which should not be read or kept in RAM as a whole
+    Author: Artyom Bishev
+*/
+
+#include <string>
+#include <cstddef>
+
+// File mapped to the address space of the process
+// Pages are loaded by the system when they are touched and may be written back and dropped
+// with Flush and Evict, so files larger than RAM can be used
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Map an existing file for reading
+    bool Open(const std::string& filename);
+
+    // Create (or truncate) the file of the specified size filled with zeros and map it for reading and writing
+    bool Create(const std::string& filename, size_t size);
+
+    // Unmap the file; changes of writable files are kept in the file
+    void Close();
+
+    bool IsOpen() const
+    {
+        return is_open;
+    }
+
+    const char* GetData() const
+    {
+        return data;
+    }
+
+    char* GetData()
+    {
+        return data;
+    }
+
+    size_t GetSize() const
+    {
+        return size;
+    }
+
+    // Write the changed pages of the range back to the file
+    void Flush(size_t offset, size_t length);
+
+    // Release the memory of the pages of the range; they are read again when touched
+    // Pages of writable files should be flushed first
+    void Evict(size_t offset, size_t length) const;
+
+private:
+    // Extend the range to the page boundaries, clipping it by the file size
+    bool AlignRange(size_t& offset, size_t& length) const;
+
+    char* data = nullptr;
+    size_t size = 0;
+    bool is_open = false;  // empty files are open, but have no data
+    bool writable = false;
+
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#else
+    int file_descriptor = -1;
+#endif
+};
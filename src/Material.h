@@ -6,7 +6,7 @@
     Author: Artyom Bishev
 */
 
-#include "glm\glm.hpp"
+#include "glm/glm.hpp"
 #include "Types.h"
 
 // Basic surface material
@@ -19,6 +19,12 @@ public:
     glm::dvec3 reflective_color;   // color of reflecions
     glm::dvec3 transparency_color; // color of transparency
 
+    bool operator==(const SurfaceMaterial& other) const
+    {
+        return shininess == other.shininess && specular == other.specular && diffuse == other.diffuse &&
+            reflective_color == other.reflective_color && transparency_color == other.transparency_color;
+    }
+
     glm::dvec3 Color(
         const glm::dvec3& normal,
         const glm::dvec3& point,
@@ -70,6 +76,11 @@ class InsideMaterial
 public:
     double refractive_index = 1.0; // refractive index
     //glm::dvec3 color; // color of inside
+
+    bool operator==(const InsideMaterial& other) const
+    {
+        return refractive_index == other.refractive_index;
+    }
 };
 
 // Calculate percentage of reflected energy (opposite to the amount of refracted energy) 
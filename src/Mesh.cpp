@@ -1,17 +1,159 @@
 #include "Mesh.h"
+#include "MeshClusters.h"
+#include "MeshData.h"
+#include "MeshLoaders.h"
 
-Poly LTriangle2ToPoly(const Loader3ds::LTriangle2& tri)
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+    std::string Extension(const std::string& filename)
+    {
+        std::string extension = filename.substr(filename.find_last_of('.') + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension;
+    }
+}
+
+MeshTriangle LTriangle2ToTriangle(const Loader3ds::LTriangle2& tri, uint32_t material)
 {
-    Poly poly;
+    MeshTriangle triangle;
     for (int k = 0; k < 3; ++k)
     {
-        poly.vertices[k] = LVectorTodvec3(tri.vertices[k]);
-        poly.normals[k] = LVectorTodvec3(tri.vertexNormals[k]);
+        triangle.vertices[k] = LVectorTodvec3(tri.vertices[k]);
+        triangle.normals[k] = LVectorTodvec3(tri.vertexNormals[k]);
     }
-    return poly;
+    triangle.material = material;
+    triangle.reserved = 0;
+    return triangle;
 }
 
 bool Mesh::LoadFromFile(const std::string& filename, int mesh_name)
+{
+    if (mesh_name < 0)
+        return false;
+    std::string extension = Extension(filename);
+    if (extension == "obj" || extension == "ply")
+    {
+        // These files contain a single mesh
+        if (mesh_name != 0)
+        {
+            std::cout << "There is no mesh " << mesh_name << " in the file\n";
+            return false;
+        }
+        return LoadIndexed(filename, false);
+    }
+    return Load3ds(filename, mesh_name);
+}
+
+bool Mesh::LoadAllFromFile(const std::string& filename)
+{
+    std::string extension = Extension(filename);
+    if (extension == "obj" || extension == "ply")
+        return LoadIndexed(filename, true);
+    return Load3ds(filename, -1);
+}
+
+bool Mesh::LoadIndexed(const std::string& filename, bool keep_materials)
+{
+    std::cout << "Loading model: \"" << filename << "\"\n";
+    MeshData data;
+    bool loaded;
+    std::string error;
+    if (Extension(filename) == "obj")
+    {
+        ObjLoader loader;
+        loaded = loader.Load(filename, data);
+        error = loader.GetError();
+    }
+    else
+    {
+        PlyLoader loader;
+        loaded = loader.Load(filename, data);
+        error = loader.GetError();
+    }
+    if (!loaded)
+    {
+        std::cout << "Error occured while loading the file: " << error << "\n";
+        return false;
+    }
+    if (!data.IsValid())
+    {
+        std::cout << "Error occured while loading the file: faces refer to missing vertices\n";
+        return false;
+    }
+    std::cout << "Number of vertices: " << data.position_count << "\n";
+
+    file_materials.clear();
+    bool has_materials = keep_materials && !data.triangle_materials.empty();
+    if (keep_materials)
+        file_materials = data.materials;
+
+    // Obtain bounding box of the vertices used by the triangles
+    // The positions are read in parallel, since the loaded files have millions of them
+    int triangle_count = static_cast<int>(data.triangle_count);
+    glm::dvec3 lower(std::numeric_limits<double>::max()), upper(-std::numeric_limits<double>::max());
+    #pragma omp parallel
+    {
+        glm::dvec3 local_lower = lower, local_upper = upper;
+        #pragma omp for nowait
+        for (int i = 0; i < triangle_count; i++)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                glm::dvec3 coord = data.GetPosition(data.GetPositionIndex(i, k));
+                local_lower = glm::min(local_lower, coord);
+                local_upper = glm::max(local_upper, coord);
+            }
+        }
+        #pragma omp critical
+        {
+            lower = glm::min(lower, local_lower);
+            upper = glm::max(upper, local_upper);
+        }
+    }
+    if (triangle_count == 0)
+        lower = upper = glm::dvec3(0.0);
+    octree_box.bounds[0] = lower;
+    octree_box.bounds[1] = upper;
+
+    // Meshes loaded on demand keep the declared bounds, since other threads are already reading them
+    if (!on_demand)
+    {
+        bounding_box = octree_box;
+    }
+    else if (!bounding_box.Contains(octree_box))
+    {
+        std::cout << "Warning: declared bounds of \"" << filename << "\" do not contain the whole mesh\n";
+    }
+
+    // Load mesh data to octree
+    MeshOctreeNode root_node;
+    for (int i = 0; i < triangle_count; ++i)
+    {
+        MeshTriangle triangle;
+        for (int k = 0; k < 3; ++k)
+        {
+            triangle.vertices[k] = data.GetPosition(data.GetPositionIndex(i, k));
+            triangle.normals[k] = data.GetNormal(data.GetNormalIndex(i, k));
+        }
+        triangle.material = has_materials ? data.triangle_materials[i] : MeshTriangle::no_material;
+        triangle.reserved = 0;
+        root_node.AddPoly(triangle, octree_box);
+    }
+    triangles_count = triangle_count;
+    auto octree = std::make_unique<MeshOctree>();
+    octree->Build(root_node);
+    octree->SetMaterials(materials.data(), materials.size());
+    root = std::move(octree);
+
+    std::cout << "Model was successfully loaded. Number of polys: " << triangles_count << std::endl;
+    return true;
+}
+
+bool Mesh::Load3ds(const std::string& filename, int mesh_name)
 {
     std::cout << "Loading model: \"" << filename << "\"\n";
     Loader3ds::L3DS loader;
@@ -23,37 +165,167 @@ bool Mesh::LoadFromFile(const std::string& filename, int mesh_name)
 
     int count_of_meshes = loader.GetMeshCount();
     std::cout << "Number of meshes: " << count_of_meshes << "\n";
+    if (mesh_name >= count_of_meshes)
+    {
+        std::cout << "There is no mesh " << mesh_name << " in the file\n";
+        return false;
+    }
     triangles_count = 0;
 
-    Loader3ds::LMesh& mesh = loader.GetMesh(mesh_name);
-
-    // Obtain bounding box
-    for (int j = 0; j < mesh.GetVertexCount(); ++j)
+    // Materials are kept only when the whole file is loaded, single meshes use the material of the model
+    bool whole_file = mesh_name < 0;
+    int first_mesh = whole_file ? 0 : mesh_name;
+    int last_mesh = whole_file ? count_of_meshes - 1 : mesh_name;
+    file_materials.clear();
+    if (whole_file)
     {
-        glm::dvec3 coord = LVectorTodvec3(mesh.GetVertex(j));
-        if (j == 0)
+        for (unsigned i = 0; i < loader.GetMaterialCount(); ++i)
         {
-            bounding_box.bounds[0] = bounding_box.bounds[1] = coord;
+            Loader3ds::LMaterial& material = loader.GetMaterial(i);
+            MeshMaterial record = {};
+            std::strncpy(record.name, material.GetName().c_str(), sizeof(record.name) - 1);
+            Loader3ds::LColor3 diffuse = material.GetDiffuseColor(), specular = material.GetSpecularColor();
+            record.diffuse = glm::dvec3(diffuse.r, diffuse.g, diffuse.b);
+            record.specular = glm::dvec3(specular.r, specular.g, specular.b);
+            record.shininess = material.GetShininess();
+            record.transparency = material.GetTransparency();
+            file_materials.push_back(record);
         }
-        for (int k = 0; k < 3; k++)
+    }
+
+    // Obtain bounding box
+    bool first_vertex = true;
+    for (int i = first_mesh; i <= last_mesh; ++i)
+    {
+        Loader3ds::LMesh& mesh = loader.GetMesh(i);
+        for (int j = 0; j < mesh.GetVertexCount(); ++j)
         {
-            bounding_box.bounds[0][k] = glm::min(coord[k], bounding_box.bounds[0][k]);
-            bounding_box.bounds[1][k] = glm::max(coord[k], bounding_box.bounds[1][k]);
+            glm::dvec3 coord = LVectorTodvec3(mesh.GetVertex(j));
+            if (first_vertex)
+            {
+                octree_box.bounds[0] = octree_box.bounds[1] = coord;
+                first_vertex = false;
+            }
+            for (int k = 0; k < 3; k++)
+            {
+                octree_box.bounds[0][k] = glm::min(coord[k], octree_box.bounds[0][k]);
+                octree_box.bounds[1][k] = glm::max(coord[k], octree_box.bounds[1][k]);
+            }
         }
     }
 
+    // Meshes loaded on demand keep the declared bounds, since other threads are already reading them
+    if (!on_demand)
+    {
+        bounding_box = octree_box;
+    }
+    else if (!bounding_box.Contains(octree_box))
+    {
+        std::cout << "Warning: declared bounds of \"" << filename << "\" do not contain the whole mesh\n";
+    }
+
     // Load mesh data to octree
-    root_node = std::make_unique<MeshOctreeNode>();
-    for (unsigned j = 0; j < mesh.GetTriangleCount(); j++)
+    MeshOctreeNode root_node;
+    for (int i = first_mesh; i <= last_mesh; ++i)
     {
-        AddPoly(LTriangle2ToPoly(mesh.GetTriangle2(j)));
+        Loader3ds::LMesh& mesh = loader.GetMesh(i);
+        bool has_materials = whole_file && mesh.GetMaterialCount() != 0;
+        for (unsigned j = 0; j < mesh.GetTriangleCount(); j++)
+        {
+            const Loader3ds::LTriangle2& tri = mesh.GetTriangle2(j);
+            // Triangles in no material group of the mesh get the material of the model
+            uint32_t material = has_materials && tri.materialId != Loader3ds::LNoMaterial &&
+                tri.materialId < file_materials.size() ? tri.materialId : MeshTriangle::no_material;
+            MeshTriangle triangle = LTriangle2ToTriangle(tri, material);
+            assert(PolyInBox(triangle, octree_box));
+            root_node.AddPoly(triangle, octree_box);
+            ++triangles_count;
+        }
     }
+    auto octree = std::make_unique<MeshOctree>();
+    octree->Build(root_node);
+    octree->SetMaterials(materials.data(), materials.size());
+    root = std::move(octree);
 
     std::cout << "Model was successfully loaded. Number of polys: " << triangles_count << std::endl;
     return true;
 }
 
-bool PolyInBox(const Poly& poly, const BoundingBox& bounding_box)
+Mesh::Mesh()
+{
+}
+
+Mesh::~Mesh()
+{
+}
+
+bool Mesh::LoadFromClusters(const std::string& filename, GeometryCache* cache, const MeshClusterSource* source)
+{
+    auto new_clusters = std::make_unique<MeshClusters>();
+    if (!new_clusters->Open(filename, cache, source))
+        return false;
+
+    on_demand = false;
+    bounding_box = new_clusters->GetBoundingBox();
+    octree_box = new_clusters->GetOctreeBox();
+    replicas.clear();
+    root = new_clusters->CopyTop();
+    clusters = std::move(new_clusters);
+    file_materials = clusters->GetFileMaterials();
+    root->SetMaterials(materials.data(), materials.size());
+    clusters->SetMaterials(materials.data(), materials.size());
+    std::cout << "Mesh clusters were loaded from \"" << filename << "\". Number of clusters: "
+        << clusters->GetClusterCount() << std::endl;
+    return true;
+}
+
+bool Mesh::WriteClusters(const std::string& filename, size_t max_triangles, const MeshClusterSource& source) const
+{
+    // Clustered meshes keep only the upper levels of the octree in memory
+    if (!root || clusters)
+        return false;
+    return MeshClusters::Write(filename, *root, bounding_box, octree_box, file_materials, source, max_triangles);
+}
+
+void Mesh::BindMaterials(const std::vector<const SurfaceMaterial*>& new_materials)
+{
+    materials = new_materials;
+    if (root)
+        root->SetMaterials(materials.data(), materials.size());
+    for (auto& replica : replicas)
+    {
+        if (replica)
+            replica->SetMaterials(materials.data(), materials.size());
+    }
+    if (clusters)
+        clusters->SetMaterials(materials.data(), materials.size());
+}
+
+void Mesh::LoadOnDemand(const std::string& filename, int mesh_name, const BoundingBox& bounds)
+{
+    on_demand = true;
+    pending_filename = filename;
+    pending_mesh_name = mesh_name;
+    bounding_box = bounds;
+}
+
+void Mesh::LoadFromOctree(const BoundingBox& bounds, const BoundingBox& octree_bounds,
+    const MeshOctreeCell* cells, size_t cell_count, const MeshTriangle* triangles, size_t triangle_count)
+{
+    on_demand = false;
+    bounding_box = bounds;
+    octree_box = octree_bounds;
+    triangles_count = static_cast<int>(triangle_count);
+    root = std::make_unique<MeshOctree>();
+    root->View(cells, cell_count, triangles, triangle_count);
+}
+
+void Mesh::LoadPendingFile()
+{
+    LoadFromFile(pending_filename, pending_mesh_name);
+}
+
+bool PolyInBox(const MeshTriangle& poly, const BoundingBox& bounding_box)
 {
     for (const auto& v : poly.vertices)
     {
@@ -67,4 +339,131 @@ bool PolyInBox(const Poly& poly, const BoundingBox& bounding_box)
         }
     }
     return true;
-}
\ No newline at end of file
+}
+MeshOctree::MeshOctree(const MeshOctree& other)
+    : clusters(other.clusters),
+    materials(other.materials),
+    material_count(other.material_count),
+    own_cells(other.cells, other.cells + other.cell_count),
+    own_triangles(other.triangles, other.triangles + other.triangle_count)
+{
+    View(own_cells.data(), own_cells.size(), own_triangles.data(), own_triangles.size());
+}
+
+namespace
+{
+    void FlattenNode(const MeshOctreeNode& node, size_t index,
+        std::vector<MeshOctreeCell>& cells, std::vector<MeshTriangle>& triangles)
+    {
+        cells[index].first_triangle = static_cast<uint32_t>(triangles.size());
+        cells[index].triangle_count = static_cast<uint32_t>(node.triangles.size());
+        triangles.insert(triangles.end(), node.triangles.begin(), node.triangles.end());
+
+        if (node.subtrees.empty())
+            return;
+
+        size_t first_child = cells.size();
+        cells[index].first_child = static_cast<int32_t>(first_child);
+        cells.resize(first_child + 8, MeshOctreeCell{ -1, 0, 0, 0 });
+        for (int i = 0; i < 8; ++i)
+            FlattenNode(node.subtrees[i], first_child + i, cells, triangles);
+    }
+}
+
+void MeshOctree::Build(const MeshOctreeNode& root)
+{
+    own_cells.assign(1, MeshOctreeCell{ -1, 0, 0, 0 });
+    own_triangles.clear();
+    FlattenNode(root, 0, own_cells, own_triangles);
+    View(own_cells.data(), own_cells.size(), own_triangles.data(), own_triangles.size());
+}
+
+void MeshOctree::View(const MeshOctreeCell* new_cells, size_t new_cell_count,
+    const MeshTriangle* new_triangles, size_t new_triangle_count)
+{
+    cells = new_cells;
+    cell_count = new_cell_count;
+    triangles = new_triangles;
+    triangle_count = new_triangle_count;
+}
+
+bool MeshOctree::IsValid(size_t cluster_count) const
+{
+    for (size_t i = 0; i < cell_count; ++i)
+    {
+        const MeshOctreeCell& cell = cells[i];
+        if (cell.cluster > cluster_count)
+            return false;
+        if (cell.first_child != -1 &&
+            (cell.first_child <= static_cast<int64_t>(i) || cell.first_child + 8 > static_cast<int64_t>(cell_count)))
+            return false;
+        if (static_cast<uint64_t>(cell.first_triangle) + cell.triangle_count > triangle_count)
+            return false;
+    }
+    return true;
+}
+
+Intersection MeshOctree::IntersectTriangle(const Ray& ray, const MeshTriangle& triangle, bool inverted)
+{
+    Intersection intersection = ::IntersectTriangle(ray,
+        triangle.vertices[0], triangle.vertices[1], triangle.vertices[2],
+        triangle.normals[0], triangle.normals[1], triangle.normals[2]);
+    if ((glm::dot(ray.direction, intersection.normal) > 0.0) != inverted)
+        return Intersection();
+    return intersection;
+}
+
+Intersection MeshOctree::IntersectCell(size_t index, const Ray& ray, const BoundingBox& bounding_box, bool inverted) const
+{
+    const MeshOctreeCell& cell = cells[index];
+    Intersection intersection;
+    if (cell.cluster != 0)
+    {
+        // The cluster is held while it is used, even if other threads evict it from the cache
+        std::shared_ptr<const MeshOctree> cluster = clusters->GetCluster(cell.cluster - 1);
+        intersection = cluster->Intersect(ray, bounding_box, inverted);
+        intersection.triangle = nullptr;
+    }
+
+    for (uint32_t k = 0; k < cell.triangle_count; ++k)
+    {
+        const MeshTriangle& triangle = triangles[cell.first_triangle + k];
+        auto current_intersection = IntersectTriangle(ray, triangle, inverted);
+        if (current_intersection)
+        {
+            if (!intersection || current_intersection.distance < intersection.distance)
+            {
+                intersection = current_intersection;
+                intersection.triangle = &triangle;
+                if (triangle.material < material_count)
+                    intersection.material = materials[triangle.material];
+            }
+        }
+    }
+
+    if (cell.first_child < 0)
+        return intersection;
+
+    glm::dvec3 center = glm::mix(bounding_box.bounds[0], bounding_box.bounds[1], 0.5);
+    for (int i = 0; i < 8; ++i)
+    {
+        BoundingBox subbox = bounding_box;
+        for (int j = 0; j < 3; ++j)
+        {
+            subbox.bounds[(i >> j) & 1][j] = center[j];
+        }
+        if (subbox.Intersect(ray))
+        {
+            auto current_intersection = IntersectCell(cell.first_child + i, ray, subbox, inverted);
+            if (current_intersection)
+            {
+                if (!intersection || current_intersection.distance < intersection.distance)
+                {
+                    intersection = current_intersection;
+                }
+            }
+        }
+    }
+
+    return intersection;
+}
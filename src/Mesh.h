@@ -6,16 +6,20 @@
     Author: Artyom Bishev
 */
 
-#include "glm\glm.hpp"
-#include "glm\ext.hpp"
+#include "glm/glm.hpp"
+#include "glm/ext.hpp"
 #include "Types.h"
 #include "Object3D.h"
 #include "BasicSurfaces.h"
-#include "L3DS\l3ds.h"
+#include "L3DS/l3ds.h"
+#include "Numa.h"
+#include "GeometryCache.h"
 #include <vector>
 #include <memory>
 #include <string>
 #include <iostream>
+#include <mutex>
+#include <cstdint>
 
 // Convert LVector structs from L3DS to vec3
 template<typename T>
@@ -33,13 +37,35 @@ inline std::ostream& operator<<(std::ostream& out, const glm::dvec3& vec)
     return out << "(" << vec.x << ", " << vec.y << ", " << vec.z << ")";
 }
 
-bool PolyInBox(const Poly& poly, const BoundingBox& bounding_box);
+// Triangle of a built octree, plain data which can be written to files and mapped back
+struct MeshTriangle
+{
+    static constexpr uint32_t no_material = 0xFFFFFFFF;
+
+    glm::dvec3 vertices[3];
+    glm::dvec3 normals[3];
+    uint32_t material;  // index in the material table of the mesh, no_material to use the material of the model
+    uint32_t reserved;
+};
+
+// Material of the triangles as it is described by the mesh file, plain data as well
+struct MeshMaterial
+{
+    char name[32];
+    glm::dvec3 diffuse;
+    glm::dvec3 specular;
+    double shininess;     // from 0 (matte) to 1 (shiny)
+    double transparency;  // from 0 (opaque) to 1 (fully transparent)
+};
 
+bool PolyInBox(const MeshTriangle& poly, const BoundingBox& bounding_box);
+
+// Node of the octree used while a mesh is being built
 struct MeshOctreeNode
 {
     std::vector<MeshOctreeNode> subtrees;
-    std::vector<Poly> triangles;
-    void AddPoly(const Poly& poly, const BoundingBox& bounding_box)
+    std::vector<MeshTriangle> triangles;
+    void AddPoly(const MeshTriangle& poly, const BoundingBox& bounding_box)
     {
         glm::dvec3 center = glm::mix(bounding_box.bounds[0], bounding_box.bounds[1], 0.5);
         for (int i = 0; i < 8; ++i)
@@ -59,76 +85,225 @@ struct MeshOctreeNode
         }
         triangles.push_back(poly);
     }
-    Intersection Intersect(const Ray& ray, const BoundingBox& bounding_box, bool inverted)
+};
+
+// Node of a built octree; children of a node are 8 consecutive cells
+struct MeshOctreeCell
+{
+    int32_t first_child;      // -1 for leaves
+    uint32_t first_triangle;
+    uint32_t triangle_count;
+    uint32_t cluster;         // 1 + index of the cluster with the triangles of the cell (and the subtree of a leaf), 0 for none
+};
+
+class MeshClusters;
+struct MeshClusterSource;
+
+// Octree flattened into two arrays, which are either owned or placed in external memory
+// (such as a mapped scene bundle)
+// Cells and triangles are referenced by indices, so the arrays can be used at any address
+// Subtrees of some leaves may be kept in clusters on disk and loaded when rays reach them
+class MeshOctree
+{
+public:
+    MeshOctree() {}
+
+    // Copies always own their arrays
+    MeshOctree(const MeshOctree& other);
+    MeshOctree& operator=(const MeshOctree&) = delete;
+
+    // Flatten the tree, the cells are stored in depth-first order
+    void Build(const MeshOctreeNode& root);
+
+    // Use the arrays owned by somebody else; they must outlive the octree
+    void View(const MeshOctreeCell* cells, size_t cell_count, const MeshTriangle* triangles, size_t triangle_count);
+
+    // Surface materials of the triangles, indexed by MeshTriangle::material; the table must outlive the octree
+    void SetMaterials(const SurfaceMaterial* const* new_materials, size_t new_material_count)
     {
-        Intersection intersection;
-        for (const auto& poly : triangles)
-        {
-            auto current_intersection = poly.Intersect(ray, inverted);
-            if (current_intersection)
-            {
-                if (!intersection || current_intersection.distance < intersection.distance)
-                {
-                    intersection = current_intersection;
-                }
-            }
-        }
+        materials = new_materials;
+        material_count = new_material_count;
+    }
 
-        if (subtrees.empty())
-            return intersection;
+    // Resolve the cluster references of the cells with the clusters, which must outlive the octree
+    void SetClusters(const MeshClusters* new_clusters)
+    {
+        clusters = new_clusters;
+    }
 
-        glm::dvec3 center = glm::mix(bounding_box.bounds[0], bounding_box.bounds[1], 0.5);
-        for (int i = 0; i < 8; ++i)
-        {
-            BoundingBox subbox = bounding_box;
-            for (int j = 0; j < 3; ++j)
-            {
-                subbox.bounds[(i >> j) & 1][j] = center[j];
-            }
-            if (subbox.Intersect(ray))
-            {
-                auto current_intersection = subtrees[i].Intersect(ray, subbox, inverted);
-                if (current_intersection)
-                {
-                    if (!intersection || current_intersection.distance < intersection.distance)
-                    {
-                        intersection = current_intersection;
-                    }
-                }
-            }
-        }
+    // Check that all indices of the cells are inside the arrays and there are at most cluster_count clusters
+    bool IsValid(size_t cluster_count = 0) const;
 
-        return intersection;
+    Intersection Intersect(const Ray& ray, const BoundingBox& bounding_box, bool inverted) const
+    {
+        if (cell_count == 0)
+            return Intersection();
+        return IntersectCell(0, ray, bounding_box, inverted);
+    }
+
+    // Intersection of the ray and the triangle, which is skipped if it faces the ray (or faces away from it, if inverted)
+    static Intersection IntersectTriangle(const Ray& ray, const MeshTriangle& triangle, bool inverted);
+
+    const MeshOctreeCell* GetCells() const
+    {
+        return cells;
+    }
+    size_t GetCellCount() const
+    {
+        return cell_count;
     }
+    const MeshTriangle* GetTriangles() const
+    {
+        return triangles;
+    }
+    size_t GetTriangleCount() const
+    {
+        return triangle_count;
+    }
+
+private:
+    Intersection IntersectCell(size_t index, const Ray& ray, const BoundingBox& bounding_box, bool inverted) const;
+
+    const MeshOctreeCell* cells = nullptr;
+    size_t cell_count = 0;
+    const MeshTriangle* triangles = nullptr;
+    size_t triangle_count = 0;
+    const MeshClusters* clusters = nullptr;
+    const SurfaceMaterial* const* materials = nullptr;
+    size_t material_count = 0;
+
+    std::vector<MeshOctreeCell> own_cells;
+    std::vector<MeshTriangle> own_triangles;
 };
 
 // 3D mesh of polygonal object
 class Mesh : public Surface
 {
 public:
-    // Load mesh from .3ds
+    // Load mesh from .3ds, .obj or .ply (which contain a single mesh)
     bool LoadFromFile(const std::string& filename, int mesh_name = 0);
 
+    // Load all meshes of the file to one octree
+    // The triangles keep the materials of the file, which are bound to surface materials by BindMaterials
+    bool LoadAllFromFile(const std::string& filename);
+
+    // Materials of the file loaded by LoadAllFromFile (or of the clusters written from it)
+    const std::vector<MeshMaterial>& GetFileMaterials() const
+    {
+        return file_materials;
+    }
+
+    // Surface materials of the triangles, one for each of the file materials; they must outlive the mesh
+    // Triangles without a material get the material of the model
+    void BindMaterials(const std::vector<const SurfaceMaterial*>& new_materials);
+
+    const std::vector<const SurfaceMaterial*>& GetMaterials() const
+    {
+        return materials;
+    }
+
+    // Postpone loading of the mesh until some ray hits the specified bounds
+    // The bounds must contain the whole mesh, otherwise some of its parts will be missed by rays
+    void LoadOnDemand(const std::string& filename, int mesh_name, const BoundingBox& bounds);
+
+    // Use the octree built earlier and placed in external memory, e.g. by a scene bundle
+    void LoadFromOctree(const BoundingBox& bounds, const BoundingBox& octree_bounds,
+        const MeshOctreeCell* cells, size_t cell_count, const MeshTriangle* triangles, size_t triangle_count);
+
+    // Use the clusters written by WriteClusters; they are read from the file when rays reach them
+    // and kept in the cache, which must outlive the mesh
+    // Clusters written from another version of the source file are rejected, unless source is nullptr
+    bool LoadFromClusters(const std::string& filename, GeometryCache* cache, const MeshClusterSource* source = nullptr);
+
+    // Split the loaded mesh into clusters of at most max_triangles triangles and write them to the file
+    // along with the description of the file the mesh was loaded from
+    bool WriteClusters(const std::string& filename, size_t max_triangles, const MeshClusterSource& source) const;
+
+    // Check whether the geometry of the mesh is kept in a cluster file
+    bool IsClustered() const
+    {
+        return clusters != nullptr;
+    }
+
+    // Load the deferred mesh now, if it is not loaded yet
+    void EnsureLoaded()
+    {
+        if (on_demand)
+            std::call_once(load_flag, [this]() { LoadPendingFile(); });
+    }
+
     Intersection Intersect(const Ray& ray, bool inverted = false) const override
     {
         if (!bounding_box.Intersect(ray))
             return Intersection();
-        return root_node->Intersect(ray, bounding_box, inverted);
+        const_cast<Mesh*>(this)->EnsureLoaded();
+
+        const MeshOctree* octree = GetOctree();
+        if (!octree)
+            return Intersection();
+        return octree->Intersect(ray, octree_box, inverted);
+    }
+
+    void ReserveReplicas(int node_count) override
+    {
+        replicas.clear();
+        replicas.resize(node_count);
+    }
+
+    void ReplicateForNode(int node) override
+    {
+        if (root)
+            replicas[node] = std::make_unique<MeshOctree>(*root);
     }
 
-	Mesh() {};
-	~Mesh() {};
+    const BoundingBox& GetBoundingBox() const
+    {
+        return bounding_box;
+    }
+    const BoundingBox& GetOctreeBox() const
+    {
+        return octree_box;
+    }
+    // Built octree, nullptr if the mesh is not loaded
+    const MeshOctree* GetRootOctree() const
+    {
+        return root.get();
+    }
+
+	Mesh();
+	~Mesh();
 
 private:
-    void AddPoly(const Poly& poly)
+    // Load one mesh of the file, or all of them if mesh_name is negative
+    bool Load3ds(const std::string& filename, int mesh_name);
+
+    // Load .obj or .ply through the indexed mesh loaders, with or without the materials of the file
+    bool LoadIndexed(const std::string& filename, bool keep_materials);
+
+    // Load the file passed to LoadOnDemand
+    void LoadPendingFile();
+
+    // Octree copy local to the node of the calling thread, if there is one
+    const MeshOctree* GetOctree() const
     {
-        assert(root_node);
-        assert(PolyInBox(poly, bounding_box));
-        root_node->AddPoly(poly, bounding_box);
-        ++triangles_count;
+        int node = NumaThreadNode();
+        if (node < static_cast<int>(replicas.size()) && replicas[node])
+            return replicas[node].get();
+        return root.get();
     }
 
-    BoundingBox bounding_box;
-    std::unique_ptr<MeshOctreeNode> root_node;
+    BoundingBox bounding_box; // bounds used to cull rays
+    BoundingBox octree_box; // bounds of the root octree node
+    std::unique_ptr<MeshClusters> clusters; // cluster file the root refers to, if any
+    std::unique_ptr<MeshOctree> root;
+    std::vector<std::unique_ptr<MeshOctree>> replicas; // per-NUMA-node copies of root
     int triangles_count;
+    std::vector<MeshMaterial> file_materials;
+    std::vector<const SurfaceMaterial*> materials;
+
+    // Deferred loading
+    bool on_demand = false;
+    std::string pending_filename;
+    int pending_mesh_name = 0;
+    std::once_flag load_flag;
 };
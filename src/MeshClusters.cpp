@@ -0,0 +1,299 @@
+#include "MeshClusters.h"
+
+#include <fstream>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+namespace
+{
+    const char clusters_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+    const uint32_t byte_order_mark = 0x01020304;
+
+    // Clusters start at page boundaries, so evicting one of them does not touch the others
+    const size_t cluster_alignment = 4096;
+    const size_t table_alignment = 16;
+
+    struct ClustersHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;  // byte_order_mark written by the machine that wrote the file
+        uint64_t file_size;
+        BoundingBox bounding_box;
+        BoundingBox octree_box;
+        uint64_t top_cells_offset;
+        uint64_t top_cell_count;
+        uint64_t records_offset;
+        uint64_t record_count;
+        uint64_t materials_offset;  // MeshMaterial records
+        uint64_t material_count;
+        MeshClusterSource source;
+    };
+
+    // Cell of the source octree which is stored as a cluster
+    struct ClusterSource
+    {
+        size_t cell;
+        bool whole_subtree;  // otherwise only the triangles of the cell itself
+    };
+
+    size_t AlignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // Number of triangles in the subtree of each cell
+    uint64_t CountTriangles(const MeshOctree& octree, size_t index, std::vector<uint64_t>& counts)
+    {
+        const MeshOctreeCell& cell = octree.GetCells()[index];
+        uint64_t count = cell.triangle_count;
+        if (cell.first_child >= 0)
+        {
+            for (int i = 0; i < 8; ++i)
+                count += CountTriangles(octree, cell.first_child + i, counts);
+        }
+        counts[index] = count;
+        return count;
+    }
+
+    // Build the upper levels of the octree
+    // Subtrees with at most max_triangles triangles become clusters, the triangles of larger
+    // cells become clusters of their own, so the upper levels keep no triangles at all
+    void SplitCell(const MeshOctree& octree, size_t index, size_t target, const std::vector<uint64_t>& counts,
+        size_t max_triangles, std::vector<MeshOctreeCell>& top_cells, std::vector<ClusterSource>& sources)
+    {
+        const MeshOctreeCell& cell = octree.GetCells()[index];
+        top_cells[target] = MeshOctreeCell{ -1, 0, 0, 0 };
+        if (counts[index] == 0)
+            return;
+
+        if (counts[index] <= max_triangles || cell.first_child < 0)
+        {
+            sources.push_back(ClusterSource{ index, true });
+            top_cells[target].cluster = static_cast<uint32_t>(sources.size());
+            return;
+        }
+
+        if (cell.triangle_count != 0)
+        {
+            sources.push_back(ClusterSource{ index, false });
+            top_cells[target].cluster = static_cast<uint32_t>(sources.size());
+        }
+
+        size_t first_child = top_cells.size();
+        top_cells[target].first_child = static_cast<int32_t>(first_child);
+        top_cells.resize(first_child + 8);
+        for (int i = 0; i < 8; ++i)
+            SplitCell(octree, cell.first_child + i, first_child + i, counts, max_triangles, top_cells, sources);
+    }
+
+    // Copy the cell (and its subtree) to separate arrays, where it becomes the root
+    void CopyCell(const MeshOctree& octree, size_t index, size_t target, bool whole_subtree,
+        std::vector<MeshOctreeCell>& cells, std::vector<MeshTriangle>& triangles)
+    {
+        const MeshOctreeCell& cell = octree.GetCells()[index];
+        cells[target] = MeshOctreeCell{ -1, static_cast<uint32_t>(triangles.size()), cell.triangle_count, 0 };
+        const MeshTriangle* first = octree.GetTriangles() + cell.first_triangle;
+        triangles.insert(triangles.end(), first, first + cell.triangle_count);
+
+        if (!whole_subtree || cell.first_child < 0)
+            return;
+
+        size_t first_child = cells.size();
+        cells[target].first_child = static_cast<int32_t>(first_child);
+        cells.resize(first_child + 8);
+        for (int i = 0; i < 8; ++i)
+            CopyCell(octree, cell.first_child + i, first_child + i, true, cells, triangles);
+    }
+
+    void Pad(std::ofstream& out, size_t alignment)
+    {
+        static const char zeros[cluster_alignment] = {};
+        size_t position = static_cast<size_t>(out.tellp());
+        out.write(zeros, AlignUp(position, alignment) - position);
+    }
+
+    template<typename T>
+    void WriteRecords(std::ofstream& out, const std::vector<T>& records)
+    {
+        out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+    }
+
+    size_t ClusterSize(const MeshClusterRecord& record)
+    {
+        return AlignUp(record.cell_count * sizeof(MeshOctreeCell), table_alignment) +
+            record.triangle_count * sizeof(MeshTriangle);
+    }
+}
+
+bool MeshClusterSource::Describe(const std::string& filename, int mesh, MeshClusterSource& source)
+{
+    std::error_code error;
+    auto size = std::filesystem::file_size(filename, error);
+    if (error)
+        return false;
+    auto modified = std::filesystem::last_write_time(filename, error);
+    if (error)
+        return false;
+
+    source = {};
+    source.size = static_cast<uint64_t>(size);
+    source.modified = static_cast<int64_t>(modified.time_since_epoch().count());
+    source.mesh = mesh;
+    return true;
+}
+
+bool MeshClusters::Write(const std::string& filename, const MeshOctree& octree,
+    const BoundingBox& bounding_box, const BoundingBox& octree_box,
+    const std::vector<MeshMaterial>& file_materials, const MeshClusterSource& source, size_t max_triangles)
+{
+    if (octree.GetCellCount() == 0)
+        return false;
+
+    std::vector<uint64_t> counts(octree.GetCellCount());
+    CountTriangles(octree, 0, counts);
+
+    std::vector<MeshOctreeCell> top_cells(1);
+    std::vector<ClusterSource> sources;
+    SplitCell(octree, 0, 0, counts, max_triangles, top_cells, sources);
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        return false;
+
+    ClustersHeader header = {};
+    std::memcpy(header.magic, clusters_magic, sizeof(header.magic));
+    header.version = version;
+    header.byte_order = byte_order_mark;
+    header.bounding_box = bounding_box;
+    header.octree_box = octree_box;
+    header.source = source;
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    Pad(out, table_alignment);
+    header.top_cells_offset = static_cast<uint64_t>(out.tellp());
+    header.top_cell_count = top_cells.size();
+    WriteRecords(out, top_cells);
+
+    // Clusters are extracted one by one, so only one of them is copied at a time
+    std::vector<MeshClusterRecord> records;
+    std::vector<MeshOctreeCell> cells;
+    std::vector<MeshTriangle> triangles;
+    for (const ClusterSource& source : sources)
+    {
+        cells.assign(1, MeshOctreeCell());
+        triangles.clear();
+        CopyCell(octree, source.cell, 0, source.whole_subtree, cells, triangles);
+
+        Pad(out, cluster_alignment);
+        MeshClusterRecord record = { static_cast<uint64_t>(out.tellp()),
+            static_cast<uint32_t>(cells.size()), static_cast<uint32_t>(triangles.size()) };
+        WriteRecords(out, cells);
+        Pad(out, table_alignment);
+        WriteRecords(out, triangles);
+        records.push_back(record);
+    }
+
+    Pad(out, table_alignment);
+    header.records_offset = static_cast<uint64_t>(out.tellp());
+    header.record_count = records.size();
+    WriteRecords(out, records);
+
+    Pad(out, table_alignment);
+    header.materials_offset = static_cast<uint64_t>(out.tellp());
+    header.material_count = file_materials.size();
+    WriteRecords(out, file_materials);
+
+    header.file_size = static_cast<uint64_t>(out.tellp());
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    return static_cast<bool>(out);
+}
+
+MeshClusters::~MeshClusters()
+{
+    if (cache)
+        cache->Remove(this);
+}
+
+bool MeshClusters::Open(const std::string& filename, GeometryCache* new_cache, const MeshClusterSource* source)
+{
+    if (!file.Open(filename) || file.GetSize() < sizeof(ClustersHeader))
+        return false;
+
+    // The mapping starts at a page boundary, so the header is aligned
+    const ClustersHeader& header = *reinterpret_cast<const ClustersHeader*>(file.GetData());
+    if (std::memcmp(header.magic, clusters_magic, sizeof(header.magic)) != 0 ||
+        header.version != version || header.byte_order != byte_order_mark || header.file_size != file.GetSize())
+        return false;
+    if (source && !(header.source == *source))
+        return false;
+
+    uint64_t size = file.GetSize();
+    if (header.top_cells_offset > size || header.records_offset > size || header.materials_offset > size ||
+        header.top_cells_offset % table_alignment != 0 || header.records_offset % table_alignment != 0 ||
+        header.materials_offset % table_alignment != 0 ||
+        header.top_cell_count > (size - header.top_cells_offset) / sizeof(MeshOctreeCell) ||
+        header.record_count > (size - header.records_offset) / sizeof(MeshClusterRecord) ||
+        header.material_count > (size - header.materials_offset) / sizeof(MeshMaterial))
+        return false;
+
+    const char* records_data = file.GetData() + header.records_offset;
+    records.assign(reinterpret_cast<const MeshClusterRecord*>(records_data),
+        reinterpret_cast<const MeshClusterRecord*>(records_data) + header.record_count);
+    for (const MeshClusterRecord& record : records)
+    {
+        if (record.offset % table_alignment != 0 || record.offset > size || ClusterSize(record) > size - record.offset)
+            return false;
+    }
+
+    const MeshMaterial* material_records = reinterpret_cast<const MeshMaterial*>(file.GetData() + header.materials_offset);
+    file_materials.assign(material_records, material_records + header.material_count);
+    for (MeshMaterial& material : file_materials)
+        material.name[sizeof(material.name) - 1] = '\0';
+
+    top.View(reinterpret_cast<const MeshOctreeCell*>(file.GetData() + header.top_cells_offset),
+        header.top_cell_count, nullptr, 0);
+    if (!top.IsValid(records.size()))
+        return false;
+
+    bounding_box = header.bounding_box;
+    octree_box = header.octree_box;
+    cache = new_cache;
+    return true;
+}
+
+std::unique_ptr<MeshOctree> MeshClusters::CopyTop() const
+{
+    auto octree = std::make_unique<MeshOctree>(top);
+    octree->SetClusters(this);
+    return octree;
+}
+
+std::shared_ptr<const MeshOctree> MeshClusters::GetCluster(uint32_t index) const
+{
+    std::shared_ptr<const MeshOctree> cluster = cache->Find(this, index);
+    if (cluster)
+        return cluster;
+
+    // Threads missing the same cluster at once may both read it, the cache keeps the first copy
+    const MeshClusterRecord& record = records[index];
+    const char* data = file.GetData() + record.offset;
+    MeshOctree view;
+    view.View(reinterpret_cast<const MeshOctreeCell*>(data), record.cell_count,
+        reinterpret_cast<const MeshTriangle*>(data + AlignUp(record.cell_count * sizeof(MeshOctreeCell), table_alignment)),
+        record.triangle_count);
+
+    std::unique_ptr<MeshOctree> loaded;
+    if (view.IsValid())
+        loaded = std::make_unique<MeshOctree>(view);
+    else
+        loaded = std::make_unique<MeshOctree>();
+    loaded->SetMaterials(materials, material_count);
+
+    // The copy is the only place the cluster is kept in memory
+    size_t size = ClusterSize(record);
+    file.Evict(record.offset, size);
+    return cache->Insert(this, index, std::move(loaded), size);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+    MeshClusters.h
+    Meshes split into spatially coherent clusters, which are kept on disk
+    and loaded while rendering when rays reach them
+    Author: Artyom Bishev
+*/
+
+#include "Mesh.h"
+#include "MappedFile.h"
+#include "GeometryCache.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Place of a cluster in the file: its cells followed by its triangles
+struct MeshClusterRecord
+{
+    uint64_t offset;
+    uint32_t cell_count;
+    uint32_t triangle_count;
+};
+
+// Mesh file the clusters are written from; clusters written from another version of the file are stale
+struct MeshClusterSource
+{
+    uint64_t size;
+    int64_t modified;  // last write time, in the ticks of the file system clock
+    int32_t mesh;      // index of the mesh in the file, -1 for all meshes of the file
+    uint32_t reserved;
+
+    // Describe the file and the mesh in it; returns false if the file cannot be found
+    static bool Describe(const std::string& filename, int mesh, MeshClusterSource& source);
+
+    bool operator==(const MeshClusterSource& other) const
+    {
+        return size == other.size && modified == other.modified && mesh == other.mesh;
+    }
+};
+
+// Cluster file of a mesh
+// The upper levels of the octree are loaded at once; each subtree with few enough triangles
+// is a cluster, which is read from the file when it is needed and kept in a GeometryCache,
+// so the memory used by the mesh is limited by the budget of the cache
+class MeshClusters
+{
+public:
+    // Version of the format, files of other versions are rejected
+    static const uint32_t version = 3;
+
+    // Split the octree into clusters of at most max_triangles triangles (unless a single leaf has more)
+    // and write them to the file along with the description of their source
+    static bool Write(const std::string& filename, const MeshOctree& octree,
+        const BoundingBox& bounding_box, const BoundingBox& octree_box,
+        const std::vector<MeshMaterial>& file_materials, const MeshClusterSource& source, size_t max_triangles);
+
+    MeshClusters() = default;
+    ~MeshClusters();
+
+    MeshClusters(const MeshClusters&) = delete;
+    MeshClusters& operator=(const MeshClusters&) = delete;
+
+    // Map the file; the clusters are kept in the cache, which must outlive this object
+    // Files written from another source are rejected, unless source is nullptr
+    bool Open(const std::string& filename, GeometryCache* cache, const MeshClusterSource* source);
+
+    // Octree of the upper levels, its leaves refer to the clusters
+    std::unique_ptr<MeshOctree> CopyTop() const;
+
+    // Material table given to the loaded clusters, see MeshOctree::SetMaterials
+    void SetMaterials(const SurfaceMaterial* const* new_materials, size_t new_material_count)
+    {
+        materials = new_materials;
+        material_count = new_material_count;
+    }
+
+    // Cluster from the cache, loaded from the file if needed
+    // Damaged clusters are replaced by empty ones
+    std::shared_ptr<const MeshOctree> GetCluster(uint32_t index) const;
+
+    const BoundingBox& GetBoundingBox() const
+    {
+        return bounding_box;
+    }
+    const BoundingBox& GetOctreeBox() const
+    {
+        return octree_box;
+    }
+    size_t GetClusterCount() const
+    {
+        return records.size();
+    }
+    const std::vector<MeshMaterial>& GetFileMaterials() const
+    {
+        return file_materials;
+    }
+
+private:
+    MappedFile file;
+    GeometryCache* cache = nullptr;
+    BoundingBox bounding_box;
+    BoundingBox octree_box;
+    MeshOctree top;  // views the mapped file
+    std::vector<MeshClusterRecord> records;
+    std::vector<MeshMaterial> file_materials;
+    const SurfaceMaterial* const* materials = nullptr;
+    size_t material_count = 0;
+};
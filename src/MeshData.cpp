@@ -0,0 +1,76 @@
+#include "MeshData.h"
+
+void MeshData::UseOwnArrays()
+{
+    position_count = own_positions.size() / 3;
+    positions = reinterpret_cast<const char*>(own_positions.data());
+    position_stride = 3 * sizeof(float);
+
+    normal_count = own_normals.size() / 3;
+    normals = own_normals.empty() ? nullptr : reinterpret_cast<const char*>(own_normals.data());
+    normal_stride = 3 * sizeof(float);
+
+    triangle_count = own_position_indices.size() / 3;
+    position_indices = reinterpret_cast<const char*>(own_position_indices.data());
+    position_index_stride = 3 * sizeof(uint32_t);
+
+    // Without own normal indices the normals belong to the positions
+    if (own_normal_indices.empty())
+        normal_indices = position_indices;
+    else
+        normal_indices = reinterpret_cast<const char*>(own_normal_indices.data());
+    normal_index_stride = 3 * sizeof(uint32_t);
+}
+
+void MeshData::ComputeNormals()
+{
+    if (normals)
+        return;
+
+    std::vector<glm::dvec3> sums(position_count);
+    for (size_t i = 0; i < triangle_count; ++i)
+    {
+        uint32_t index[3] = { GetPositionIndex(i, 0), GetPositionIndex(i, 1), GetPositionIndex(i, 2) };
+        glm::dvec3 a = GetPosition(index[0]), b = GetPosition(index[1]), c = GetPosition(index[2]);
+        // The length of the cross product is twice the area of the triangle
+        glm::dvec3 normal = glm::cross(b - a, c - a);
+        for (int k = 0; k < 3; ++k)
+            sums[index[k]] += normal;
+    }
+
+    own_normals.resize(position_count * 3);
+    for (size_t i = 0; i < position_count; ++i)
+    {
+        double length = glm::length(sums[i]);
+        glm::dvec3 normal = length > 0.0 ? sums[i] / length : glm::dvec3(0.0, 0.0, 1.0);
+        for (int k = 0; k < 3; ++k)
+            own_normals[i * 3 + k] = static_cast<float>(normal[k]);
+    }
+
+    normal_count = position_count;
+    normals = reinterpret_cast<const char*>(own_normals.data());
+    normal_stride = 3 * sizeof(float);
+    normal_indices = position_indices;
+    normal_index_stride = position_index_stride;
+}
+
+bool MeshData::IsValid() const
+{
+    if (!triangle_materials.empty() && triangle_materials.size() != triangle_count)
+        return false;
+
+    for (size_t i = 0; i < triangle_count; ++i)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            if (GetPositionIndex(i, k) >= position_count)
+                return false;
+            if (normals && GetNormalIndex(i, k) >= normal_count)
+                return false;
+        }
+        if (!triangle_materials.empty() && triangle_materials[i] >= materials.size() &&
+            triangle_materials[i] != MeshTriangle::no_material)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+/*
+    MeshData.h
+    Indexed triangle meshes read from files, before they are put into octrees
+    Author: Artyom Bishev
+*/
+
+#include "Mesh.h"
+#include "MappedFile.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+// Vertices and triangles of a mesh as they are stored in a file
+// The arrays are views with any distance between the records, which point either into the vectors
+// of the object or right into the mapped file, so binary files are used without copying
+// Positions and normals are 3 floats, the corners of the triangles are 3 uint32 indices
+class MeshData
+{
+public:
+    size_t position_count = 0;
+    size_t normal_count = 0;
+    size_t triangle_count = 0;
+
+    const char* positions = nullptr;
+    size_t position_stride = 0;
+    const char* normals = nullptr;  // nullptr if there are no normals
+    size_t normal_stride = 0;
+
+    const char* position_indices = nullptr;
+    size_t position_index_stride = 0;
+    const char* normal_indices = nullptr;  // normals of the corners, may be the same view as position_indices
+    size_t normal_index_stride = 0;
+
+    // Index in materials for each triangle, empty if the file has no materials
+    std::vector<uint32_t> triangle_materials;
+    std::vector<MeshMaterial> materials;
+
+    // Storage of the arrays which are not mapped
+    std::vector<float> own_positions;
+    std::vector<float> own_normals;
+    std::vector<uint32_t> own_position_indices;
+    std::vector<uint32_t> own_normal_indices;
+
+    // File the views may point into
+    MappedFile file;
+
+    glm::dvec3 GetPosition(size_t index) const
+    {
+        return LoadVector(positions + index * position_stride);
+    }
+
+    glm::dvec3 GetNormal(size_t index) const
+    {
+        return LoadVector(normals + index * normal_stride);
+    }
+
+    uint32_t GetPositionIndex(size_t triangle, int corner) const
+    {
+        return LoadIndex(position_indices + triangle * position_index_stride + corner * sizeof(uint32_t));
+    }
+
+    uint32_t GetNormalIndex(size_t triangle, int corner) const
+    {
+        return LoadIndex(normal_indices + triangle * normal_index_stride + corner * sizeof(uint32_t));
+    }
+
+    // Point all of the views to the own arrays
+    void UseOwnArrays();
+
+    // Compute smooth normals of the positions weighted by the areas of the triangles,
+    // if the file has no normals
+    void ComputeNormals();
+
+    // Check that the triangles refer only to existing vertices and materials
+    bool IsValid() const;
+
+private:
+    // Views into files need not be aligned
+    static glm::dvec3 LoadVector(const char* data)
+    {
+        float value[3];
+        std::memcpy(value, data, sizeof(value));
+        return glm::dvec3(value[0], value[1], value[2]);
+    }
+
+    static uint32_t LoadIndex(const char* data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+    MeshLoaders.h
+    Loaders of Wavefront OBJ and Stanford PLY meshes
+    Author: Artyom Bishev
+*/
+
+#include "MeshData.h"
+#include <string>
+
+// Reads .obj files with their .mtl materials
+// The file is mapped to memory and split into chunks at line boundaries, which are parsed in parallel;
+// polygons are split into triangle fans
+class ObjLoader
+{
+public:
+    bool Load(const std::string& filename, MeshData& data);
+
+    // Description of the last error
+    const std::string& GetError() const
+    {
+        return error;
+    }
+
+private:
+    bool Fail(const std::string& message);
+
+    // Read the materials of the library into data.materials, adding their names to material_names
+    void LoadMaterialLibrary(const std::string& filename, MeshData& data, std::vector<std::string>& material_names);
+
+    std::string error;
+};
+
+// Reads .ply files
+// Binary little endian vertices with float coordinates and triangle faces are used right from the mapped file,
+// other layouts (ASCII, big endian, double coordinates, polygons) are converted
+class PlyLoader
+{
+public:
+    bool Load(const std::string& filename, MeshData& data);
+
+    // Description of the last error
+    const std::string& GetError() const
+    {
+        return error;
+    }
+
+private:
+    bool Fail(const std::string& message);
+
+    std::string error;
+};
@@ -0,0 +1,167 @@
+#include "Numa.h"
+#include "Threads.h"
+
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+namespace
+{
+    // Maximal number of OpenMP threads whose nodes are remembered
+    const int max_pinned_threads = 1024;
+
+    int thread_nodes[max_pinned_threads] = {};
+
+#ifndef _WIN32
+    // Processors of every node as listed in /sys/devices/system/node/node*/cpulist
+    std::vector<std::vector<int>> LoadNodeProcessors()
+    {
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0;; ++node)
+        {
+            std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!fin)
+                break;
+
+            // cpulist looks like "0-7,16-23"
+            std::vector<int> processors;
+            std::string range;
+            while (std::getline(fin, range, ','))
+            {
+                std::istringstream range_stream(range);
+                int first = 0, last = 0;
+                char dash = 0;
+                if (!(range_stream >> first))
+                    continue;
+                if (range_stream >> dash >> last)
+                {
+                    for (int cpu = first; cpu <= last; ++cpu)
+                        processors.push_back(cpu);
+                }
+                else
+                {
+                    processors.push_back(first);
+                }
+            }
+            nodes.push_back(processors);
+        }
+        return nodes;
+    }
+
+    const std::vector<std::vector<int>>& NodeProcessors()
+    {
+        static const std::vector<std::vector<int>> nodes = LoadNodeProcessors();
+        return nodes;
+    }
+#endif
+}
+
+int NumaNodeCount()
+{
+#ifdef _WIN32
+    ULONG highest_node = 0;
+    if (!GetNumaHighestNodeNumber(&highest_node))
+        return 1;
+    return static_cast<int>(highest_node) + 1;
+#else
+    int count = static_cast<int>(NodeProcessors().size());
+    return count > 0 ? count : 1;
+#endif
+}
+
+bool NumaPinThread(int node)
+{
+    int thread = ThreadIndex();
+    if (thread < max_pinned_threads)
+        thread_nodes[thread] = node;
+
+#ifdef _WIN32
+    ULONGLONG mask = 0;
+    if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask) || mask == 0)
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(mask)) != 0;
+#else
+    const auto& nodes = NodeProcessors();
+    if (node < 0 || node >= static_cast<int>(nodes.size()) || nodes[node].empty())
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : nodes[node])
+        CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+int NumaTeamThreadNode()
+{
+    return NumaNodeForThread(ThreadIndex(), TeamSize());
+}
+
+NumaAffinity NumaSaveAffinity()
+{
+    NumaAffinity affinity;
+    affinity.node = NumaThreadNode();
+
+#ifdef _WIN32
+    // There is no GetThreadAffinityMask, the old mask is returned when a new one is set
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        return affinity;
+    DWORD_PTR mask = SetThreadAffinityMask(GetCurrentThread(), process_mask);
+    if (mask == 0)
+        return affinity;
+    SetThreadAffinityMask(GetCurrentThread(), mask);
+    affinity.processors.push_back(static_cast<uint64_t>(mask));
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return affinity;
+    affinity.processors.assign((CPU_SETSIZE + 63) / 64, 0);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set))
+            affinity.processors[cpu / 64] |= uint64_t(1) << (cpu % 64);
+    }
+#endif
+    affinity.valid = true;
+    return affinity;
+}
+
+void NumaRestoreAffinity(const NumaAffinity& affinity)
+{
+    int thread = ThreadIndex();
+    if (thread < max_pinned_threads)
+        thread_nodes[thread] = affinity.node;
+    if (!affinity.valid || affinity.processors.empty())
+        return;
+
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(affinity.processors[0]));
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu / 64 < static_cast<int>(affinity.processors.size()); ++cpu)
+    {
+        if (affinity.processors[cpu / 64] & (uint64_t(1) << (cpu % 64)))
+            CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+int NumaThreadNode()
+{
+    int thread = ThreadIndex();
+    if (thread >= max_pinned_threads)
+        return 0;
+    return thread_nodes[thread];
+}
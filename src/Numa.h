@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+    Numa.h
+    Helpers for pinning render threads to NUMA nodes
+    Author: Artyom Bishev
+*/
+
+#include <vector>
+#include <cstdint>
+
+// Number of NUMA nodes in the system (1 if the topology is unknown)
+int NumaNodeCount();
+
+// Pin the calling thread to the processors of the specified node
+// and remember the node for NumaThreadNode()
+// Returns false if the affinity could not be changed
+bool NumaPinThread(int node);
+
+// Processors the calling thread may run on and the node remembered for it
+struct NumaAffinity
+{
+    std::vector<uint64_t> processors;  // bit i % 64 of word i / 64 is set for processor i
+    int node = 0;
+    bool valid = false;                // false if the affinity could not be read
+};
+
+// Affinity of the calling thread, to be restored after the thread has been pinned
+NumaAffinity NumaSaveAffinity();
+
+// Give the calling thread back the saved affinity
+void NumaRestoreAffinity(const NumaAffinity& affinity);
+
+// Pins the calling thread to a node while it is alive and restores its affinity afterwards,
+// so the OpenMP pool threads do not stay pinned in the parallel regions which are not NUMA-aware
+// Negative nodes leave the thread as it is
+class NumaPinScope
+{
+public:
+    explicit NumaPinScope(int node)
+    {
+        if (node < 0)
+            return;
+        saved = NumaSaveAffinity();
+        pinned = true;
+        NumaPinThread(node);
+    }
+    ~NumaPinScope()
+    {
+        if (pinned)
+            NumaRestoreAffinity(saved);
+    }
+    NumaPinScope(const NumaPinScope&) = delete;
+    NumaPinScope& operator=(const NumaPinScope&) = delete;
+
+private:
+    NumaAffinity saved;
+    bool pinned = false;
+};
+
+// Node of the calling thread of the current OpenMP team given by NumaNodeForThread
+int NumaTeamThreadNode();
+
+// Node the calling OpenMP thread was pinned to (0 if it was never pinned)
+int NumaThreadNode();
+
+// Node which the specified thread of a team of thread_count threads should be pinned to
+// Threads are split into contiguous blocks, one block per node
+inline int NumaNodeForThread(int thread, int thread_count)
+{
+    int node_count = NumaNodeCount();
+    if (thread_count <= 0)
+        return 0;
+    return (thread * node_count) / thread_count;
+}
@@ -0,0 +1,399 @@
+#include "MeshLoaders.h"
+#include "Threads.h"
+#include "Paths.h"
+
+#include <charconv>
+#include <string_view>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+
+namespace
+{
+    // Chunks are large enough to make merging cheap, and there are several of them per thread
+    // to balance the load
+    const size_t min_chunk_size = 1 << 20;
+    const int chunks_per_thread = 4;
+
+    // Indices of a chunk are kept until the chunks are merged either as absolute ones (0-based, plus absolute_index)
+    // or as relative to the first vertex of the chunk (negative ones refer to the previous chunks)
+    const int64_t absolute_index = int64_t(1) << 62;
+
+    // Material of the faces before the first usemtl of a chunk, which is the last material of the previous chunk
+    const uint32_t inherited_material = 0xFFFFFFFE;
+
+    struct ObjChunk
+    {
+        std::vector<float> positions;
+        std::vector<float> normals;
+        std::vector<int64_t> position_indices;  // 3 per triangle
+        std::vector<int64_t> normal_indices;    // 3 per triangle, if all faces have normals
+        std::vector<uint32_t> materials;        // index in material_names for each triangle
+        std::vector<std::string> material_names;
+        std::vector<std::string> libraries;
+        uint32_t last_material = inherited_material;  // material at the end of the chunk
+        bool missing_normals = false;
+        size_t line_count = 0;
+
+        // First error of the chunk
+        size_t error_line = 0;
+        std::string error;
+    };
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    class LineReader
+    {
+    public:
+        LineReader(const char* begin, const char* end) : position(begin), end(end) {}
+
+        bool AtEnd() const
+        {
+            return position >= end;
+        }
+
+        // Next token of the line, empty at the end of the line
+        std::string_view Token()
+        {
+            while (position < end && IsSpace(*position))
+                ++position;
+            const char* start = position;
+            while (position < end && !IsSpace(*position))
+                ++position;
+            return std::string_view(start, position - start);
+        }
+
+        // Rest of the line without the surrounding spaces
+        std::string_view Rest()
+        {
+            while (position < end && IsSpace(*position))
+                ++position;
+            const char* last = end;
+            while (last > position && IsSpace(last[-1]))
+                --last;
+            std::string_view rest(position, last - position);
+            position = end;
+            return rest;
+        }
+
+    private:
+        const char* position;
+        const char* end;
+    };
+
+    bool ParseFloat(std::string_view token, float& value)
+    {
+        // from_chars does not accept the leading '+'
+        if (token.size() > 1 && token[0] == '+')
+            token.remove_prefix(1);
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        return !token.empty() && result.ec == std::errc() && result.ptr == token.data() + token.size();
+    }
+
+    // Parse a 1-based or negative index, encoding it as described at absolute_index
+    bool ParseIndex(std::string_view token, size_t count_in_chunk, int64_t& index)
+    {
+        int64_t value = 0;
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (token.empty() || result.ec != std::errc() || result.ptr != token.data() + token.size() || value == 0)
+            return false;
+        index = value > 0 ? absolute_index + value - 1 : static_cast<int64_t>(count_in_chunk) + value;
+        return true;
+    }
+
+    void ParseChunk(const char* begin, const char* end, ObjChunk& chunk)
+    {
+        std::vector<int64_t> face_positions, face_normals;
+        uint32_t material = inherited_material;
+
+        auto fail = [&](const std::string& message) {
+            chunk.error_line = chunk.line_count;
+            chunk.error = message;
+        };
+
+        for (const char* line = begin; line < end && chunk.error.empty();)
+        {
+            const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+            if (!line_end)
+                line_end = end;
+            ++chunk.line_count;
+            LineReader reader(line, line_end);
+            line = line_end + 1;
+
+            std::string_view keyword = reader.Token();
+            if (keyword == "v" || keyword == "vn")
+            {
+                std::vector<float>& target = keyword == "v" ? chunk.positions : chunk.normals;
+                for (int k = 0; k < 3; ++k)
+                {
+                    float value;
+                    if (!ParseFloat(reader.Token(), value))
+                    {
+                        fail("Number expected");
+                        break;
+                    }
+                    target.push_back(value);
+                }
+            }
+            else if (keyword == "f")
+            {
+                face_positions.clear();
+                face_normals.clear();
+                bool has_normals = true;
+                for (std::string_view corner = reader.Token(); !corner.empty(); corner = reader.Token())
+                {
+                    // v, v/vt, v//vn or v/vt/vn
+                    size_t slash = corner.find('/');
+                    int64_t index;
+                    if (!ParseIndex(corner.substr(0, slash), chunk.positions.size() / 3, index))
+                    {
+                        fail("Wrong vertex index");
+                        break;
+                    }
+                    face_positions.push_back(index);
+
+                    size_t second_slash = slash == std::string_view::npos ? slash : corner.find('/', slash + 1);
+                    if (second_slash == std::string_view::npos || second_slash + 1 == corner.size())
+                    {
+                        has_normals = false;
+                    }
+                    else if (!ParseIndex(corner.substr(second_slash + 1), chunk.normals.size() / 3, index))
+                    {
+                        fail("Wrong normal index");
+                        break;
+                    }
+                    else
+                    {
+                        face_normals.push_back(index);
+                    }
+                }
+                if (!chunk.error.empty())
+                    break;
+                if (face_positions.size() < 3)
+                {
+                    fail("Face with less than 3 vertices");
+                    break;
+                }
+                chunk.missing_normals |= !has_normals;
+
+                // Triangle fan
+                for (size_t i = 1; i + 1 < face_positions.size(); ++i)
+                {
+                    size_t corners[3] = { 0, i, i + 1 };
+                    for (size_t corner : corners)
+                    {
+                        chunk.position_indices.push_back(face_positions[corner]);
+                        if (has_normals)
+                            chunk.normal_indices.push_back(face_normals[corner]);
+                    }
+                    chunk.materials.push_back(material);
+                }
+            }
+            else if (keyword == "usemtl")
+            {
+                std::string name(reader.Rest());
+                auto found = std::find(chunk.material_names.begin(), chunk.material_names.end(), name);
+                material = static_cast<uint32_t>(found - chunk.material_names.begin());
+                if (found == chunk.material_names.end())
+                    chunk.material_names.push_back(name);
+            }
+            else if (keyword == "mtllib")
+            {
+                chunk.libraries.push_back(std::string(reader.Rest()));
+            }
+            // Texture coordinates, groups, smoothing groups, lines and points are not used
+        }
+        chunk.last_material = material;
+    }
+}
+
+bool ObjLoader::Fail(const std::string& message)
+{
+    error = message;
+    return false;
+}
+
+void ObjLoader::LoadMaterialLibrary(const std::string& filename, MeshData& data, std::vector<std::string>& material_names)
+{
+    std::ifstream fin(filename);
+    std::string line;
+    MeshMaterial* material = nullptr;
+    while (std::getline(fin, line))
+    {
+        std::istringstream in(line);
+        std::string keyword;
+        in >> keyword;
+        if (keyword == "newmtl")
+        {
+            std::string name;
+            std::getline(in >> std::ws, name);
+            while (!name.empty() && IsSpace(name.back()))
+                name.pop_back();
+            MeshMaterial record = {};
+            std::strncpy(record.name, name.c_str(), sizeof(record.name) - 1);
+            record.diffuse = glm::dvec3(0.8);
+            data.materials.push_back(record);
+            material_names.push_back(name);
+            material = &data.materials.back();
+        }
+        else if (!material)
+        {
+            continue;
+        }
+        else if (keyword == "Kd")
+        {
+            in >> material->diffuse.x >> material->diffuse.y >> material->diffuse.z;
+        }
+        else if (keyword == "Ks")
+        {
+            in >> material->specular.x >> material->specular.y >> material->specular.z;
+        }
+        else if (keyword == "Ns")
+        {
+            // Phong exponent from 0 to 1000
+            double exponent = 0.0;
+            in >> exponent;
+            material->shininess = glm::clamp(exponent / 128.0, 0.0, 1.0);
+        }
+        else if (keyword == "d")
+        {
+            double opacity = 1.0;
+            in >> opacity;
+            material->transparency = 1.0 - opacity;
+        }
+        else if (keyword == "Tr")
+        {
+            in >> material->transparency;
+        }
+    }
+}
+
+bool ObjLoader::Load(const std::string& filename, MeshData& data)
+{
+    MappedFile file;
+    if (!file.Open(filename))
+        return Fail("Cannot open \"" + filename + "\"");
+
+    // Split the file into chunks at line boundaries
+    const char* begin = file.GetData();
+    const char* end = begin + file.GetSize();
+    size_t chunk_count = std::min<size_t>(file.GetSize() / min_chunk_size + 1, MaxThreads() * chunks_per_thread);
+    std::vector<const char*> bounds(1, begin);
+    for (size_t i = 1; i < chunk_count; ++i)
+    {
+        const char* bound = std::max(bounds.back(), begin + file.GetSize() / chunk_count * i);
+        const char* line_end = static_cast<const char*>(std::memchr(bound, '\n', end - bound));
+        if (!line_end)
+            break;
+        bounds.push_back(line_end + 1);
+    }
+    bounds.push_back(end);
+
+    int count = static_cast<int>(bounds.size() - 1);
+    std::vector<ObjChunk> chunks(count);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < count; i++)
+        ParseChunk(bounds[i], bounds[i + 1], chunks[i]);
+
+    // Offsets of the chunks in the merged arrays
+    std::vector<size_t> position_base(count + 1), normal_base(count + 1), triangle_base(count + 1);
+    size_t line_base = 0;
+    bool has_normals = true;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!chunks[i].error.empty())
+        {
+            return Fail(filename + ":" + std::to_string(line_base + chunks[i].error_line) + ": " + chunks[i].error);
+        }
+        line_base += chunks[i].line_count;
+        position_base[i + 1] = position_base[i] + chunks[i].positions.size() / 3;
+        normal_base[i + 1] = normal_base[i] + chunks[i].normals.size() / 3;
+        triangle_base[i + 1] = triangle_base[i] + chunks[i].materials.size();
+        has_normals &= !chunks[i].missing_normals;
+    }
+    has_normals &= normal_base[count] != 0;
+
+    // Materials: libraries first, then the names used by the faces
+    std::vector<std::string> material_names;
+    for (const ObjChunk& chunk : chunks)
+    {
+        for (const std::string& library : chunk.libraries)
+            LoadMaterialLibrary(DirectoryOf(filename) + library, data, material_names);
+    }
+    bool has_materials = !material_names.empty();
+    std::vector<std::vector<uint32_t>> chunk_materials(count);
+    for (int i = 0; i < count; ++i)
+    {
+        // Names missing from the libraries leave the material of the model
+        for (const std::string& name : chunks[i].material_names)
+        {
+            auto found = std::find(material_names.begin(), material_names.end(), name);
+            chunk_materials[i].push_back(found == material_names.end() ?
+                MeshTriangle::no_material : static_cast<uint32_t>(found - material_names.begin()));
+        }
+    }
+    std::vector<uint32_t> initial_material(count, MeshTriangle::no_material);
+    for (int i = 1; i < count; ++i)
+    {
+        uint32_t last = chunks[i - 1].last_material;
+        initial_material[i] = last == inherited_material ? initial_material[i - 1] : chunk_materials[i - 1][last];
+    }
+
+    data.own_positions.resize(position_base[count] * 3);
+    data.own_normals.resize(has_normals ? normal_base[count] * 3 : 0);
+    data.own_position_indices.resize(triangle_base[count] * 3);
+    data.own_normal_indices.resize(has_normals ? triangle_base[count] * 3 : 0);
+    if (has_materials)
+        data.triangle_materials.resize(triangle_base[count]);
+
+    bool indices_valid = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:indices_valid)
+    for (int i = 0; i < count; i++)
+    {
+        ObjChunk& chunk = chunks[i];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), data.own_positions.begin() + position_base[i] * 3);
+        if (has_normals)
+            std::copy(chunk.normals.begin(), chunk.normals.end(), data.own_normals.begin() + normal_base[i] * 3);
+
+        auto resolve = [&](int64_t index, size_t base, size_t total) {
+            int64_t resolved = index >= absolute_index / 2 ? index - absolute_index : static_cast<int64_t>(base) + index;
+            if (resolved < 0 || resolved >= static_cast<int64_t>(total))
+            {
+                indices_valid = false;
+                return uint32_t(0);
+            }
+            return static_cast<uint32_t>(resolved);
+        };
+        size_t first = triangle_base[i] * 3;
+        for (size_t k = 0; k < chunk.position_indices.size(); ++k)
+            data.own_position_indices[first + k] = resolve(chunk.position_indices[k], position_base[i], position_base[count]);
+        if (has_normals)
+        {
+            for (size_t k = 0; k < chunk.normal_indices.size(); ++k)
+                data.own_normal_indices[first + k] = resolve(chunk.normal_indices[k], normal_base[i], normal_base[count]);
+        }
+
+        if (has_materials)
+        {
+            uint32_t* materials = data.triangle_materials.data() + triangle_base[i];
+            for (size_t k = 0; k < chunk.materials.size(); ++k)
+            {
+                materials[k] = chunk.materials[k] == inherited_material ?
+                    initial_material[i] : chunk_materials[i][chunk.materials[k]];
+            }
+        }
+
+        // Release the memory of the chunk as soon as it is merged
+        chunk = ObjChunk();
+    }
+    if (!indices_valid)
+        return Fail(filename + ": faces refer to missing vertices");
+
+    data.UseOwnArrays();
+    data.ComputeNormals();
+    return true;
+}
@@ -19,8 +19,9 @@ Intersection Model::Intersect(const Ray& ray, bool inverted) const
     intersection.normal = glm::normalize(GetNormalMatrix() * intersection.normal);
     intersection.distance = glm::length2(intersection.coord - ray.origin);
 
-    // Set intersection material
-    intersection.material = surface_material;
+    // Set intersection material, unless the surface has materials of its own
+    if (!intersection.material)
+        intersection.material = surface_material;
 
     return intersection;
 }
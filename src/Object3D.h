@@ -9,6 +9,7 @@
 #include "Types.h"
 #include "Material.h"
 
+struct MeshTriangle;
 
 // Contains all neccessary information about ray-object intersection
 struct Intersection
@@ -17,6 +18,7 @@ struct Intersection
     glm::dvec3 coord;
     glm::dvec3 normal;
     const SurfaceMaterial* material = nullptr;
+    const MeshTriangle* triangle = nullptr;  // hit triangle of a mesh, unless it is in a cluster which may be evicted
     double distance;
     operator bool() const
     {
@@ -37,6 +39,14 @@ public:
     {
         return Intersection();
     }
+
+    // Prepare storage for copies of the acceleration data owned by each of the given number of NUMA nodes
+    virtual void ReserveReplicas(int) {}
+
+    // Copy the acceleration data to the specified node
+    // Must be called from a thread pinned to that node, so the copy is allocated in its local memory
+    virtual void ReplicateForNode(int) {}
+
     virtual ~Surface() {}
 };
 
@@ -95,6 +105,14 @@ public:
         scale = new_scale;
         RenewMatrices();
     }
+    // Set all of the transformation at once, computing the matrices only once
+    void SetTransform(const glm::dvec3& new_position, const glm::dvec3& new_orientation, const glm::dvec3& new_scale)
+    {
+        position = new_position;
+        orientation = new_orientation;
+        scale = new_scale;
+        RenewMatrices();
+    }
 
 private:
     glm::dmat3 model_matrix;
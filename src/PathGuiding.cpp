@@ -0,0 +1,213 @@
+#include "PathGuiding.h"
+#include "glm/gtc/constants.hpp"
+
+#include <cmath>
+
+glm::dvec2 DirectionalQuadtree::ToSquare(const glm::dvec3& direction)
+{
+    const double pi = glm::pi<double>();
+    double phi = std::atan2(direction.y, direction.x);
+    if (phi < 0.0)
+        phi += 2.0 * pi;
+    glm::dvec2 point((glm::clamp(direction.z, -1.0, 1.0) + 1.0) * 0.5, phi / (2.0 * pi));
+    return glm::clamp(point, glm::dvec2(0.0), glm::dvec2(1.0 - 1e-12));
+}
+
+glm::dvec3 DirectionalQuadtree::FromSquare(const glm::dvec2& point)
+{
+    double cos_theta = 2.0 * point.x - 1.0, phi = 2.0 * glm::pi<double>() * point.y;
+    double sin_theta = glm::sqrt(glm::max(0.0, 1.0 - cos_theta * cos_theta));
+    return glm::dvec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+void DirectionalQuadtree::Record(const glm::dvec3& direction, double energy)
+{
+    glm::dvec2 point = ToSquare(direction);
+    int node = 0;
+    while (true)
+    {
+        int x = point.x >= 0.5 ? 1 : 0, y = point.y >= 0.5 ? 1 : 0;
+        int quadrant = x + 2 * y;
+        nodes[node].energy[quadrant].Add(energy);
+        node = nodes[node].children[quadrant];
+        if (node == 0)
+            return;
+        point = point * 2.0 - glm::dvec2(x, y);
+    }
+}
+
+double DirectionalQuadtree::Total() const
+{
+    const Node& root = nodes[0];
+    return root.energy[0].Get() + root.energy[1].Get() + root.energy[2].Get() + root.energy[3].Get();
+}
+
+glm::dvec3 DirectionalQuadtree::Sample(double u, double v) const
+{
+    glm::dvec2 origin(0.0);
+    double size = 1.0;
+    int node = 0;
+    while (true)
+    {
+        const Node& current = nodes[node];
+        double energy[4];
+        for (int q = 0; q < 4; q++)
+            energy[q] = current.energy[q].Get();
+        double total = energy[0] + energy[1] + energy[2] + energy[3];
+        if (total <= 0.0)
+            return FromSquare(origin + glm::dvec2(u, v) * size);
+
+        // Pick the column by its energy, then the quadrant of the column, rescaling the random numbers
+        double left = (energy[0] + energy[2]) / total;
+        int x = u < left ? 0 : 1;
+        u = x == 0 ? u / left : (u - left) / (1.0 - left);
+        double column = energy[x] + energy[x + 2];
+        double bottom = column > 0.0 ? energy[x] / column : 0.5;
+        int y = v < bottom ? 0 : 1;
+        v = y == 0 ? v / bottom : (v - bottom) / (1.0 - bottom);
+        u = glm::clamp(u, 0.0, 1.0 - 1e-12);
+        v = glm::clamp(v, 0.0, 1.0 - 1e-12);
+
+        size *= 0.5;
+        origin += glm::dvec2(x, y) * size;
+        node = current.children[x + 2 * y];
+        if (node == 0)
+            return FromSquare(origin + glm::dvec2(u, v) * size);
+    }
+}
+
+double DirectionalQuadtree::Pdf(const glm::dvec3& direction) const
+{
+    // Density relative to the uniform one is the product of 4 times the part of the energy of every quadrant on the way
+    glm::dvec2 point = ToSquare(direction);
+    double density = 1.0;
+    int node = 0;
+    while (true)
+    {
+        const Node& current = nodes[node];
+        double total = current.energy[0].Get() + current.energy[1].Get() + current.energy[2].Get() + current.energy[3].Get();
+        if (total <= 0.0)
+            break;
+        int x = point.x >= 0.5 ? 1 : 0, y = point.y >= 0.5 ? 1 : 0;
+        int quadrant = x + 2 * y;
+        density *= 4.0 * current.energy[quadrant].Get() / total;
+        node = current.children[quadrant];
+        if (node == 0 || density == 0.0)
+            break;
+        point = point * 2.0 - glm::dvec2(x, y);
+    }
+    return density / (4.0 * glm::pi<double>());
+}
+
+void DirectionalQuadtree::Refine(double threshold, int max_depth)
+{
+    double total = Total();
+    if (total <= 0.0)
+        return;
+
+    // The new nodes are made by the energy of the old quadrants; the quadrants which were leaves
+    // share their energy evenly between their own quadrants if they are split further
+    struct Pending
+    {
+        int node;
+        int old_node;  // -1 if the old tree had no node here
+        double energy;
+        int depth;
+    };
+    std::vector<Node> refined(1);
+    std::vector<Pending> pending = { { 0, 0, total, 1 } };
+    while (!pending.empty())
+    {
+        Pending item = pending.back();
+        pending.pop_back();
+        for (int q = 0; q < 4; q++)
+        {
+            double energy = item.old_node >= 0 ? nodes[item.old_node].energy[q].Get() : item.energy / 4.0;
+            if (item.depth >= max_depth || energy <= threshold * total)
+                continue;
+            int child = static_cast<int>(refined.size());
+            refined[item.node].children[q] = child;
+            refined.emplace_back();
+            int old_child = item.old_node >= 0 && nodes[item.old_node].children[q] != 0 ? nodes[item.old_node].children[q] : -1;
+            pending.push_back({ child, old_child, energy, item.depth + 1 });
+        }
+    }
+    nodes.swap(refined);
+}
+
+void GuidingTree::Reset()
+{
+    nodes.assign(1, Node());
+    leaves.clear();
+    leaves.emplace_back();
+    passes = 0;
+}
+
+void GuidingTree::SetBounds(const glm::dvec3& new_lower, const glm::dvec3& new_upper)
+{
+    lower = new_lower;
+    upper = new_upper;
+}
+
+GuidingTree::Leaf& GuidingTree::Lookup(const glm::dvec3& position)
+{
+    glm::dvec3 point = glm::clamp((position - lower) / glm::max(upper - lower, glm::dvec3(1e-12)),
+        glm::dvec3(0.0), glm::dvec3(1.0));
+    int node = 0;
+    while (nodes[node].children != 0)
+    {
+        int axis = nodes[node].axis;
+        if (point[axis] < 0.5)
+        {
+            point[axis] *= 2.0;
+            node = nodes[node].children;
+        }
+        else
+        {
+            point[axis] = point[axis] * 2.0 - 1.0;
+            node = nodes[node].children + 1;
+        }
+    }
+    return leaves[nodes[node].leaf];
+}
+
+void GuidingTree::Split(int node, double split_samples)
+{
+    int leaf = nodes[node].leaf;
+    if (leaves[leaf].samples.Get() <= split_samples)
+        return;
+
+    // Both halves start with the quadtrees of the leaf and a half of its records
+    int axis = nodes[node].axis;
+    int children = static_cast<int>(nodes.size());
+    nodes.resize(nodes.size() + 2);
+    nodes[node].children = children;
+    leaves[leaf].samples.value.store(leaves[leaf].samples.Get() / 2.0);
+    Leaf copy = leaves[leaf];
+    leaves.push_back(copy);
+    for (int k = 0; k < 2; k++)
+    {
+        nodes[children + k].axis = (axis + 1) % 3;
+        nodes[children + k].leaf = k == 0 ? leaf : static_cast<int>(leaves.size()) - 1;
+    }
+    Split(children, split_samples);
+    Split(children + 1, split_samples);
+}
+
+void GuidingTree::Refine(double split_samples, double threshold, int max_depth)
+{
+    size_t node_count = nodes.size();
+    for (size_t i = 0; i < node_count; i++)
+    {
+        if (nodes[i].children == 0)
+            Split(static_cast<int>(i), split_samples);
+    }
+
+    for (Leaf& leaf : leaves)
+    {
+        leaf.sampling = leaf.building;
+        leaf.building.Refine(threshold, max_depth);
+        leaf.samples.value.store(0.0);
+    }
+    passes++;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+/*
+    PathGuiding.h
+    Incident light learned by spatial-directional trees for guiding the path tracer (Muller et al.)
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include <vector>
+#include <atomic>
+
+// Double added to by many threads at once
+struct AtomicDouble
+{
+    AtomicDouble() = default;
+    AtomicDouble(const AtomicDouble& other) : value(other.Get()) {}
+
+    AtomicDouble& operator=(const AtomicDouble& other)
+    {
+        value.store(other.Get(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void Add(double x)
+    {
+        double old = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(old, old + x, std::memory_order_relaxed))
+            ;
+    }
+
+    double Get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<double> value{ 0.0 };
+};
+
+// Distribution of the directions by a quadtree over the unit square,
+// which is mapped to the sphere by (cos theta, phi) preserving the areas
+// Every node keeps the energy recorded in its quadrants; a quadrant is either a leaf or a child node
+class DirectionalQuadtree
+{
+public:
+    DirectionalQuadtree() : nodes(1) {}
+
+    // Add the energy arriving from the direction; may be called by many threads at once
+    void Record(const glm::dvec3& direction, double energy);
+
+    // Direction distributed by the recorded energy for two random numbers in [0, 1)
+    // The directions are uniform while nothing is recorded
+    glm::dvec3 Sample(double u, double v) const;
+
+    // Density of the direction sampled by Sample (per solid angle)
+    double Pdf(const glm::dvec3& direction) const;
+
+    double Total() const;
+
+    // Rebuild the nodes by the recorded energy and clear it: the quadrants with more than threshold
+    // of the total energy are split (down to max_depth), the rest become leaves
+    void Refine(double threshold, int max_depth);
+
+    size_t NodeCount() const
+    {
+        return nodes.size();
+    }
+
+private:
+    struct Node
+    {
+        AtomicDouble energy[4];  // quadrant x + 2 * y
+        int children[4] = { 0, 0, 0, 0 };  // child nodes of the quadrants, zero for leaves
+    };
+
+    static glm::dvec2 ToSquare(const glm::dvec3& direction);
+    static glm::dvec3 FromSquare(const glm::dvec2& point);
+
+    std::vector<Node> nodes;
+};
+
+// Binary tree over the box of the scene splitting the cells in halves by the axes in turn
+// Every leaf keeps the quadtree learned by the last pass, which is sampled, and the quadtree
+// recorded by the current pass, which replaces it by Refine
+class GuidingTree
+{
+public:
+    struct Leaf
+    {
+        DirectionalQuadtree sampling;
+        DirectionalQuadtree building;
+        AtomicDouble samples;  // number of records of the current pass
+    };
+
+    // Start over with a single leaf
+    void Reset();
+
+    // Set the box split by the tree; must be set before the leaves are split by Refine
+    void SetBounds(const glm::dvec3& lower, const glm::dvec3& upper);
+
+    // Leaf of the point; the points out of the box belong to the nearest leaves
+    Leaf& Lookup(const glm::dvec3& position);
+
+    // Finish the pass: split the leaves with more than split_samples records,
+    // then make the recorded quadtrees sampled and refine their structure for the next pass
+    void Refine(double split_samples, double threshold, int max_depth);
+
+    size_t LeafCount() const
+    {
+        return leaves.size();
+    }
+
+    // Check whether any pass was finished, so the leaves have something to sample
+    bool Trained() const
+    {
+        return passes > 0;
+    }
+
+private:
+    struct Node
+    {
+        int axis = 0;
+        int children = 0;  // index of the first of the two child nodes, zero for leaves
+        int leaf = 0;
+    };
+
+    void Split(int node, double split_samples);
+
+    glm::dvec3 lower = glm::dvec3(0.0), upper = glm::dvec3(1.0);
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    int passes = 0;
+};
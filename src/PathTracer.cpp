@@ -0,0 +1,431 @@
+#include "Renderer.h"
+#include "Threads.h"
+
+#include <limits>
+
+using namespace glm;
+
+namespace
+{
+    // Direction of the polar angle with the specified cosine and the azimuth phi around the axis
+    dvec3 AroundAxis(const dvec3& axis, double cos_theta, double phi)
+    {
+        dvec3 tangent = glm::normalize(glm::cross(std::abs(axis.x) > 0.5 ? dvec3(0.0, 1.0, 0.0) : dvec3(1.0, 0.0, 0.0), axis));
+        dvec3 bitangent = glm::cross(axis, tangent);
+        double sin_theta = glm::sqrt(glm::max(0.0, 1.0 - cos_theta * cos_theta));
+        return tangent * (sin_theta * glm::cos(phi)) + bitangent * (sin_theta * glm::sin(phi)) + axis * cos_theta;
+    }
+
+    // Weight of the strategy with density pdf against the other strategy with density other_pdf
+    double PowerHeuristic(double pdf, double other_pdf)
+    {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+    }
+
+    // Diffuse or glossy vertex of a guided path and the path state after its bounce
+    struct GuidedVertex
+    {
+        GuidingTree::Leaf* leaf;
+        dvec3 direction;
+        double pdf;
+        dvec3 radiance;  // light of the path found before the bounce
+        dvec3 throughput;
+    };
+}
+
+void PathTracer::Render(uvec2 res)
+{
+    PrepareShadowRays();
+    if (!pathGuiding)
+    {
+        RayTracer::Render(res);
+        return;
+    }
+
+    // Every learning pass has twice the samples of the one before, while the next one fits in the rest
+    const double inf = std::numeric_limits<double>::infinity();
+    ImageWriter* stream = imageStream;
+    imageStream = nullptr;
+    int total_samples = samplesPerPixel;
+    std::uint64_t seed = sampler.seed;
+    guidingTree.Reset();
+    guidingBounds.assign(MaxThreads(), BoundingBox{ { dvec3(inf), dvec3(-inf) } });
+    PrepareFrame(res);
+
+    // All passes are unbiased, so the framebuffer accumulates their images weighted by their samples;
+    // only the last pass streams the finished rows
+    int pass_samples = 1, done = 0;
+    for (int pass = 0;; pass++)
+    {
+        int remaining = total_samples - done;
+        guidingTraining = remaining >= 3 * pass_samples;
+        if (!guidingTraining)
+            pass_samples = remaining;
+        samplesPerPixel = pass_samples;
+        sampler.seed = seed + pass;
+        accumulatedSamples = done;
+        if (!guidingTraining)
+            imageStream = stream;
+        RenderFrame();
+        done += pass_samples;
+        if (!guidingTraining)
+            break;
+
+        if (pass == 0)
+        {
+            BoundingBox box = guidingBounds[0];
+            for (auto& bounds : guidingBounds)
+            {
+                box.bounds[0] = glm::min(box.bounds[0], bounds.bounds[0]);
+                box.bounds[1] = glm::max(box.bounds[1], bounds.bounds[1]);
+            }
+            if (box.bounds[0].x <= box.bounds[1].x)
+            {
+                dvec3 margin = (box.bounds[1] - box.bounds[0]) * 0.01 + TRACER_EPSILON;
+                guidingTree.SetBounds(box.bounds[0] - margin, box.bounds[1] + margin);
+            }
+        }
+        guidingTree.Refine(guidingSplitSamples * glm::sqrt(double(pass_samples)), 0.01, 20);
+        pass_samples *= 2;
+    }
+    samplesPerPixel = total_samples;
+    sampler.seed = seed;
+    accumulatedSamples = 0;
+}
+
+dvec3 PathTracer::TraceSample(const Ray& camera_ray, uvec2 pixel, int sample, SceneEntities* touched)
+{
+    const double pi = glm::pi<double>();
+    // The sky is sampled uniformly over the hemisphere of the point
+    const double sky_pdf = 1.0 / (2.0 * pi);
+
+    RandomStream random(std::uint64_t(pixel.y) * resolution.x + pixel.x, sample, sampler.seed);
+    Ray ray = camera_ray;
+    dvec3 radiance(0.0), throughput(1.0);
+    dvec3 roulette_throughput(1.0);  // throughput the path would have if its bounces were not guided
+    double bounce_pdf = 0.0;  // density of the direction of the ray sampled by the last bounce, zero for specular ones
+    std::vector<GuidedVertex> guided;
+
+    for (int bounce = 0; bounce < maxRenderStep; bounce++)
+    {
+        random.SetBounce(bounce);
+
+        Intersection intersection;
+        Object3D* intersected_object = FindIntersection(ray, intersection);
+        if (!intersection)
+        {
+            // The sky found by a diffuse or glossy bounce was also sampled by the shadow rays of the last point
+            double weight = bounce_pdf > 0.0 && nextEventEstimation ? PowerHeuristic(bounce_pdf, sky_pdf) : 1.0;
+            radiance += throughput * backgroundColor * weight;
+            break;
+        }
+        if (!intersection.material)
+            break;
+        if (glm::dot(ray.direction, intersection.normal) > 0.0)
+            intersection.normal = -intersection.normal;
+
+        SurfacePassage passage = PassSurface(ray, intersection, intersected_object);
+        if (touched)
+        {
+            touched->objects.insert(intersected_object);
+            touched->surface_materials.insert(intersection.material);
+            touched->inside_materials.insert(ray.current_object_insides.top()->material);
+            touched->inside_materials.insert(passage.insides.top()->material);
+        }
+
+        const SurfaceMaterial& material = *intersection.material;
+        const dvec3& point = intersection.coord;
+        const dvec3& normal = intersection.normal;
+        dvec3 view = ray.direction;
+        Lobes lobes = GetLobes(material, passage);
+
+        GuidingTree::Leaf* leaf = nullptr;
+        const DirectionalQuadtree* guide = nullptr;
+        if (pathGuiding && lobes.diffuse + lobes.glossy > 0.0)
+        {
+            leaf = &guidingTree.Lookup(point);
+            if (guidingTree.Trained())
+                guide = &leaf->sampling;
+            if (guidingTraining && !guidingTree.Trained())
+            {
+                BoundingBox& box = guidingBounds[ThreadIndex()];
+                box.bounds[0] = glm::min(box.bounds[0], point);
+                box.bounds[1] = glm::max(box.bounds[1], point);
+            }
+        }
+
+        if (nextEventEstimation && lobes.diffuse + lobes.glossy > 0.0)
+            radiance += throughput * SampleLights(material, lobes, point, normal, view, ray.current_object_insides, random, guide);
+
+        Ray next;
+        dvec3 weight;
+        if (!Scatter(material, lobes, ray, intersection, passage, random, next, weight, bounce_pdf, guide))
+            break;
+        throughput *= weight;
+        if (leaf && guidingTraining && bounce_pdf > 0.0)
+            guided.push_back({ leaf, next.direction, bounce_pdf, radiance, throughput });
+
+        // Guided bounces have small throughputs in the directions they favour, which should not be terminated
+        // more often than by the material alone
+        double material_pdf = guide && bounce_pdf > 0.0 ? Pdf(material, lobes, normal, view, next.direction) : 0.0;
+        roulette_throughput *= material_pdf > 0.0 ? weight * (bounce_pdf / material_pdf) : weight;
+
+        // Paths of little throughput are terminated randomly, the rest carry their light
+        if (bounce + 1 >= rouletteDepth)
+        {
+            double survival = glm::min(0.95, MaxComponent(roulette_throughput));
+            if (random.Next() >= survival)
+                break;
+            throughput /= survival;
+            roulette_throughput /= survival;
+        }
+        ray = next;
+    }
+
+    // The light found after a bounce divided by the throughput after it is the light incident at the vertex
+    for (auto& vertex : guided)
+    {
+        dvec3 incident = (radiance - vertex.radiance) / glm::max(vertex.throughput, dvec3(1e-300));
+        double energy = (incident.x + incident.y + incident.z) / 3.0 / vertex.pdf;
+        vertex.leaf->building.Record(vertex.direction, energy);
+        vertex.leaf->samples.Add(1.0);
+    }
+    return radiance;
+}
+
+bool PathTracer::Scatter(const SurfaceMaterial& material, const Lobes& lobes, const Ray& ray, const Intersection& intersection,
+    SurfacePassage& passage, RandomStream& random, Ray& next, dvec3& weight, double& pdf, const DirectionalQuadtree* guide) const
+{
+    const double pi = glm::pi<double>();
+    const dvec3& normal = intersection.normal;
+    const dvec3& view = ray.direction;
+
+    // Pick the kind of scattering, then the direction
+    double u = random.Next();
+    next.origin = intersection.coord;
+    pdf = 0.0;
+    if (u < lobes.mirror)
+    {
+        next.direction = glm::reflect(view, normal);
+        next.current_object_insides = ray.current_object_insides;
+        weight = lobes.mirror_color / lobes.mirror;
+        return true;
+    }
+    if (u < lobes.mirror + lobes.refraction)
+    {
+        next.direction = glm::refract(view, normal, passage.relative_refractive_index);
+        std::swap(next.current_object_insides, passage.insides);
+        weight = lobes.refraction_color / lobes.refraction;
+        return true;
+    }
+    if (lobes.diffuse + lobes.glossy <= 0.0)
+        return false;
+
+    double v = random.Next(), w = random.Next();
+    if (guide && random.Next() < guidingFraction)
+        next.direction = guide->Sample(v, w);
+    else if (u < lobes.mirror + lobes.refraction + lobes.diffuse)
+        next.direction = AroundAxis(normal, glm::sqrt(1.0 - v), 2.0 * pi * w);
+    else
+        next.direction = AroundAxis(glm::reflect(view, normal), glm::pow(v, 1.0 / (material.shininess + 1.0)), 2.0 * pi * w);
+
+    double cosine = glm::dot(normal, next.direction);
+    pdf = GuidedPdf(material, lobes, normal, view, next.direction, guide);
+    if (cosine <= 0.0 || pdf <= 0.0)
+        return false;
+    next.current_object_insides = ray.current_object_insides;
+    weight = Evaluate(material, normal, view, next.direction) * (cosine / pdf);
+    return true;
+}
+
+PathTracer::Lobes PathTracer::GetLobes(const SurfaceMaterial& material, const SurfacePassage& passage) const
+{
+    Lobes lobes;
+    lobes.mirror_color = material.transparency_color * passage.R + material.reflective_color;
+    lobes.refraction_color = material.transparency_color * passage.T;
+
+    // The kinds are picked by their largest color components;
+    // the Phong lobe reflects about 2 / (shininess + 2) of its specular color
+    lobes.diffuse = MaxComponent(material.diffuse);
+    lobes.glossy = MaxComponent(material.specular) * 2.0 / (material.shininess + 2.0);
+    lobes.mirror = MaxComponent(lobes.mirror_color);
+    lobes.refraction = MaxComponent(lobes.refraction_color);
+    double total = lobes.diffuse + lobes.glossy + lobes.mirror + lobes.refraction;
+    if (total <= 0.0)
+        return Lobes();
+    lobes.diffuse /= total;
+    lobes.glossy /= total;
+    lobes.mirror /= total;
+    lobes.refraction /= total;
+    return lobes;
+}
+
+dvec3 PathTracer::Evaluate(const SurfaceMaterial& material, const dvec3& normal, const dvec3& view, const dvec3& wi) const
+{
+    // Lambert and Phong reflectances matching the direct light of SurfaceMaterial::Color,
+    // whose point lights have the intensity of pi times their color
+    const double pi = glm::pi<double>();
+    dvec3 reflectance = material.diffuse / pi;
+    double cos_alpha = glm::dot(glm::reflect(view, normal), wi);
+    if (cos_alpha > 0.0)
+        reflectance += material.specular * (glm::pow(cos_alpha, material.shininess) / pi);
+    return reflectance;
+}
+
+double PathTracer::Pdf(const SurfaceMaterial& material, const Lobes& lobes, const dvec3& normal, const dvec3& view,
+    const dvec3& wi) const
+{
+    const double pi = glm::pi<double>();
+    double cosine = glm::dot(normal, wi);
+    if (cosine <= 0.0)
+        return 0.0;
+    double pdf = lobes.diffuse * cosine / pi;
+    double cos_alpha = glm::dot(glm::reflect(view, normal), wi);
+    if (cos_alpha > 0.0)
+        pdf += lobes.glossy * (material.shininess + 1.0) / (2.0 * pi) * glm::pow(cos_alpha, material.shininess);
+    return pdf;
+}
+
+double PathTracer::GuidedPdf(const SurfaceMaterial& material, const Lobes& lobes, const dvec3& normal, const dvec3& view,
+    const dvec3& wi, const DirectionalQuadtree* guide) const
+{
+    double pdf = Pdf(material, lobes, normal, view, wi);
+    if (!guide)
+        return pdf;
+    return (1.0 - guidingFraction) * pdf + guidingFraction * (lobes.diffuse + lobes.glossy) * guide->Pdf(wi);
+}
+
+dvec3 PathTracer::SampleLights(const SurfaceMaterial& material, const Lobes& lobes, const dvec3& point,
+    const dvec3& normal, const dvec3& view, const std::stack<Object3D*>& insides, RandomStream& random,
+    const DirectionalQuadtree* guide)
+{
+    const double pi = glm::pi<double>();
+    dvec3 radiance(0.0);
+
+    // Point lights can not be found by the bounces, so their shadow rays take the whole weight
+    auto add_light = [&](int index, double weight) {
+        const PointLight& light = scene->lights[index];
+        dvec3 offset = light.center - point;
+        double distance = glm::length(offset);
+        dvec3 wi = offset / distance;
+        double cosine = glm::dot(normal, wi);
+        if (cosine <= 0.0 || !Visible(point, wi, distance, insides, index))
+            return;
+        radiance += Evaluate(material, normal, view, wi) * light.color * (pi * cosine * weight / (distance * distance));
+    };
+    if (lightTreeSampling)
+    {
+        for (int sample = 0; sample < lightSamples; sample++)
+        {
+            double probability;
+            int index = lightTree.Sample(point, normal, lightCullFraction, random.Next(), probability);
+            if (index >= 0)
+                add_light(index, 1.0 / (probability * lightSamples));
+        }
+    }
+    else
+    {
+        for (int index = 0; index < static_cast<int>(scene->lights.size()); index++)
+            add_light(index, 1.0);
+    }
+
+    // The sky: a uniform direction of the hemisphere weighted against the chance of the bounce to find it
+    if (MaxComponent(backgroundColor) > 0.0)
+    {
+        const double sky_pdf = 1.0 / (2.0 * pi);
+        dvec3 wi = AroundAxis(normal, random.Next(), 2.0 * pi * random.Next());
+        double cosine = glm::dot(normal, wi);
+        if (cosine > 0.0 && Visible(point, wi, std::numeric_limits<double>::infinity(), insides))
+        {
+            double weight = PowerHeuristic(sky_pdf, GuidedPdf(material, lobes, normal, view, wi, guide));
+            radiance += Evaluate(material, normal, view, wi) * backgroundColor * (cosine * weight / sky_pdf);
+        }
+    }
+    return radiance;
+}
+
+bool PathTracer::Visible(const dvec3& point, const dvec3& direction, double distance, const std::stack<Object3D*>& insides,
+    int light)
+{
+    Ray shadow(point, direction);
+    shadow.current_object_insides = insides;
+
+    // Neighbouring points are mostly blocked from a light by the same object, so its occluder is tried first;
+    // any hit closer than the light blocks it, whether it is the nearest or not
+    ShadowOccluder* occluder = nullptr;
+    if (light >= 0 && shadowCaching)
+    {
+        int thread = ThreadIndex();
+        if (thread < static_cast<int>(shadowCache.size()) && light < static_cast<int>(shadowCache[thread].size()))
+            occluder = &shadowCache[thread][light];
+    }
+    if (occluder && occluder->object && Occludes(*occluder, shadow, distance))
+        return false;
+
+    Intersection intersection;
+    Object3D* blocker = nullptr;
+    if (light >= 0 && light < static_cast<int>(lightBuffers.size()))
+    {
+        // Only the candidates of the cell of the direction from the light can block it
+        for (Object3D* object : lightBuffers[light].Find(point - scene->lights[light].center))
+        {
+            intersection = object->surface->Intersect(shadow, insides.top() == object);
+            if (intersection && glm::distance(point, intersection.coord) < distance)
+            {
+                blocker = object;
+                break;
+            }
+        }
+    }
+    else
+    {
+        Object3D* intersected_object = FindIntersection(shadow, intersection);
+        if (intersection && glm::distance(point, intersection.coord) < distance)
+            blocker = intersected_object;
+    }
+    if (!blocker)
+        return true;
+
+    if (occluder)
+    {
+        occluder->object = blocker;
+        occluder->model = intersection.triangle ? dynamic_cast<Model*>(blocker->surface) : nullptr;
+        if (occluder->model)
+            occluder->triangle = *intersection.triangle;
+    }
+    return false;
+}
+
+bool PathTracer::Occludes(const ShadowOccluder& occluder, const Ray& shadow, double distance)
+{
+    bool inverted = shadow.current_object_insides.top() == occluder.object;
+    Intersection intersection;
+    if (occluder.model)
+    {
+        // The triangle is tested in the local space of the model, as the mesh tests it
+        Model& model = *occluder.model;
+        Ray local;
+        local.direction = model.GetModelMatrixInverse() * shadow.direction;
+        local.origin = model.GetModelMatrixInverse() * (shadow.origin - model.GetPosition());
+        intersection = MeshOctree::IntersectTriangle(local, occluder.triangle, inverted);
+        if (intersection)
+            intersection.coord = model.GetModelMatrix() * intersection.coord + model.GetPosition();
+    }
+    else
+        intersection = occluder.object->surface->Intersect(shadow, inverted);
+    return intersection && glm::distance(shadow.origin, intersection.coord) < distance;
+}
+
+void PathTracer::PrepareShadowRays()
+{
+    shadowCache.assign(MaxThreads(), std::vector<ShadowOccluder>(shadowCaching ? scene->lights.size() : 0));
+
+    lightBuffers.clear();
+    if (lightBufferResolution <= 0)
+        return;
+    int light_count = static_cast<int>(scene->lights.size());
+    lightBuffers.resize(light_count);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < light_count; i++)
+        lightBuffers[i].Build(scene->lights[i].center, scene->objects, lightBufferResolution);
+}
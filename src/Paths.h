@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+    Paths.h
+    Helpers for the paths of the files referenced by scenes and meshes
+    Author: Artyom Bishev
+*/
+
+#include <string>
+
+// Directory part of the path, including the trailing separator
+inline std::string DirectoryOf(const std::string& path)
+{
+    size_t separator = path.find_last_of("/\\");
+    return separator == std::string::npos ? std::string() : path.substr(0, separator + 1);
+}
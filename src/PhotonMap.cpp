@@ -0,0 +1,269 @@
+#include "PhotonMap.h"
+#include "glm/gtc/constants.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // Minimal number of photons of a meaningful estimate
+    const int min_estimate_photons = 8;
+
+    // Sines and cosines of the quantized angles of the directions
+    struct DirectionTables
+    {
+        double cos_theta[256], sin_theta[256], cos_phi[256], sin_phi[256];
+
+        DirectionTables()
+        {
+            const double pi = glm::pi<double>();
+            for (int i = 0; i < 256; ++i)
+            {
+                double theta = (i + 0.5) * pi / 256.0;
+                double phi = (i + 0.5) * 2.0 * pi / 256.0;
+                cos_theta[i] = std::cos(theta);
+                sin_theta[i] = std::sin(theta);
+                cos_phi[i] = std::cos(phi);
+                sin_phi[i] = std::sin(phi);
+            }
+        }
+    };
+
+    const DirectionTables& GetDirectionTables()
+    {
+        static const DirectionTables tables;
+        return tables;
+    }
+}
+
+void Photon::SetPosition(const glm::dvec3& value)
+{
+    for (int k = 0; k < 3; ++k)
+        position[k] = static_cast<float>(value[k]);
+}
+
+void Photon::SetPower(const glm::dvec3& value)
+{
+    double largest = glm::max(value.x, glm::max(value.y, value.z));
+    if (largest < 1e-32)
+    {
+        power[0] = power[1] = power[2] = power[3] = 0;
+        return;
+    }
+    int exponent;
+    double scale = std::frexp(largest, &exponent) * 256.0 / largest;
+    for (int k = 0; k < 3; ++k)
+        power[k] = static_cast<uint8_t>(glm::clamp(value[k] * scale, 0.0, 255.0));
+    power[3] = static_cast<uint8_t>(glm::clamp(exponent + 128, 0, 255));
+}
+
+glm::dvec3 Photon::GetPower() const
+{
+    if (power[3] == 0)
+        return glm::dvec3(0.0);
+    double scale = std::ldexp(1.0, power[3] - (128 + 8));
+    return glm::dvec3(power[0] + 0.5, power[1] + 0.5, power[2] + 0.5) * scale;
+}
+
+void Photon::SetDirection(const glm::dvec3& value)
+{
+    const double pi = glm::pi<double>();
+    double theta = std::acos(glm::clamp(value.z, -1.0, 1.0));
+    double phi = std::atan2(value.y, value.x);
+    if (phi < 0.0)
+        phi += 2.0 * pi;
+    this->theta = static_cast<uint8_t>(glm::min(theta * 256.0 / pi, 255.0));
+    this->phi = static_cast<uint8_t>(glm::min(phi * 256.0 / (2.0 * pi), 255.0));
+}
+
+glm::dvec3 Photon::GetDirection() const
+{
+    const DirectionTables& tables = GetDirectionTables();
+    return glm::dvec3(
+        tables.sin_theta[theta] * tables.cos_phi[phi],
+        tables.sin_theta[theta] * tables.sin_phi[phi],
+        tables.cos_theta[theta]);
+}
+
+void PhotonMap::Store(const std::vector<Photon>& new_photons)
+{
+    photons.insert(photons.end(), new_photons.begin(), new_photons.end());
+}
+
+void PhotonMap::Balance()
+{
+    // The decoding tables are built before the threads start to gather
+    GetDirectionTables();
+    BalanceRange(0, photons.size());
+}
+
+void PhotonMap::BalanceRange(size_t begin, size_t end)
+{
+    if (end - begin <= 1)
+    {
+        if (begin < end)
+            photons[begin].plane = 0;
+        return;
+    }
+
+    // Split along the axis of the largest extent of the photons
+    glm::dvec3 lower = photons[begin].GetPosition(), upper = lower;
+    for (size_t i = begin + 1; i < end; ++i)
+    {
+        lower = glm::min(lower, photons[i].GetPosition());
+        upper = glm::max(upper, photons[i].GetPosition());
+    }
+    glm::dvec3 extent = upper - lower;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+    size_t median = begin + (end - begin) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + median, photons.begin() + end,
+        [axis](const Photon& a, const Photon& b) { return a.position[axis] < b.position[axis]; });
+    photons[median].plane = static_cast<uint8_t>(axis);
+
+    BalanceRange(begin, median);
+    BalanceRange(median + 1, end);
+}
+
+// Max-heap of the nearest photons found so far
+struct PhotonMap::Query
+{
+    glm::vec3 position;
+    float max_distance2;
+    size_t max_count;
+    std::vector<std::pair<float, const Photon*>>& heap;
+};
+
+void PhotonMap::LocateRange(size_t begin, size_t end, Query& query) const
+{
+    while (begin < end)
+    {
+        size_t median = begin + (end - begin) / 2;
+        const Photon& photon = photons[median];
+
+        glm::vec3 offset = glm::vec3(photon.position[0], photon.position[1], photon.position[2]) - query.position;
+        float distance2 = glm::dot(offset, offset);
+        if (distance2 < query.max_distance2)
+        {
+            query.heap.emplace_back(distance2, &photon);
+            std::push_heap(query.heap.begin(), query.heap.end());
+            if (query.heap.size() > query.max_count)
+            {
+                std::pop_heap(query.heap.begin(), query.heap.end());
+                query.heap.pop_back();
+            }
+            // Once the heap is full, only photons closer than the farthest one are useful
+            if (query.heap.size() == query.max_count)
+                query.max_distance2 = query.heap.front().first;
+        }
+
+        if (end - begin == 1)
+            return;
+
+        // Visit the side of the splitting plane with the position first, then the other one if it is close enough
+        float delta = query.position[photon.plane] - photon.position[photon.plane];
+        size_t near_begin = delta < 0.0f ? begin : median + 1, near_end = delta < 0.0f ? median : end;
+        size_t far_begin = delta < 0.0f ? median + 1 : begin, far_end = delta < 0.0f ? end : median;
+        LocateRange(near_begin, near_end, query);
+        if (delta * delta >= query.max_distance2)
+            return;
+        begin = far_begin;
+        end = far_end;
+    }
+}
+
+double PhotonMap::Locate(const glm::dvec3& position, double max_distance, int max_count,
+    std::vector<const Photon*>& found) const
+{
+    thread_local std::vector<std::pair<float, const Photon*>> heap;
+    heap.clear();
+    found.clear();
+    if (photons.empty() || max_count <= 0)
+        return 0.0;
+
+    Query query = { glm::vec3(position), static_cast<float>(max_distance * max_distance),
+        static_cast<size_t>(max_count), heap };
+    LocateRange(0, photons.size(), query);
+
+    double farthest2 = 0.0;
+    for (const auto& entry : heap)
+    {
+        found.push_back(entry.second);
+        farthest2 = glm::max(farthest2, static_cast<double>(entry.first));
+    }
+    return farthest2;
+}
+
+void ProjectionMap::Build(int new_resolution, const std::function<bool(const glm::dvec3&)>& hits)
+{
+    resolution = new_resolution;
+    int rows = resolution, columns = 2 * resolution;
+    std::vector<uint8_t> hit(rows * columns, 0);
+
+    // Each cell is sampled at the centers of its quarters
+    const int subsamples = 2;
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < rows; row++)
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            for (int k = 0; k < subsamples * subsamples && !hit[row * columns + column]; k++)
+            {
+                double u = (row + (k / subsamples + 0.5) / subsamples) / rows;
+                double v = (column + (k % subsamples + 0.5) / subsamples) / columns;
+                if (hits(Direction(u, v)))
+                    hit[row * columns + column] = 1;
+            }
+        }
+    }
+
+    // Extend the hit cells by their neighbours; the columns wrap around the azimuth
+    marked.clear();
+    for (int row = 0; row < rows; row++)
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            bool near_hit = false;
+            for (int dr = -1; dr <= 1 && !near_hit; dr++)
+            {
+                int r = row + dr;
+                if (r < 0 || r >= rows)
+                    continue;
+                for (int dc = -1; dc <= 1 && !near_hit; dc++)
+                    near_hit = hit[r * columns + (column + dc + columns) % columns] != 0;
+            }
+            if (near_hit)
+                marked.push_back(row * columns + column);
+        }
+    }
+}
+
+glm::dvec3 ProjectionMap::Sample(double u, double v, double w) const
+{
+    int columns = 2 * resolution;
+    int cell = marked[glm::min(static_cast<size_t>(u * marked.size()), marked.size() - 1)];
+    return Direction((cell / columns + v) / resolution, (cell % columns + w) / columns);
+}
+
+glm::dvec3 ProjectionMap::Direction(double u, double v)
+{
+    double z = 1.0 - 2.0 * u, r = glm::sqrt(glm::max(0.0, 1.0 - z * z)), phi = 2.0 * glm::pi<double>() * v;
+    return glm::dvec3(r * glm::cos(phi), r * glm::sin(phi), z);
+}
+
+glm::dvec3 PhotonMap::Irradiance(const glm::dvec3& position, const glm::dvec3& normal,
+    double max_distance, int max_photons) const
+{
+    thread_local std::vector<const Photon*> found;
+    double radius2 = Locate(position, max_distance, max_photons, found);
+    if (static_cast<int>(found.size()) < min_estimate_photons || radius2 <= 0.0)
+        return glm::dvec3(0.0);
+
+    glm::dvec3 flux(0.0);
+    for (const Photon* photon : found)
+    {
+        if (glm::dot(photon->GetDirection(), normal) < 0.0)
+            flux += photon->GetPower();
+    }
+    return flux / (glm::pi<double>() * radius2);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+    PhotonMap.h
+    Photons stored by the light tracing pass and the kd-tree used to gather them
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+// Photon in a compact form of 20 bytes
+// The power is kept in shared exponent format (RGBE), the direction of incidence in spherical coordinates
+struct Photon
+{
+    float position[3];
+    uint8_t power[4];   // RGB mantissas and the shared exponent
+    uint8_t theta, phi; // direction of incidence
+    uint8_t plane;      // splitting axis of the kd-tree node
+    uint8_t reserved;
+
+    void SetPosition(const glm::dvec3& value);
+    void SetPower(const glm::dvec3& value);
+    void SetDirection(const glm::dvec3& value);
+
+    glm::dvec3 GetPosition() const
+    {
+        return glm::dvec3(position[0], position[1], position[2]);
+    }
+    glm::dvec3 GetPower() const;
+    glm::dvec3 GetDirection() const;
+};
+
+static_assert(sizeof(Photon) == 20, "Photon must stay compact");
+
+// Photons at the surfaces of the scene organized in a balanced kd-tree
+// The tree is implicit: the node of a range of photons is its median, which splits the range
+// into the left and the right subtrees, so no pointers are stored
+class PhotonMap
+{
+public:
+    // Add photons before the tree is built
+    void Store(const std::vector<Photon>& new_photons);
+
+    // Build the balanced kd-tree of the stored photons
+    void Balance();
+
+    void Clear()
+    {
+        photons.clear();
+    }
+
+    size_t Size() const
+    {
+        return photons.size();
+    }
+
+    // Irradiance at the point of the surface with the specified normal estimated by at most max_photons
+    // nearest photons in max_distance which came from the front of the surface
+    glm::dvec3 Irradiance(const glm::dvec3& position, const glm::dvec3& normal,
+        double max_distance, int max_photons) const;
+
+    // Find at most max_count photons nearest to the position in max_distance
+    // The result is unordered; returns the squared distance to the farthest found photon
+    double Locate(const glm::dvec3& position, double max_distance, int max_count,
+        std::vector<const Photon*>& found) const;
+
+    const std::vector<Photon>& GetPhotons() const
+    {
+        return photons;
+    }
+
+private:
+    void BalanceRange(size_t begin, size_t end);
+
+    struct Query;
+    void LocateRange(size_t begin, size_t end, Query& query) const;
+
+    std::vector<Photon> photons;
+};
+
+// Directions from a light marked if they lead to interesting objects, e.g. specular ones
+// The sphere of directions is split into cells of equal solid angle: resolution rows of equal ranges of z
+// by 2 * resolution columns of equal ranges of the azimuth
+class ProjectionMap
+{
+public:
+    // Mark the cells where hits is true for any of the directions sampled in the cell
+    // The marked cells are extended by their neighbours, so small objects between the samples are not lost
+    void Build(int new_resolution, const std::function<bool(const glm::dvec3&)>& hits);
+
+    // Fraction of the solid angle covered by the marked cells
+    double Coverage() const
+    {
+        return resolution == 0 ? 0.0 : double(marked.size()) / (2.0 * resolution * resolution);
+    }
+
+    // Direction distributed uniformly over the marked cells by three random numbers in [0, 1)
+    glm::dvec3 Sample(double u, double v, double w) const;
+
+    // Direction of the point (u, v) of the unit square mapped to the sphere preserving the areas
+    static glm::dvec3 Direction(double u, double v);
+
+private:
+    int resolution = 0;
+    std::vector<int> marked;  // indices of the marked cells, row by row
+};
@@ -0,0 +1,430 @@
+#include "MeshLoaders.h"
+
+#include <charconv>
+#include <string_view>
+#include <algorithm>
+
+namespace
+{
+    enum class PlyFormat
+    {
+        Ascii,
+        BinaryLittleEndian,
+        BinaryBigEndian
+    };
+
+    enum class PlyType
+    {
+        None,
+        Int8,
+        UInt8,
+        Int16,
+        UInt16,
+        Int32,
+        UInt32,
+        Float32,
+        Float64
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type = PlyType::None;
+        PlyType count_type = PlyType::None;  // None if the property is not a list
+        size_t offset = 0;                   // offset in the record, if the record has a fixed size
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count = 0;
+        std::vector<PlyProperty> properties;
+        size_t record_size = 0;  // 0 if the record contains lists
+    };
+
+    size_t SizeOf(PlyType type)
+    {
+        switch (type)
+        {
+        case PlyType::Int8: case PlyType::UInt8: return 1;
+        case PlyType::Int16: case PlyType::UInt16: return 2;
+        case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default: return 0;
+        }
+    }
+
+    PlyType ParseType(std::string_view name)
+    {
+        if (name == "char" || name == "int8") return PlyType::Int8;
+        if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+        if (name == "short" || name == "int16") return PlyType::Int16;
+        if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+        if (name == "int" || name == "int32") return PlyType::Int32;
+        if (name == "uint" || name == "uint32") return PlyType::UInt32;
+        if (name == "float" || name == "float32") return PlyType::Float32;
+        if (name == "double" || name == "float64") return PlyType::Float64;
+        return PlyType::None;
+    }
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // Split a header line into words
+    std::vector<std::string_view> Words(std::string_view line)
+    {
+        std::vector<std::string_view> words;
+        size_t position = 0;
+        while (position < line.size())
+        {
+            while (position < line.size() && IsSpace(line[position]))
+                ++position;
+            size_t start = position;
+            while (position < line.size() && !IsSpace(line[position]))
+                ++position;
+            if (position > start)
+                words.push_back(line.substr(start, position - start));
+        }
+        return words;
+    }
+
+    // Sequential reader of the values of the body in any format
+    class PlyReader
+    {
+    public:
+        PlyReader(const char* begin, const char* end, PlyFormat format) :
+            position(begin), end(end), format(format) {}
+
+        bool Read(PlyType type, double& value)
+        {
+            if (format == PlyFormat::Ascii)
+                return ReadText(value);
+
+            size_t size = SizeOf(type);
+            if (static_cast<size_t>(end - position) < size)
+                return false;
+            unsigned char bytes[8];
+            std::memcpy(bytes, position, size);
+            position += size;
+            if (format == PlyFormat::BinaryBigEndian)
+                std::reverse(bytes, bytes + size);
+
+            switch (type)
+            {
+            case PlyType::Int8: value = static_cast<int8_t>(bytes[0]); break;
+            case PlyType::UInt8: value = bytes[0]; break;
+            case PlyType::Int16: value = Load<int16_t>(bytes); break;
+            case PlyType::UInt16: value = Load<uint16_t>(bytes); break;
+            case PlyType::Int32: value = Load<int32_t>(bytes); break;
+            case PlyType::UInt32: value = Load<uint32_t>(bytes); break;
+            case PlyType::Float32: value = Load<float>(bytes); break;
+            case PlyType::Float64: value = Load<double>(bytes); break;
+            default: return false;
+            }
+            return true;
+        }
+
+        // Largest number of values of the type which the rest of the body can hold
+        // (a text value takes at least one character)
+        size_t MaxValues(PlyType type) const
+        {
+            size_t remaining = static_cast<size_t>(end - position), size = SizeOf(type);
+            if (format == PlyFormat::Ascii)
+                return remaining;
+            return size != 0 ? remaining / size : 0;
+        }
+
+    private:
+        template <typename T>
+        static T Load(const unsigned char* bytes)
+        {
+            T value;
+            std::memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        bool ReadText(double& value)
+        {
+            while (position < end && IsSpace(*position))
+                ++position;
+            const char* start = position;
+            while (position < end && !IsSpace(*position))
+                ++position;
+            auto result = std::from_chars(start, position, value);
+            return position > start && result.ec == std::errc() && result.ptr == position;
+        }
+
+        const char* position;
+        const char* end;
+        PlyFormat format;
+    };
+
+    const PlyProperty* FindProperty(const PlyElement& element, const char* name)
+    {
+        for (const PlyProperty& property : element.properties)
+        {
+            if (property.name == name)
+                return &property;
+        }
+        return nullptr;
+    }
+
+    // Check that the properties are consecutive floats of a fixed size record
+    bool IsFloatVector(const PlyElement& element, const PlyProperty* x, const PlyProperty* y, const PlyProperty* z)
+    {
+        return element.record_size != 0 &&
+            x->type == PlyType::Float32 && y->type == PlyType::Float32 && z->type == PlyType::Float32 &&
+            y->offset == x->offset + 4 && z->offset == x->offset + 8;
+    }
+}
+
+bool PlyLoader::Fail(const std::string& message)
+{
+    error = message;
+    return false;
+}
+
+bool PlyLoader::Load(const std::string& filename, MeshData& data)
+{
+    MappedFile& file = data.file;
+    if (!file.Open(filename))
+        return Fail("Cannot open \"" + filename + "\"");
+    const char* begin = file.GetData();
+    const char* end = begin + file.GetSize();
+
+    // Header
+    std::vector<PlyElement> elements;
+    PlyFormat format = PlyFormat::Ascii;
+    const char* body = nullptr;
+    bool has_format = false;
+    for (const char* line = begin; line < end && !body;)
+    {
+        const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!line_end)
+            line_end = end;
+        std::vector<std::string_view> words = Words(std::string_view(line, line_end - line));
+        bool first_line = line == begin;
+        line = line_end + 1;
+
+        if (first_line)
+        {
+            if (words.size() != 1 || words[0] != "ply")
+                return Fail(filename + ": not a PLY file");
+        }
+        else if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+        {
+            continue;
+        }
+        else if (words[0] == "format" && words.size() == 3)
+        {
+            if (words[1] == "ascii")
+                format = PlyFormat::Ascii;
+            else if (words[1] == "binary_little_endian")
+                format = PlyFormat::BinaryLittleEndian;
+            else if (words[1] == "binary_big_endian")
+                format = PlyFormat::BinaryBigEndian;
+            else
+                return Fail(filename + ": unknown format " + std::string(words[1]));
+            has_format = true;
+        }
+        else if (words[0] == "element" && words.size() == 3)
+        {
+            PlyElement element;
+            element.name = std::string(words[1]);
+            auto result = std::from_chars(words[2].data(), words[2].data() + words[2].size(), element.count);
+            if (result.ec != std::errc())
+                return Fail(filename + ": wrong count of " + element.name);
+            elements.push_back(element);
+        }
+        else if (words[0] == "property" && !elements.empty())
+        {
+            PlyProperty property;
+            if (words.size() == 5 && words[1] == "list")
+            {
+                property.count_type = ParseType(words[2]);
+                property.type = ParseType(words[3]);
+                property.name = std::string(words[4]);
+                if (property.count_type == PlyType::None || property.count_type == PlyType::Float32 ||
+                    property.count_type == PlyType::Float64)
+                    return Fail(filename + ": wrong list property " + property.name);
+            }
+            else if (words.size() == 3)
+            {
+                property.type = ParseType(words[1]);
+                property.name = std::string(words[2]);
+            }
+            if (property.type == PlyType::None)
+                return Fail(filename + ": wrong property in element " + elements.back().name);
+            elements.back().properties.push_back(property);
+        }
+        else if (words[0] == "end_header")
+        {
+            body = std::min(line, end);
+        }
+        else
+        {
+            return Fail(filename + ": unknown header line " + std::string(words[0]));
+        }
+    }
+    if (!body || !has_format)
+        return Fail(filename + ": incomplete header");
+
+    // Records without lists have a fixed size and fixed property offsets
+    for (PlyElement& element : elements)
+    {
+        size_t offset = 0;
+        bool fixed = true;
+        for (PlyProperty& property : element.properties)
+        {
+            property.offset = offset;
+            offset += SizeOf(property.type);
+            fixed &= property.count_type == PlyType::None;
+        }
+        element.record_size = fixed ? offset : 0;
+    }
+
+    auto vertex = std::find_if(elements.begin(), elements.end(), [](const PlyElement& e) { return e.name == "vertex"; });
+    auto face = std::find_if(elements.begin(), elements.end(), [](const PlyElement& e) { return e.name == "face"; });
+    if (vertex == elements.end() || face == elements.end())
+        return Fail(filename + ": no vertex or face element");
+    const PlyProperty* x = FindProperty(*vertex, "x");
+    const PlyProperty* y = FindProperty(*vertex, "y");
+    const PlyProperty* z = FindProperty(*vertex, "z");
+    const PlyProperty* nx = FindProperty(*vertex, "nx");
+    const PlyProperty* ny = FindProperty(*vertex, "ny");
+    const PlyProperty* nz = FindProperty(*vertex, "nz");
+    const PlyProperty* indices = FindProperty(*face, "vertex_indices");
+    if (!indices)
+        indices = FindProperty(*face, "vertex_index");
+    if (!x || !y || !z || !indices || indices->count_type == PlyType::None)
+        return Fail(filename + ": no vertex positions or face indices");
+    bool has_normals = nx && ny && nz;
+
+    // Mapped layout: binary little endian, float vectors and faces of a single list of uchar count and 32-bit indices
+    // The vertices must come before the faces, and every element before the faces must have fixed size records
+    // to find the offsets without reading them; all of the records must lie in the file
+    bool mapped = format == PlyFormat::BinaryLittleEndian && vertex < face &&
+        IsFloatVector(*vertex, x, y, z) && (!has_normals || IsFloatVector(*vertex, nx, ny, nz)) &&
+        face->properties.size() == 1 && indices->count_type == PlyType::UInt8 &&
+        (indices->type == PlyType::Int32 || indices->type == PlyType::UInt32);
+    size_t vertex_offset = 0, face_offset = 0, offset = 0;
+    const size_t face_record_size = 1 + 3 * sizeof(uint32_t);
+    const size_t body_size = static_cast<size_t>(end - body);
+    for (auto element = elements.begin(); mapped && element <= face; ++element)
+    {
+        if (element == vertex)
+            vertex_offset = offset;
+        if (element == face)
+        {
+            face_offset = offset;
+            break;
+        }
+        mapped = element->record_size != 0 && element->count <= (body_size - offset) / element->record_size;
+        offset += element->count * element->record_size;
+    }
+    mapped = mapped && face->count <= (body_size - face_offset) / face_record_size;
+
+    // The mapped layout needs faces to be triangles
+    if (mapped)
+    {
+        const char* faces = body + face_offset;
+        int64_t count = static_cast<int64_t>(face->count);
+        bool triangles = true;
+        #pragma omp parallel for reduction(&&:triangles)
+        for (int64_t i = 0; i < count; i++)
+            triangles = triangles && faces[i * face_record_size] == 3;
+        mapped = triangles;
+    }
+
+    if (mapped)
+    {
+        data.position_count = vertex->count;
+        data.positions = body + vertex_offset + x->offset;
+        data.position_stride = vertex->record_size;
+        data.normal_count = has_normals ? vertex->count : 0;
+        data.normals = has_normals ? body + vertex_offset + nx->offset : nullptr;
+        data.normal_stride = vertex->record_size;
+        data.triangle_count = face->count;
+        data.position_indices = body + face_offset + 1;
+        data.position_index_stride = face_record_size;
+        data.normal_indices = data.position_indices;
+        data.normal_index_stride = face_record_size;
+        data.ComputeNormals();
+        return true;
+    }
+
+    // Other layouts are read value by value
+    PlyReader reader(body, end, format);
+    for (const PlyElement& element : elements)
+    {
+        bool is_vertex = &element == &*vertex, is_face = &element == &*face;
+        if (is_vertex)
+        {
+            size_t count = std::min(element.count, reader.MaxValues(x->type) / 3);
+            data.own_positions.reserve(count * 3);
+            if (has_normals)
+                data.own_normals.reserve(count * 3);
+        }
+        std::vector<uint32_t> polygon;
+        for (size_t i = 0; i < element.count; ++i)
+        {
+            float position[3] = {}, normal[3] = {};
+            for (const PlyProperty& property : element.properties)
+            {
+                double value;
+                if (property.count_type != PlyType::None)
+                {
+                    // The count comes from the file, so it is checked before anything is allocated for it
+                    if (!reader.Read(property.count_type, value) || value < 0 || value > reader.MaxValues(property.type))
+                        return Fail(filename + ": wrong list in element " + element.name);
+                    polygon.resize(static_cast<size_t>(value));
+                    for (uint32_t& index : polygon)
+                    {
+                        if (!reader.Read(property.type, value))
+                            return Fail(filename + ": unexpected end of element " + element.name);
+                        index = static_cast<uint32_t>(value);
+                    }
+                    if (!is_face || &property != indices)
+                        continue;
+                    if (polygon.size() < 3)
+                        return Fail(filename + ": face with less than 3 vertices");
+                    // Triangle fan
+                    for (size_t k = 1; k + 1 < polygon.size(); ++k)
+                    {
+                        data.own_position_indices.push_back(polygon[0]);
+                        data.own_position_indices.push_back(polygon[k]);
+                        data.own_position_indices.push_back(polygon[k + 1]);
+                    }
+                    continue;
+                }
+
+                if (!reader.Read(property.type, value))
+                    return Fail(filename + ": unexpected end of element " + element.name);
+                if (!is_vertex)
+                    continue;
+                if (&property == x) position[0] = static_cast<float>(value);
+                else if (&property == y) position[1] = static_cast<float>(value);
+                else if (&property == z) position[2] = static_cast<float>(value);
+                else if (&property == nx) normal[0] = static_cast<float>(value);
+                else if (&property == ny) normal[1] = static_cast<float>(value);
+                else if (&property == nz) normal[2] = static_cast<float>(value);
+            }
+            if (is_vertex)
+            {
+                data.own_positions.insert(data.own_positions.end(), position, position + 3);
+                if (has_normals)
+                    data.own_normals.insert(data.own_normals.end(), normal, normal + 3);
+            }
+        }
+        // Nothing after both of the elements is needed
+        if ((is_face && face > vertex) || (is_vertex && vertex > face))
+            break;
+    }
+    file.Close();
+
+    data.UseOwnArrays();
+    data.ComputeNormals();
+    return true;
+}
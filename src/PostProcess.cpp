@@ -0,0 +1,235 @@
+#include "PostProcess.h"
+#include "Sampler.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define POSTPROCESS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // The gamma table covers [2^-20, 1] with 128 entries per octave;
+    // the values below are mapped linearly
+    const int table_octaves = 20;
+    const int table_steps = 128;
+    const int table_size = table_octaves * table_steps + 2;
+    const float table_min = 1.0f / (1 << table_octaves);
+    // Upper 16 bits of the representation of table_min
+    const int32_t table_base = (127 - table_octaves) << 7;
+
+    const int dither_size = 64;
+
+    // Hable's filmic curve
+    float Hable(float x)
+    {
+        const float a = 0.15f, b = 0.50f, c = 0.10f, d = 0.20f, e = 0.02f, f = 0.30f;
+        return ((x * (a * x + c * b) + d * e) / (x * (a * x + b) + d * f)) - e / f;
+    }
+
+#ifdef POSTPROCESS_SSE2
+    __m128 HableSse(__m128 x)
+    {
+        const __m128 a = _mm_set1_ps(0.15f), b = _mm_set1_ps(0.50f), cb = _mm_set1_ps(0.10f * 0.50f);
+        const __m128 de = _mm_set1_ps(0.20f * 0.02f), df = _mm_set1_ps(0.20f * 0.30f), ef = _mm_set1_ps(0.02f / 0.30f);
+        __m128 ax = _mm_mul_ps(a, x);
+        __m128 numerator = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(ax, cb)), de);
+        __m128 denominator = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(ax, b)), df);
+        return _mm_sub_ps(_mm_div_ps(numerator, denominator), ef);
+    }
+#endif
+}
+
+void PostProcessor::Prepare()
+{
+    scale = static_cast<float>(std::pow(2.0, exposure));
+    switch (tone_mapping)
+    {
+    case ToneMapping::Filmic:
+        white_scale = 1.0f / Hable(static_cast<float>(white_point));
+        break;
+    case ToneMapping::ReinhardExtended:
+        white_scale = static_cast<float>(1.0 / (white_point * white_point));
+        break;
+    default:
+        white_scale = 1.0f;
+    }
+
+    if (gamma_table.empty() || prepared_gamma != gamma)
+    {
+        gamma_table.resize(table_size);
+        for (int i = 0; i < table_size; i++)
+        {
+            int32_t bits = (table_base + i) << 16;
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            gamma_table[i] = static_cast<float>(255.0 * std::pow(glm::min(static_cast<double>(value), 1.0), 1.0 / gamma));
+        }
+        prepared_gamma = gamma;
+    }
+
+    if (dither_table.empty())
+    {
+        // Every channel reads blue noise with its own offset, so the channels are not correlated
+        std::vector<float> tile = MakeBlueNoiseTile(dither_size);
+        dither_table.resize(dither_size * dither_size * 3);
+        for (int y = 0; y < dither_size; y++)
+        {
+            for (int x = 0; x < dither_size; x++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    int tx = (x + c * 23) % dither_size, ty = (y + c * 41) % dither_size;
+                    dither_table[(y * dither_size + x) * 3 + c] = tile[ty * dither_size + tx];
+                }
+            }
+        }
+    }
+}
+
+float PostProcessor::ToneMap(float x) const
+{
+    switch (tone_mapping)
+    {
+    case ToneMapping::Reinhard:
+        return x / (1.0f + x);
+    case ToneMapping::ReinhardExtended:
+        return x * (1.0f + x * white_scale) / (1.0f + x);
+    case ToneMapping::Filmic:
+        return Hable(x) * white_scale;
+    case ToneMapping::Aces:
+        x *= 0.6f;
+        return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    default:
+        return x;
+    }
+}
+
+float PostProcessor::GammaLookup(float x) const
+{
+    if (x < table_min)
+        return x * (gamma_table[0] / table_min);
+
+    int32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    int index = (bits >> 16) - table_base;
+    float t = (bits & 0xffff) * (1.0f / 65536.0f);
+    return gamma_table[index] + (gamma_table[index + 1] - gamma_table[index]) * t;
+}
+
+void PostProcessor::ProcessRow(const float* linear, unsigned width, unsigned y, unsigned char* rgb) const
+{
+    const size_t count = static_cast<size_t>(width) * 3;
+    const size_t dither_row_size = dither_size * 3;
+    const float* noise = dither ? &dither_table[(y % dither_size) * dither_row_size] : nullptr;
+    size_t k = 0;
+
+#ifdef POSTPROCESS_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 exposure_scale = _mm_set1_ps(scale);
+    const __m128 white = _mm_set1_ps(white_scale);
+    const __m128 min_value = _mm_set1_ps(table_min);
+    const __m128 small_scale = _mm_set1_ps(gamma_table[0] / table_min);
+    const __m128 fraction_scale = _mm_set1_ps(1.0f / 65536.0f);
+    const __m128i low_bits = _mm_set1_epi32(0xffff);
+    const __m128i base = _mm_set1_epi32(table_base);
+
+    for (; k + 4 <= count; k += 4)
+    {
+        __m128 x = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(linear + k), exposure_scale), zero);
+
+        switch (tone_mapping)
+        {
+        case ToneMapping::Reinhard:
+            x = _mm_div_ps(x, _mm_add_ps(one, x));
+            break;
+        case ToneMapping::ReinhardExtended:
+            x = _mm_div_ps(_mm_mul_ps(x, _mm_add_ps(one, _mm_mul_ps(x, white))), _mm_add_ps(one, x));
+            break;
+        case ToneMapping::Filmic:
+            x = _mm_mul_ps(HableSse(x), white);
+            break;
+        case ToneMapping::Aces:
+        {
+            x = _mm_mul_ps(x, _mm_set1_ps(0.6f));
+            __m128 numerator = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+            __m128 denominator = _mm_add_ps(
+                _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))),
+                _mm_set1_ps(0.14f));
+            x = _mm_div_ps(numerator, denominator);
+            break;
+        }
+        default:
+            break;
+        }
+        x = _mm_min_ps(_mm_max_ps(x, zero), one);
+
+        // Gamma: the upper bits of the float are the table index, the lower ones interpolate
+        __m128i bits = _mm_castps_si128(x);
+        __m128i index = _mm_sub_epi32(_mm_srli_epi32(bits, 16), base);
+        __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(bits, low_bits)), fraction_scale);
+
+        alignas(16) int32_t indices[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(indices), index);
+        for (int i = 0; i < 4; i++)
+            indices[i] = indices[i] < 0 ? 0 : indices[i];
+        __m128 low = _mm_setr_ps(gamma_table[indices[0]], gamma_table[indices[1]],
+            gamma_table[indices[2]], gamma_table[indices[3]]);
+        __m128 high = _mm_setr_ps(gamma_table[indices[0] + 1], gamma_table[indices[1] + 1],
+            gamma_table[indices[2] + 1], gamma_table[indices[3] + 1]);
+        __m128 value = _mm_add_ps(low, _mm_mul_ps(_mm_sub_ps(high, low), t));
+
+        // Values below the table are mapped linearly
+        __m128 small = _mm_cmplt_ps(x, min_value);
+        value = _mm_or_ps(_mm_and_ps(small, _mm_mul_ps(x, small_scale)), _mm_andnot_ps(small, value));
+
+        if (noise)
+            value = _mm_add_ps(value, _mm_loadu_ps(noise + k % dither_row_size));
+
+        // Truncate and pack to bytes with saturation
+        __m128i quantized = _mm_cvttps_epi32(value);
+        quantized = _mm_packs_epi32(quantized, quantized);
+        quantized = _mm_packus_epi16(quantized, quantized);
+        int32_t packed = _mm_cvtsi128_si32(quantized);
+        std::memcpy(rgb + k, &packed, 4);
+    }
+#endif
+
+    for (; k < count; k++)
+    {
+        float x = glm::max(linear[k] * scale, 0.0f);
+        x = glm::clamp(ToneMap(x), 0.0f, 1.0f);
+        float value = GammaLookup(x);
+        if (noise)
+            value += noise[k % dither_row_size];
+        rgb[k] = static_cast<unsigned char>(glm::min(value, 255.0f));
+    }
+}
+
+void PostProcessor::Process(const Framebuffer& framebuffer, unsigned first_row, unsigned row_count, unsigned char* rgb) const
+{
+    const unsigned width = framebuffer.GetResolution().x;
+
+    #pragma omp parallel
+    {
+        std::vector<float> converted_row;
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < static_cast<int>(row_count); i++)
+        {
+            unsigned y = first_row + i;
+            const float* row = framebuffer.FloatRow(y);
+            if (!row)
+            {
+                converted_row.resize(width * 3);
+                framebuffer.ReadRow(y, converted_row.data());
+                row = converted_row.data();
+            }
+            ProcessRow(row, width, y, rgb + static_cast<size_t>(i) * width * 3);
+        }
+    }
+}
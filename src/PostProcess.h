@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+    PostProcess.h
+    Conversion of linear HDR images to displayable 8-bit images:
+    exposure, tone mapping, gamma and dithered quantization
+    Author: Artyom Bishev
+*/
+
+#include "Framebuffer.h"
+#include <vector>
+
+// Tone mapping operators, applied to every color channel
+enum class ToneMapping
+{
+    Clamp,             // no tone mapping, colors above 1 are clipped
+    Reinhard,          // x / (1 + x)
+    ReinhardExtended,  // Reinhard operator which maps white_point to 1
+    Filmic,            // Hable's filmic curve (Uncharted 2)
+    Aces               // Narkowicz's fit of ACES filmic curve
+};
+
+// Post-processing stage which runs on the whole framebuffer after rendering
+// Rows are processed in parallel, 4 channel values at a time with SSE2 where it is available
+class PostProcessor
+{
+public:
+    double exposure = 0.0;        // exposure correction in stops
+    ToneMapping tone_mapping = ToneMapping::Clamp;
+    double white_point = 4.0;     // smallest value mapped to white by ReinhardExtended and Filmic
+    double gamma = 2.1;
+    bool dither = false;          // add blue noise before quantization to hide banding
+
+    // Build the lookup tables for the current settings
+    // Must be called after the settings are changed and before Process is used by several threads
+    void Prepare();
+
+    // Convert rows [first_row, first_row + row_count) of the framebuffer to 8-bit RGB
+    void Process(const Framebuffer& framebuffer, unsigned first_row, unsigned row_count, unsigned char* rgb) const;
+
+    // Convert one row of linear colors (3 floats per pixel) to 8-bit RGB
+    // y is used to pick the dither pattern
+    void ProcessRow(const float* linear, unsigned width, unsigned y, unsigned char* rgb) const;
+
+private:
+    // Tone mapped value in [0, 1] of the linear value already multiplied by exposure
+    float ToneMap(float x) const;
+
+    // Gamma corrected value in [0, 255] of the value in [0, 1] (by the lookup table)
+    float GammaLookup(float x) const;
+
+    std::vector<float> gamma_table;  // gamma curve sampled at 128 points per octave
+    std::vector<float> dither_table; // blue noise for every channel of a tile of pixels
+    float scale = 1.0f;              // 2^exposure
+    float white_scale = 1.0f;        // normalization factor of the tone mapping curve
+    double prepared_gamma = 0.0;
+};
@@ -0,0 +1,204 @@
+#include "Renderer.h"
+#include "Numa.h"
+
+#include <climits>
+
+using namespace glm;
+
+void ProgressivePhotonMapper::Render(uvec2 res)
+{
+    AllocateFramebuffer(res);
+    SplitTiles();
+    photonMap.Clear();
+    causticMap.Clear();
+
+    if (numaAware && numaReplicateScene)
+        scene->ReplicateForNodes(NumaNodeCount());
+
+    if (lightTreeSampling)
+        lightTree.Build(scene->lights);
+
+    if (samplesPerPixel > 1)
+        sampler.Prepare();
+
+    TraceCameraPass();
+    passesDone = 0;
+    RenderPasses(passCount);
+
+    if (!imageStream)
+        return;
+    std::vector<unsigned char> rgb;
+    for (unsigned first = 0; first < resolution.y; first += tileSize)
+    {
+        unsigned row_count = glm::min(tileSize, resolution.y - first);
+        ConvertRows(first, row_count, rgb);
+        imageStream->WriteRows(rgb.data(), row_count);
+    }
+}
+
+int ProgressivePhotonMapper::RenderChanged(const SceneEntities&)
+{
+    if (tiles.empty())
+        return 0;
+    int passes = passesDone;
+    TraceCameraPass();
+    passesDone = 0;
+    RenderPasses(passes);
+    return static_cast<int>(tiles.size());
+}
+
+void ProgressivePhotonMapper::TraceCameraPass()
+{
+    // Camera pass: the hit points of every row are collected separately and joined in the order of the rows,
+    // so the result does not depend on the scheduling of the threads
+    int rows = static_cast<int>(resolution.y);
+    std::vector<std::vector<HitPoint>> row_points(rows);
+    directLight.assign(size_t(resolution.x) * resolution.y, dvec3(0.0));
+    #pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < rows; y++)
+    {
+        for (unsigned x = 0; x < resolution.x; x++)
+        {
+            uvec2 pixel(x, y);
+            std::uint32_t index = y * resolution.x + x;
+            if (samplesPerPixel <= 1)
+            {
+                TraceHitPoints(MakeRay(pixel), 0, dvec3(1.0), index, directLight[index], row_points[y]);
+                continue;
+            }
+            dvec3 weight(1.0 / samplesPerPixel);
+            for (int sample = 0; sample < samplesPerPixel; sample++)
+            {
+                dvec2 offset = sampler.Get2D(pixel, sample, samplesPerPixel, 0);
+                TraceHitPoints(MakeRay(dvec2(pixel) + offset), 0, weight, index, directLight[index], row_points[y]);
+            }
+        }
+    }
+
+    hitPoints.clear();
+    for (auto& points : row_points)
+    {
+        hitPoints.insert(hitPoints.end(), points.begin(), points.end());
+        std::vector<HitPoint>().swap(points);
+    }
+    std::cout << "Progressive photon mapping: " << hitPoints.size() << " hit points\n";
+}
+
+void ProgressivePhotonMapper::RenderPasses(int count)
+{
+    for (int pass = 0; pass < count; pass++)
+    {
+        // Every pass emits its own photons; only their statistics are kept after the pass
+        PhotonMap photons;
+        // The hit points gather the caustics too, so the paths of only specular bounces are kept
+        EmitPhotons(photonsPerPass, nullptr, true, photons, passesDone + 1);
+
+        #pragma omp parallel
+        {
+            NumaPinScope pin(numaAware ? NumaTeamThreadNode() : -1);
+
+            std::vector<const Photon*> found;
+            #pragma omp for schedule(dynamic, 256)
+            for (int i = 0; i < static_cast<int>(hitPoints.size()); i++)
+            {
+                HitPoint& point = hitPoints[i];
+                photons.Locate(point.position, glm::sqrt(point.radius2), INT_MAX, found);
+
+                double new_count = 0.0;
+                dvec3 new_flux(0.0);
+                for (const Photon* photon : found)
+                {
+                    if (glm::dot(photon->GetDirection(), point.normal) < 0.0)
+                    {
+                        new_count += 1.0;
+                        new_flux += photon->GetPower();
+                    }
+                }
+                if (new_count == 0.0)
+                    continue;
+
+                // Keep alpha of the new photons and shrink the radius to keep the density of the photons
+                double kept_count = point.photon_count + alpha * new_count;
+                double ratio = kept_count / (point.photon_count + new_count);
+                point.radius2 *= ratio;
+                point.flux = (point.flux + new_flux) * ratio;
+                point.photon_count = kept_count;
+            }
+        }
+        passesDone++;
+    }
+
+    UpdateFramebuffer();
+    std::cout << "Progressive photon mapping: " << passesDone << " passes of " << photonsPerPass << " photons\n";
+}
+
+void ProgressivePhotonMapper::TraceHitPoints(Ray ray, int step, dvec3 weight, std::uint32_t pixel, dvec3& direct,
+    std::vector<HitPoint>& points)
+{
+    // Every traced ray contributes the background color, as in TraceRay
+    direct += weight * backgroundColor;
+    if (step >= maxRenderStep)
+        return;
+
+    Intersection intersection;
+    Object3D* intersected_object = FindIntersection(ray, intersection);
+    if (glm::dot(ray.direction, intersection.normal) > 0.0)
+        intersection.normal = -intersection.normal;
+    if (!intersection || !intersection.material)
+        return;
+    const SurfaceMaterial* material = intersection.material;
+
+    SurfacePassage passage = PassSurface(ray, intersection, intersected_object);
+
+    AddDirectLight(*material, intersection.normal, intersection.coord, ray.direction, weight, direct);
+
+    if (glm::length(material->diffuse) >= FLT_EPSILON)
+    {
+        HitPoint point;
+        point.position = intersection.coord;
+        point.normal = intersection.normal;
+        point.weight = weight * material->diffuse;
+        point.pixel = pixel;
+        point.radius2 = initialRadius * initialRadius;
+        point.photon_count = 0.0;
+        point.flux = dvec3(0.0);
+        points.push_back(point);
+    }
+
+    dvec3 reflective_color = material->transparency_color * passage.R + material->reflective_color;
+    dvec3 transparency_color = material->transparency_color * passage.T;
+
+    if (glm::length(reflective_color) > TRACER_EPSILON)
+    {
+        Ray reflected;
+        reflected.direction = glm::reflect(ray.direction, intersection.normal);
+        reflected.origin = intersection.coord;
+        reflected.current_object_insides = ray.current_object_insides;
+        TraceHitPoints(reflected, step + 1, weight * reflective_color, pixel, direct, points);
+    }
+
+    if (glm::length(transparency_color) > TRACER_EPSILON)
+    {
+        Ray refracted;
+        refracted.direction = glm::refract(ray.direction, intersection.normal, passage.relative_refractive_index);
+        refracted.origin = intersection.coord;
+        std::swap(refracted.current_object_insides, passage.insides);
+        TraceHitPoints(refracted, step + 1, weight * transparency_color, pixel, direct, points);
+    }
+}
+
+void ProgressivePhotonMapper::UpdateFramebuffer()
+{
+    // The photons of every pass carry the whole flux of the lights, so the estimates are averaged over the passes
+    std::vector<dvec3> colors = directLight;
+    double passes = glm::max(passesDone, 1);
+    for (const HitPoint& point : hitPoints)
+        colors[point.pixel] += point.weight * point.flux / (glm::pi<double>() * point.radius2 * passes);
+
+    for (unsigned y = 0; y < resolution.y; y++)
+    {
+        for (unsigned x = 0; x < resolution.x; x++)
+            framebuffer.Set(x, y, vec3(colors[y * resolution.x + x]));
+    }
+    framebuffer.FlushRegion(uvec2(0), resolution);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+/*
+    Random.h
+    Counter-based random numbers for stochastic sampling
+    Author: Artyom Bishev
+*/
+
+#include <cstdint>
+
+// Mixing function of SplitMix64
+// Maps every 64-bit value to a well scrambled 64-bit value
+inline uint64_t MixBits(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Random 64 bits keyed by (pixel, sample, bounce, dimension)
+// The result depends on the key only, so there is no state shared between threads,
+// and the same key always produces the same number regardless of the rendering order
+inline uint64_t RandomBits(uint64_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension, uint64_t seed = 0)
+{
+    uint64_t h = MixBits(seed + 0x9e3779b97f4a7c15ULL);
+    h = MixBits(h ^ pixel);
+    h = MixBits(h ^ ((static_cast<uint64_t>(sample) << 32) | bounce));
+    h = MixBits(h ^ dimension);
+    return h;
+}
+
+// Random number in [0, 1) keyed by (pixel, sample, bounce, dimension)
+inline double RandomUniform(uint64_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension, uint64_t seed = 0)
+{
+    // 53 upper bits fill the whole mantissa of double
+    return (RandomBits(pixel, sample, bounce, dimension, seed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Sequence of random numbers of one sample of one pixel
+// Every bounce of a path gets its own dimensions, so the numbers used by a bounce
+// do not depend on how many numbers were taken by the previous bounces
+class RandomStream
+{
+public:
+    RandomStream(uint64_t pixel = 0, uint32_t sample = 0, uint64_t seed = 0)
+        : pixel(pixel), sample(sample), seed(seed) {}
+
+    // Move to the specified bounce and restart its dimensions
+    void SetBounce(uint32_t new_bounce)
+    {
+        bounce = new_bounce;
+        dimension = 0;
+    }
+
+    // Next random number in [0, 1)
+    double Next()
+    {
+        return RandomUniform(pixel, sample, bounce, dimension++, seed);
+    }
+
+    // Next 32 random bits
+    uint32_t NextBits()
+    {
+        return static_cast<uint32_t>(RandomBits(pixel, sample, bounce, dimension++, seed) >> 32);
+    }
+
+    uint64_t pixel;
+    uint32_t sample;
+    uint32_t bounce = 0;
+    uint32_t dimension = 0;
+    uint64_t seed;
+};
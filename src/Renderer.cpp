@@ -1,20 +1,54 @@
 #include "Renderer.h"
-#include "atlimage.h"
+#include "Numa.h"
+
+#include <algorithm>
+#include <limits>
+#include <cstring>
 
 using namespace glm;
 
+namespace
+{
+    // Direction distributed by the cosine of the angle with the normal
+    dvec3 CosineDirection(const dvec3& normal, double u, double v)
+    {
+        dvec3 tangent = glm::normalize(glm::cross(std::abs(normal.x) > 0.5 ? dvec3(0.0, 1.0, 0.0) : dvec3(1.0, 0.0, 0.0), normal));
+        dvec3 bitangent = glm::cross(normal, tangent);
+        double r = glm::sqrt(u), phi = 2.0 * glm::pi<double>() * v;
+        return tangent * (r * glm::cos(phi)) + bitangent * (r * glm::sin(phi)) + normal * glm::sqrt(glm::max(0.0, 1.0 - u));
+    }
+
+    // Random key of the point, so the numbers used at a point do not depend on the rendering order
+    std::uint64_t PositionKey(const dvec3& position)
+    {
+        std::uint64_t key = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            std::uint64_t bits;
+            std::memcpy(&bits, &position[k], sizeof(bits));
+            key = MixBits(key ^ bits);
+        }
+        return key;
+    }
+}
+
 Ray RayTracer::MakeRay(uvec2 pixelPos)
+{
+    return MakeRay(dvec2(pixelPos));
+}
+
+Ray RayTracer::MakeRay(dvec2 imagePos)
 {
     dvec3 localDirection;
-    localDirection.x = (pixelPos.x - resolution.x / 2.0f) / resolution.x;
-	localDirection.y = (pixelPos.y - resolution.y / 2.0f) / resolution.x;
+    localDirection.x = (imagePos.x - resolution.x / 2.0f) / resolution.x;
+	localDirection.y = (imagePos.y - resolution.y / 2.0f) / resolution.x;
     localDirection.z = 0.5f / atan(camera.viewAngle / 2.0f);
     Ray ray(camera.position, camera.GetRotateMatrix() * localDirection);
     ray.current_object_insides.push(&scene->empty_object);
     return ray;
 }
 
-glm::dvec3 RayTracer::TraceRay(Ray ray, int step = 0)
+glm::dvec3 RayTracer::TraceRay(Ray ray, int step = 0, SceneEntities* touched = nullptr)
 {
 	// Check whether recursive tracing is too deep to proceed calculations
     if (step >= maxRenderStep)
@@ -22,6 +56,89 @@ glm::dvec3 RayTracer::TraceRay(Ray ray, int step = 0)
 
 	// Find the nearest intersection of the ray and the scene
     Intersection intersection;
+    Object3D* intersected_object = FindIntersection(ray, intersection);
+
+    // Set proper direction of the normal vector at the intersection point
+    if (glm::dot(ray.direction, intersection.normal) > 0.0) 
+        intersection.normal = -intersection.normal;
+
+    // If no intersections occured, return default color
+    dvec3 color = backgroundColor;
+    if (!intersection)
+        return color;
+
+    // Objects the ray is in after passing the surface and the part of the light reflected by it
+    SurfacePassage passage = PassSurface(ray, intersection, intersected_object);
+
+    // Remember everything the color of this ray depends on
+    if (touched)
+    {
+        touched->objects.insert(intersected_object);
+        touched->surface_materials.insert(intersection.material);
+        touched->inside_materials.insert(ray.current_object_insides.top()->material);
+        touched->inside_materials.insert(passage.insides.top()->material);
+    }
+
+	// Calculate color by summing intensities from the light sources 
+    if (intersection.material)
+    {
+        AddDirectLight(*intersection.material, intersection.normal, intersection.coord, ray.direction, dvec3(1.0), color);
+
+        // Indirect light interpolated by the irradiance cache or gathered from the photons near the point
+        if (glm::length(intersection.material->diffuse) >= FLT_EPSILON)
+        {
+            if (irradianceCaching)
+            {
+                color += intersection.material->diffuse * IndirectIrradiance(
+                    intersection.coord, intersection.normal, ray.current_object_insides);
+            }
+            else if (photonMap.Size() != 0)
+            {
+                color += intersection.material->diffuse * photonMap.Irradiance(
+                    intersection.coord, intersection.normal, photonGatherRadius, photonGatherCount);
+            }
+            if (causticMap.Size() != 0)
+            {
+                color += intersection.material->diffuse * causticMap.Irradiance(
+                    intersection.coord, intersection.normal, causticGatherRadius, causticGatherCount);
+            }
+        }
+    }
+
+    dvec3 reflective_color = intersection.material->transparency_color * passage.R +
+        intersection.material->reflective_color;
+    dvec3 transparency_color = intersection.material->transparency_color * passage.T;
+
+	// If reflectance effect on the resulting pixel is sufficient,
+	// trace the reflected ray further
+    if (glm::length(reflective_color) > TRACER_EPSILON)
+    {
+        Ray reflected; // reflected ray
+        reflected.direction = glm::reflect(ray.direction, intersection.normal);
+        reflected.origin = intersection.coord;
+        reflected.current_object_insides = ray.current_object_insides;
+
+        color += reflective_color * TraceRay(reflected, step + 1, touched);
+    }
+
+    // If transparency effect on the resulting pixel is sufficient,
+    // trace the refracted ray further
+    if (glm::length(transparency_color) > TRACER_EPSILON)
+    {
+        Ray refracted; // refracted ray
+
+        refracted.direction = glm::refract(ray.direction, intersection.normal, passage.relative_refractive_index);
+        refracted.origin = intersection.coord;
+        std::swap(refracted.current_object_insides, passage.insides);
+
+        color += transparency_color * TraceRay(refracted, step + 1, touched);
+    }
+
+    return color;
+}
+
+Object3D* RayTracer::FindIntersection(const Ray& ray, Intersection& intersection)
+{
     Object3D* intersected_object = nullptr;
     for (auto& object : scene->objects)
     {
@@ -37,147 +154,557 @@ glm::dvec3 RayTracer::TraceRay(Ray ray, int step = 0)
             intersected_object = &object;
         }
     }
+    return intersected_object;
+}
 
-    // Set proper direction of the normal vector at the intersection point
-    if (glm::dot(ray.direction, intersection.normal) > 0.0) 
-        intersection.normal = -intersection.normal;
-
-    // If no intersections occured, return default color
-    dvec3 color = backgroundColor;
-    if (!intersection)
-        return color;
+RayTracer::SurfacePassage RayTracer::PassSurface(const Ray& ray, const Intersection& intersection, Object3D* intersected_object) const
+{
+    SurfacePassage passage;
 
     // Push the intersected object to the stack if the ray went inside it
     // or pop the intersected object from the stack if the ray went outside of it
-    bool outside = (ray.current_object_insides.top() == intersected_object);
-    Object3D* prevous_object = ray.current_object_insides.top();
-    Object3D* current_object;
-
-    std::stack<Object3D*> new_object_insides = ray.current_object_insides;
+    passage.insides = ray.current_object_insides;
     if (intersected_object->surface)
     {
-        if (outside)
+        if (ray.current_object_insides.top() == intersected_object)
+            passage.insides.pop();
+        else
+            passage.insides.push(intersected_object);
+    }
+
+    if (passage.insides.top()->material)
+    {
+        passage.relative_refractive_index =
+            passage.insides.top()->material->refractive_index /
+            ray.current_object_insides.top()->material->refractive_index;
+        passage.R = FrenselReflectance(
+            normalizeDot(-ray.direction, intersection.normal),
+            passage.relative_refractive_index
+            );
+        passage.T = 1.0 - passage.R;
+    }
+    return passage;
+}
+
+void RayTracer::BuildPhotonMaps()
+{
+    photonMap.Clear();
+    causticMap.Clear();
+
+    if (photonCount > 0)
+    {
+        EmitPhotons(photonCount, nullptr, causticPhotonCount == 0, photonMap);
+        std::cout << "Photon map: " << photonMap.Size() << " photons stored\n";
+    }
+
+    if (causticPhotonCount > 0)
+    {
+        // Caustic photons are emitted only in the directions of the specular objects
+        std::vector<ProjectionMap> projections(scene->lights.size());
+        for (size_t i = 0; i < scene->lights.size(); i++)
         {
-            new_object_insides.pop();
+            const PointLight& light = scene->lights[i];
+            projections[i].Build(projectionMapResolution, [this, &light](const dvec3& direction) {
+                Ray ray(light.center, direction);
+                ray.current_object_insides.push(&scene->empty_object);
+                Intersection intersection;
+                FindIntersection(ray, intersection);
+                return intersection && intersection.material && IsSpecular(*intersection.material);
+            });
         }
-        else
+        EmitPhotons(causticPhotonCount, &projections, false, causticMap);
+        std::cout << "Caustic photon map: " << causticMap.Size() << " photons stored\n";
+    }
+}
+
+bool RayTracer::IsSpecular(const SurfaceMaterial& material)
+{
+    return glm::length(material.reflective_color) > TRACER_EPSILON || glm::length(material.transparency_color) > TRACER_EPSILON;
+}
+
+void RayTracer::EmitPhotons(int count, const std::vector<ProjectionMap>* projections, bool store_specular_paths, PhotonMap& map,
+    std::uint64_t seed)
+{
+    // Photons are shared between the lights by their power in the emitted directions,
+    // first_photon[i] is the index of the first photon of the light i
+    std::vector<double> weights;
+    double total_weight = 0.0;
+    for (size_t i = 0; i < scene->lights.size(); i++)
+    {
+        const dvec3& color = scene->lights[i].color;
+        weights.push_back((color.x + color.y + color.z) * (projections ? (*projections)[i].Coverage() : 1.0));
+        total_weight += weights.back();
+    }
+    if (total_weight <= 0.0)
+        return;
+    std::vector<int> first_photon(1, 0);
+    double accumulated = 0.0;
+    for (double weight : weights)
+    {
+        accumulated += weight;
+        first_photon.push_back(static_cast<int>(count * (accumulated / total_weight) + 0.5));
+    }
+
+    // Photons are traced by chunks which are stored in the order of the chunks,
+    // so the map does not depend on the scheduling of the threads
+    const int chunk_size = 4096;
+    int chunk_count = (count + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<Photon>> chunks(chunk_count);
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < chunk_count; c++)
+    {
+        int end = glm::min(count, (c + 1) * chunk_size);
+        for (int i = c * chunk_size; i < end; i++)
         {
-            new_object_insides.push(intersected_object);
+            size_t light_index = std::upper_bound(first_photon.begin(), first_photon.end(), i) - first_photon.begin() - 1;
+            const PointLight& light = scene->lights[light_index];
+            int light_photons = first_photon[light_index + 1] - first_photon[light_index];
+
+            // Point light of intensity I emits the flux of 4 pi I, the photons of the projection map
+            // carry the part of the flux emitted in its cells
+            RandomStream random(i, projections ? 1 : 0, seed);
+            double u = random.Next(), v = random.Next();
+            dvec3 direction = projections ? (*projections)[light_index].Sample(u, v, random.Next()) : ProjectionMap::Direction(u, v);
+            double coverage = projections ? (*projections)[light_index].Coverage() : 1.0;
+            Ray ray(light.center, direction);
+            ray.current_object_insides.push(&scene->empty_object);
+            dvec3 power = light.color * (4.0 * glm::pi<double>() * coverage / light_photons);
+            TracePhoton(ray, power, random, projections != nullptr, store_specular_paths, chunks[c]);
         }
     }
 
-	// Calculate color by summing intensities from all light sources 
-    if (intersection.material)
+    for (auto& chunk : chunks)
+        map.Store(chunk);
+    map.Balance();
+}
+
+void RayTracer::TracePhoton(Ray ray, dvec3 power, RandomStream& random, bool caustic, bool store_specular_paths,
+    std::vector<Photon>& stored)
+{
+    // Paths of only specular bounces end in the caustic map when it is built, so the global map skips them
+    bool specular_path = true;
+
+    for (int step = 0; step < maxRenderStep; step++)
     {
-        for (auto& light : scene->lights)
+        random.SetBounce(step + 1);
+
+        Intersection intersection;
+        Object3D* intersected_object = FindIntersection(ray, intersection);
+        if (!intersection || !intersection.material)
+            return;
+        if (glm::dot(ray.direction, intersection.normal) > 0.0)
+            intersection.normal = -intersection.normal;
+        const SurfaceMaterial* material = intersection.material;
+
+        // The direct light is computed exactly by TraceRay
+        bool store = caustic ? specular_path : (store_specular_paths || !specular_path);
+        if (step > 0 && store && glm::length(material->diffuse) >= FLT_EPSILON)
+        {
+            Photon photon;
+            photon.SetPosition(intersection.coord);
+            photon.SetPower(power);
+            photon.SetDirection(ray.direction);
+            photon.plane = 0;
+            photon.reserved = 0;
+            stored.push_back(photon);
+        }
+
+        SurfacePassage passage = PassSurface(ray, intersection, intersected_object);
+
+        // Russian roulette chooses the diffuse reflection, the mirror reflection, the refraction or the absorption
+        // with the probabilities of the largest components of their colors
+        // Caustic photons are only reflected and refracted
+        dvec3 diffuse = caustic ? dvec3(0.0) : glm::min(material->diffuse, dvec3(1.0));
+        dvec3 reflective = material->transparency_color * passage.R + material->reflective_color;
+        dvec3 transparent = material->transparency_color * passage.T;
+        double p_diffuse = MaxComponent(diffuse), p_reflect = MaxComponent(reflective), p_transmit = MaxComponent(transparent);
+        double p_total = p_diffuse + p_reflect + p_transmit;
+        if (p_total > 1.0)
+        {
+            p_diffuse /= p_total;
+            p_reflect /= p_total;
+            p_transmit /= p_total;
+        }
+
+        double xi = random.Next();
+        ray.origin = intersection.coord;
+        if (xi < p_diffuse)
+        {
+            power *= diffuse / p_diffuse;
+            ray.direction = CosineDirection(intersection.normal, random.Next(), random.Next());
+            specular_path = false;
+        }
+        else if (xi < p_diffuse + p_reflect)
+        {
+            power *= reflective / p_reflect;
+            ray.direction = glm::reflect(ray.direction, intersection.normal);
+        }
+        else if (xi < p_diffuse + p_reflect + p_transmit)
         {
-            color += intersection.material->Color(
-                intersection.normal, intersection.coord, 
-                ray.direction, light
-                );
+            power *= transparent / p_transmit;
+            ray.direction = glm::refract(ray.direction, intersection.normal, passage.relative_refractive_index);
+            std::swap(ray.current_object_insides, passage.insides);
+        }
+        else
+        {
+            return;
         }
     }
+}
 
-    double relative_refractive_index = 1.0;
-    double R = 0.0, T = 0.0;
+void RayTracer::AddDirectLight(const SurfaceMaterial& material, const dvec3& normal, const dvec3& point,
+    const dvec3& view_vector, const dvec3& weight, dvec3& color) const
+{
+    if (!lightTreeSampling)
+    {
+        for (auto& light : scene->lights)
+            color += weight * material.Color(normal, point, view_vector, light);
+        return;
+    }
 
-    if (new_object_insides.top()->material)
+    // Every sampled light is weighted by the inverse of its probability, so the sum stays unbiased
+    // apart from the culled lights
+    RandomStream random(PositionKey(point));
+    for (int sample = 0; sample < lightSamples; sample++)
     {
-        relative_refractive_index =
-            new_object_insides.top()->material->refractive_index /
-            ray.current_object_insides.top()->material->refractive_index;
-        R = FrenselReflectance(
-            normalizeDot(-ray.direction, intersection.normal),
-            relative_refractive_index
-            );
-        T = 1.0 - R;
+        double probability;
+        int index = lightTree.Sample(point, normal, lightCullFraction, random.Next(), probability);
+        if (index < 0)
+            continue;
+        color += weight * material.Color(normal, point, view_vector, scene->lights[index]) / (probability * lightSamples);
     }
+}
 
-    dvec3 reflective_color = intersection.material->transparency_color * R +
-        intersection.material->reflective_color;
-    dvec3 transparency_color = intersection.material->transparency_color * T;
+dvec3 RayTracer::IndirectIrradiance(const dvec3& position, const dvec3& normal, const std::stack<Object3D*>& insides)
+{
+    dvec3 irradiance;
+    if (irradianceCache.Interpolate(position, normal, irradiance))
+        return irradiance;
 
-	// If reflectance effect on the resulting pixel is sufficient,
-	// trace the reflected ray further
-    if (glm::length(reflective_color) > TRACER_EPSILON)
+    IrradianceRecord record = SampleIrradiance(position, normal, insides);
+    irradianceCache.Insert(record);
+    return record.irradiance;
+}
+
+IrradianceRecord RayTracer::SampleIrradiance(const dvec3& position, const dvec3& normal, const std::stack<Object3D*>& insides)
+{
+    // The hemisphere is stratified by rows of equal ranges of sin^2 of the polar angle, so the rays are
+    // distributed by the cosine, and by about pi times as many columns of the azimuth (Ward and Heckbert)
+    const double pi = glm::pi<double>();
+    int rows = glm::max(2, static_cast<int>(glm::sqrt(irradianceSamples / pi) + 0.5));
+    int columns = glm::max(4, static_cast<int>(double(irradianceSamples) / rows + 0.5));
+    dvec3 tangent = glm::normalize(glm::cross(std::abs(normal.x) > 0.5 ? dvec3(0.0, 1.0, 0.0) : dvec3(1.0, 0.0, 0.0), normal));
+    dvec3 bitangent = glm::cross(normal, tangent);
+
+    // The random numbers of a record depend on its position only
+    RandomStream random(PositionKey(position));
+
+    const double no_hit = std::numeric_limits<double>::infinity();
+    std::vector<dvec3> radiance(rows * columns);
+    std::vector<double> distance(rows * columns);
+    dvec3 sum(0.0);
+    double inverse_distance_sum = 0.0;
+    for (int j = 0; j < rows; j++)
     {
-        Ray reflected; // reflected ray
-        reflected.direction = glm::reflect(ray.direction, intersection.normal);
-        reflected.origin = intersection.coord;
-        reflected.current_object_insides = ray.current_object_insides;
+        for (int k = 0; k < columns; k++)
+        {
+            double u = (j + random.Next()) / rows, v = (k + random.Next()) / columns;
+            double sin_theta = glm::sqrt(u), cos_theta = glm::sqrt(1.0 - u), phi = 2.0 * pi * v;
+            Ray gather(position, tangent * (sin_theta * glm::cos(phi)) + bitangent * (sin_theta * glm::sin(phi)) + normal * cos_theta);
+            gather.current_object_insides = insides;
 
-        color += reflective_color * TraceRay(reflected, step + 1);
+            int index = j * columns + k;
+            radiance[index] = GatherRadiance(gather, distance[index]);
+            sum += radiance[index];
+            if (distance[index] != no_hit)
+                inverse_distance_sum += 1.0 / glm::max(distance[index], 1e-9);
+        }
     }
 
-    // If transparency effect on the resulting pixel is sufficient,
-    // trace the refracted ray further
-    if (glm::length(transparency_color) > TRACER_EPSILON)
+    IrradianceRecord record;
+    record.position = position;
+    record.normal = normal;
+    // With the rays distributed by the cosine, the mean radiance is the irradiance divided by pi,
+    // which is the scale of the photon map estimates and of the diffuse color
+    record.irradiance = sum / double(rows * columns);
+    double harmonic_mean = inverse_distance_sum > 0.0 ? rows * columns / inverse_distance_sum : irradianceMaxSpacing;
+    record.radius = glm::clamp(harmonic_mean, irradianceMinSpacing, irradianceMaxSpacing);
+
+    // Gradients of Ward and Heckbert, divided by pi as the irradiance is
+    for (int c = 0; c < 3; c++)
+        record.rotational_gradient[c] = record.translational_gradient[c] = dvec3(0.0);
+    for (int k = 0; k < columns; k++)
     {
-        Ray refracted; // refracted ray
+        double phi = 2.0 * pi * (k + 0.5) / columns, phi_start = 2.0 * pi * k / columns;
+        dvec3 u_k = tangent * glm::cos(phi) + bitangent * glm::sin(phi);
+        dvec3 v_k = -tangent * glm::sin(phi) + bitangent * glm::cos(phi);
+        dvec3 v_start = -tangent * glm::sin(phi_start) + bitangent * glm::cos(phi_start);
+        int previous_k = (k + columns - 1) % columns;
 
-        refracted.direction = glm::refract(ray.direction, intersection.normal, relative_refractive_index);
-        refracted.origin = intersection.coord;
-        std::swap(refracted.current_object_insides, new_object_insides);
+        dvec3 rotation(0.0), polar(0.0), azimuthal(0.0);
+        for (int j = 0; j < rows; j++)
+        {
+            double center = (j + 0.5) / rows;
+            rotation -= glm::sqrt(center / (1.0 - center)) * radiance[j * columns + k];
 
-        color += transparency_color * TraceRay(refracted, step + 1);
+            double sin_start = glm::sqrt(double(j) / rows), sin_end = glm::sqrt(double(j + 1) / rows);
+            if (j > 0)
+            {
+                double r = glm::min(distance[j * columns + k], distance[(j - 1) * columns + k]);
+                polar += sin_start * (1.0 - double(j) / rows) / r *
+                    (radiance[j * columns + k] - radiance[(j - 1) * columns + k]);
+            }
+            double r = glm::min(distance[j * columns + k], distance[j * columns + previous_k]);
+            azimuthal += (sin_end - sin_start) / r * (radiance[j * columns + k] - radiance[j * columns + previous_k]);
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            record.rotational_gradient[c] += v_k * (rotation[c] / (rows * columns));
+            record.translational_gradient[c] += (u_k * (2.0 * pi / columns * polar[c]) + v_start * azimuthal[c]) / pi;
+        }
+    }
+    return record;
+}
+
+dvec3 RayTracer::GatherRadiance(const Ray& ray, double& distance)
+{
+    Intersection intersection;
+    FindIntersection(ray, intersection);
+    if (!intersection || !intersection.material)
+    {
+        distance = std::numeric_limits<double>::infinity();
+        return backgroundColor;
     }
+    distance = glm::distance(ray.origin, intersection.coord);
+    if (glm::dot(ray.direction, intersection.normal) > 0.0)
+        intersection.normal = -intersection.normal;
 
+    // The light of the surface as TraceRay sees it, without the reflections and refractions
+    const SurfaceMaterial* material = intersection.material;
+    dvec3 color = backgroundColor;
+    AddDirectLight(*material, intersection.normal, intersection.coord, ray.direction, dvec3(1.0), color);
+    if (glm::length(material->diffuse) >= FLT_EPSILON)
+    {
+        if (photonMap.Size() != 0)
+        {
+            color += material->diffuse * photonMap.Irradiance(
+                intersection.coord, intersection.normal, photonGatherRadius, photonGatherCount);
+        }
+        if (causticMap.Size() != 0)
+        {
+            color += material->diffuse * causticMap.Irradiance(
+                intersection.coord, intersection.normal, causticGatherRadius, causticGatherCount);
+        }
+    }
     return color;
 }
 
 void RayTracer::Render(uvec2 res)
+{
+    PrepareFrame(res);
+    RenderFrame();
+}
+
+void RayTracer::PrepareFrame(uvec2 res)
+{
+    AllocateFramebuffer(res);
+    SplitTiles();
+
+    if (numaAware && numaReplicateScene)
+        scene->ReplicateForNodes(NumaNodeCount());
+
+    BuildPhotonMaps();
+    if (lightTreeSampling)
+        lightTree.Build(scene->lights);
+    irradianceCache.SetAccuracy(irradianceAccuracy, irradianceMaxSpacing);
+
+    if (samplesPerPixel > 1)
+        sampler.Prepare();
+}
+
+void RayTracer::RenderFrame()
+{
+    if (!imageStream)
+    {
+        std::vector<int> tile_indices(tiles.size());
+        for (int i = 0; i < static_cast<int>(tiles.size()); i++)
+            tile_indices[i] = i;
+        RenderTiles(tile_indices);
+        return;
+    }
+
+    // Render the image by rows of tiles and pass every finished row to the stream
+    int tiles_per_row = (resolution.x + tileSize - 1) / tileSize;
+    std::vector<unsigned char> rgb;
+    for (int first = 0; first < static_cast<int>(tiles.size()); first += tiles_per_row)
+    {
+        std::vector<int> tile_indices(tiles_per_row);
+        for (int i = 0; i < tiles_per_row; i++)
+            tile_indices[i] = first + i;
+        RenderTiles(tile_indices);
+
+        const ImageTile& tile = tiles[first];
+        ConvertRows(tile.origin.y, tile.size.y, rgb);
+        imageStream->WriteRows(rgb.data(), tile.size.y);
+    }
+}
+
+void RayTracer::AllocateFramebuffer(uvec2 res)
 {
 	// Set resolution
     resolution = res;
-    pixels.resize(resolution.x * resolution.y);
+    if (framebufferFile.empty() || !framebuffer.AllocateMapped(resolution, pixelFormat, framebufferFile, tileSize))
+        framebuffer.Allocate(resolution, pixelFormat);
+}
 
-	// For each image pixel, trace the corresponding ray
-    #pragma omp parallel for schedule(guided)
-    for (int i = 0; i < resolution.y; i++)
+void RayTracer::SplitTiles()
+{
+    tiles.clear();
+    for (unsigned y = 0; y < resolution.y; y += tileSize)
     {
-        for (int j = 0; j < resolution.x; j++)
+        for (unsigned x = 0; x < resolution.x; x += tileSize)
         {
-            Ray ray = MakeRay(uvec2(j, i));
-            pixels[i * resolution.x + j] = GammaCompression(TraceRay(ray));
+            ImageTile tile;
+            tile.origin = uvec2(x, y);
+            tile.size = glm::min(uvec2(tileSize), resolution - tile.origin);
+            tiles.push_back(tile);
         }
     }
 }
 
-void RayTracer::SaveImageToFile(std::string fileName)
+int RayTracer::RenderChanged(const SceneEntities& changes)
 {
-    CImage image;
+    // The gather rays of the photon maps and of the irradiance records reach entities
+    // which are not recorded by the tiles
+    bool global_light = photonCount > 0 || causticPhotonCount > 0 || irradianceCaching;
+    if (global_light && !tiles.empty())
+    {
+        BuildPhotonMaps();
+        irradianceCache.Clear();
+    }
 
-    int width = resolution.x;
-    int height = resolution.y;
+    std::vector<int> tile_indices;
+    for (int i = 0; i < static_cast<int>(tiles.size()); i++)
+    {
+        if (global_light || !trackTileDependencies || tiles[i].touched.Intersects(changes))
+            tile_indices.push_back(i);
+    }
+    RenderTiles(tile_indices);
+    return static_cast<int>(tile_indices.size());
+}
 
-    image.Create(width, height, 24);
-    
-	int pitch = image.GetPitch();
-	unsigned char* imageBuffer = (unsigned char*)image.GetBits();
+void RayTracer::RenderTiles(const std::vector<int>& tile_indices)
+{
+    // The tiles were split by the last Render, tileSize may have changed since then
+    size_t buffer_size = 0;
+    for (int index : tile_indices)
+        buffer_size = glm::max(buffer_size, size_t(tiles[index].size.x) * tiles[index].size.y);
 
-	if (pitch < 0)
-	{
-		imageBuffer += pitch * (height - 1);
-		pitch =- pitch;
-	}
+    #pragma omp parallel
+    {
+        NumaPinScope pin(numaAware ? NumaTeamThreadNode() : -1);
+
+        // Pinned threads trace their tiles into a scratch buffer allocated by the thread itself,
+        // so the colors are gathered in the memory of the thread's node and only the finished tile
+        // is copied to the shared framebuffer
+        std::vector<dvec3> buffer;
+        if (numaAware)
+            buffer.resize(buffer_size);
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < static_cast<int>(tile_indices.size()); i++)
+        {
+            RenderTile(tiles[tile_indices[i]], numaAware ? &buffer : nullptr);
+        }
+    }
+}
 
-	int i, j;
-	int image_displacement = 0;
-    int texture_displacement = 0;
+void RayTracer::RenderTile(ImageTile& tile, std::vector<dvec3>* buffer)
+{
+    // The entities of the earlier passes stay touched by the accumulated image
+    if (accumulatedSamples == 0)
+        tile.touched.Clear();
+    SceneEntities* touched = trackTileDependencies ? &tile.touched : nullptr;
+
+    // New colors are averaged with the accumulated ones in proportion to their samples
+    double weight = double(glm::max(samplesPerPixel, 1)) / (accumulatedSamples + glm::max(samplesPerPixel, 1));
+    auto write = [&](unsigned i, unsigned j, dvec3 color) {
+        uvec2 pixel = tile.origin + uvec2(j, i);
+        if (accumulatedSamples > 0)
+            color = glm::mix(dvec3(framebuffer.Get(pixel.x, pixel.y)), color, weight);
+        framebuffer.Set(pixel.x, pixel.y, vec3(color));
+    };
+    auto store = [&](unsigned i, unsigned j, const dvec3& color) {
+        if (buffer)
+            (*buffer)[i * tile.size.x + j] = color;
+        else
+            write(i, j, color);
+    };
 
-	for (i = 0; i < height; i++)
-	{
-        for (j = 0; j < width; j++)
+	// For each tile pixel, trace the corresponding ray
+    for (unsigned i = 0; i < tile.size.y; i++)
+    {
+        for (unsigned j = 0; j < tile.size.x; j++)
         {
-            dvec3 color = pixels[texture_displacement + j];
-            for (int k = 0; k < 3; k++)
-                imageBuffer[image_displacement + 3*j + k] = clamp(color[2 - k], 0.0, 1.0) * 255.0;
+            uvec2 pixel = tile.origin + uvec2(j, i);
+            if (samplesPerPixel <= 1)
+            {
+                Ray ray = MakeRay(pixel);
+                store(i, j, TraceSample(ray, pixel, 0, touched));
+                continue;
+            }
+
+            // Average the rays spread over the pixel by the sampler
+            dvec3 color(0.0);
+            for (int sample = 0; sample < samplesPerPixel; sample++)
+            {
+                dvec2 offset = sampler.Get2D(pixel, sample, samplesPerPixel, 0);
+                Ray ray = MakeRay(dvec2(pixel) + offset);
+                color += TraceSample(ray, pixel, sample, touched);
+            }
+            store(i, j, color / double(samplesPerPixel));
         }
+    }
+
+    for (unsigned i = 0; buffer && i < tile.size.y; i++)
+    {
+        for (unsigned j = 0; j < tile.size.x; j++)
+            write(i, j, (*buffer)[i * tile.size.x + j]);
+    }
+
+    // Finished tiles of the mapped framebuffer leave the memory
+    framebuffer.FlushRegion(tile.origin, tile.size);
+}
+
+dvec3 RayTracer::TraceSample(const Ray& ray, uvec2, int, SceneEntities* touched)
+{
+    return TraceRay(ray, 0, touched);
+}
 
-        image_displacement += pitch;
-        texture_displacement += width;
-	}
+bool RayTracer::SaveImageToFile(std::string fileName)
+{
+    if (Framebuffer::IsFloatFormat(fileName))
+        return framebuffer.SaveToFile(fileName);
+
+    auto writer = MakeImageWriter(fileName);
+    if (!writer || !writer->Open(fileName, resolution))
+        return false;
 
-    image.Save(fileName.c_str());
-	image.Destroy();
+    // The image is converted by bands of rows, so the whole 8-bit image is never kept in memory
+    const unsigned band_size = 256;
+    std::vector<unsigned char> rgb;
+    for (unsigned first = 0; first < resolution.y; first += band_size)
+    {
+        unsigned row_count = glm::min(band_size, resolution.y - first);
+        ConvertRows(first, row_count, rgb);
+        writer->WriteRows(rgb.data(), row_count);
+    }
+    return writer->Close();
+}
+
+void RayTracer::ConvertRows(unsigned firstRow, unsigned rowCount, std::vector<unsigned char>& rgb)
+{
+    rgb.resize(rowCount * resolution.x * 3);
+    postProcess.Prepare();
+    postProcess.Process(framebuffer, firstRow, rowCount, rgb.data());
 }
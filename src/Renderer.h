@@ -9,6 +9,16 @@
 #include "glm/glm.hpp"
 #include "Types.h"
 #include "Scene.h"
+#include "Sampler.h"
+#include "ImageWriter.h"
+#include "Framebuffer.h"
+#include "PostProcess.h"
+#include "PhotonMap.h"
+#include "IrradianceCache.h"
+#include "LightTree.h"
+#include "PathGuiding.h"
+#include "LightBuffer.h"
+#include "Random.h"
 
 #include "string"
 
@@ -25,6 +35,14 @@ public:
     virtual ~Renderer() {};
 };
 
+// Rectangular part of the image rendered as a whole
+struct ImageTile
+{
+    glm::uvec2 origin; // position of the top left pixel
+    glm::uvec2 size;
+    SceneEntities touched; // entities touched by any ray traced for this tile
+};
+
 // Ray tracer renderer
 // renders scene in the internal buffer 
 // realistic and not realtime sort of renderer
@@ -35,23 +53,386 @@ public:
 	// Depends on the camera
     Ray MakeRay(glm::uvec2 pixelPos);
 
+	// Make ray that goes through the specified point of the image plane
+	// (pixel (x, y) covers the square from (x, y) to (x + 1, y + 1))
+    Ray MakeRay(glm::dvec2 imagePos);
+
 	// Trace the specified ray
 	// Returns pixel color
-    glm::dvec3 TraceRay(Ray ray, int step);
+	// Scene entities met by the ray and its children are added to touched, if it is set
+    glm::dvec3 TraceRay(Ray ray, int step, SceneEntities* touched);
 
 	// Render image
     void Render(glm::uvec2 resolution);
 
+    // Rerender only the tiles of the last rendered image which have touched any of the changed entities
+    // Suits changes of materials and object appearance; objects moved to new places of the image
+    // and changed lights require the full Render
+    // The tiles know their entities only if trackTileDependencies was set for the last Render, otherwise all of them are rerendered
+    // The photon maps and the irradiance cache hold the light of the whole scene, so if any of them is used,
+    // they are built again and all tiles are rerendered
+    // Returns the number of rerendered tiles
+    virtual int RenderChanged(const SceneEntities& changes);
+
 	// Save rendered image to specified file
-    void SaveImageToFile(std::string fileName);
+	// .pfm and .exr keep the linear colors, .png and .ppm are gamma corrected 8-bit images
+    bool SaveImageToFile(std::string fileName);
+
+    // Convert rows of the rendered image to 8-bit RGB by postProcess
+    void ConvertRows(unsigned firstRow, unsigned rowCount, std::vector<unsigned char>& rgb);
 
 	glm::uvec2 resolution;  // Image resolution
-	std::vector<glm::dvec3> pixels;  // Pixel array
+	Framebuffer framebuffer;  // Linear colors of the pixels
+    PixelFormat pixelFormat = PixelFormat::Float32;  // Layout of the framebuffer
+    std::string framebufferFile;  // If set, the framebuffer is kept in this memory-mapped file for images larger than RAM
+    std::vector<ImageTile> tiles;  // Tiles of the image
+    PostProcessor postProcess;  // Tone mapping, gamma and quantization used for 8-bit images
 
+    unsigned tileSize = 32;  // Size of the square image tiles (in pixels)
+    int samplesPerPixel = 1;  // Number of rays averaged per pixel
+    PixelSampler sampler;  // Positions of the rays inside pixels
+    ImageWriter* imageStream = nullptr;  // If set, Render writes every finished row of tiles to it
     int maxRenderStep = 10;  // Maximal tracing deepness
     glm::dvec3 backgroundColor; // Default color (is set when no intersections were found)
 
-private:
+    bool trackTileDependencies = false;  // Record the entities touched by every tile, so RenderChanged rerenders only the affected tiles
+
+    bool numaAware = false;  // Pin render threads to NUMA nodes and trace tiles into node-local scratch buffers
+    bool numaReplicateScene = false;  // Copy acceleration structures to every node (needs numaAware)
+
+    // Indirect illumination by photon mapping; the photon maps are built by Render
+    // and rebuilt by RenderChanged, since the photons depend on the materials of the whole scene
+    int photonCount = 0;  // Number of photons emitted by the lights, 0 disables the photon map
+    int photonGatherCount = 100;  // Maximal number of photons of a radiance estimate
+    double photonGatherRadius = 0.5;  // Maximal distance to the photons of a radiance estimate
+    PhotonMap photonMap;  // Photons scattered by the scene at least once (but not only by specular surfaces, if there are caustics)
+
+    // Caustics (light reflected or refracted by specular surfaces onto diffuse ones) by a separate photon map,
+    // whose photons are emitted only in the directions of the specular objects marked in the projection maps of the lights
+    int causticPhotonCount = 0;  // Number of caustic photons emitted by the lights, 0 disables the caustic map
+    int causticGatherCount = 50;  // Maximal number of photons of a caustic radiance estimate
+    double causticGatherRadius = 0.1;  // Maximal distance to the photons of a caustic radiance estimate
+    int projectionMapResolution = 256;  // Number of rows of the projection maps
+    PhotonMap causticMap;  // Photons reflected or refracted only by specular surfaces
+
+    // Indirect diffuse light by irradiance caching: the irradiance is sampled over the hemisphere only at sparse
+    // records, made when no record is close enough, and interpolated between them by their gradients
+    // The surfaces seen by the hemisphere rays are lit directly and by the photon maps, if they are built
+    bool irradianceCaching = false;
+    int irradianceSamples = 256;  // Number of hemisphere rays of a record
+    double irradianceAccuracy = 0.2;  // Maximal interpolation error
+    double irradianceMinSpacing = 0.05;  // Minimal radius of the records
+    double irradianceMaxSpacing = 1.0;  // Maximal radius of the records
+    IrradianceCache irradianceCache;  // Records of the last rendered image
+
+    // Direct light of many lights by sampling a few of them from lightTree at every surface point,
+    // each with the probability of its estimated contribution; the tree is built by Render
+    bool lightTreeSampling = false;
+    int lightSamples = 4;  // Number of lights sampled per surface point
+    double lightCullFraction = 1e-3;  // Lights are skipped if they bring less than this part of the light of their neighbours
+    LightTree lightTree;
+
+protected:
+    // Allocate the framebuffer of the specified resolution
+    void AllocateFramebuffer(glm::uvec2 res);
+
+    // Split the framebuffer into tiles of tileSize
+    void SplitTiles();
+
+    // Allocate the framebuffer, split it into tiles and build what all the tiles share:
+    // the scene replicas, photon maps, light tree and sampler
+    void PrepareFrame(glm::uvec2 res);
+
+    // Render all tiles of the prepared frame, passing every finished row of tiles to imageStream, if it is set
+    void RenderFrame();
+
+    // Render the tiles with the specified indices in parallel
+    void RenderTiles(const std::vector<int>& tile_indices);
+
+    // Trace all pixels of the tile into the framebuffer, through the scratch buffer if it is set
+    void RenderTile(ImageTile& tile, std::vector<glm::dvec3>* buffer);
+
+    // Samples per pixel already averaged in the framebuffer; RenderFrame adds the new samples
+    // to them instead of overwriting the pixels, if it is not zero
+    int accumulatedSamples = 0;
+
+    // Color of the camera ray of the specified sample of the pixel, traced by TraceRay
+    virtual glm::dvec3 TraceSample(const Ray& ray, glm::uvec2 pixel, int sample, SceneEntities* touched);
+
+    // Find the nearest intersection of the ray and the scene
+    // Returns the intersected object
+    Object3D* FindIntersection(const Ray& ray, Intersection& intersection);
+
+    // Passage of a ray through the surface of the intersected object
+    struct SurfacePassage
+    {
+        std::stack<Object3D*> insides;  // objects the ray is in after the surface
+        double relative_refractive_index = 1.0;
+        double R = 0.0, T = 0.0;  // Fresnel reflectance and transmittance, zero unless the ray enters a material
+    };
+    SurfacePassage PassSurface(const Ray& ray, const Intersection& intersection, Object3D* intersected_object) const;
+
+    // Add the direct light of the scene lights reflected by the material at the point multiplied by weight to color
+    // All lights are summed, or a few are sampled from lightTree, if lightTreeSampling is set
+    void AddDirectLight(const SurfaceMaterial& material, const glm::dvec3& normal, const glm::dvec3& point,
+        const glm::dvec3& view_vector, const glm::dvec3& weight, glm::dvec3& color) const;
+
+    // Build photonMap and causticMap
+    void BuildPhotonMaps();
+
+    // Emit count photons from the lights (only in the marked directions, if the projection maps of the lights
+    // are specified) and store the caustic or the global photons in map
+    // Global photons of paths of only specular bounces are stored if store_specular_paths is set
+    // Different seeds give independent sets of photons
+    void EmitPhotons(int count, const std::vector<ProjectionMap>* projections, bool store_specular_paths, PhotonMap& map,
+        uint64_t seed = 0);
+
+    // Trace the photon with the specified power through the scene
+    // Photons which hit diffuse surfaces after at least one bounce are added to stored, except the photons of paths
+    // of only specular bounces, unless store_specular_paths is set;
+    // caustic photons are stored only after specular bounces and are not reflected diffusely
+    void TracePhoton(Ray ray, glm::dvec3 power, RandomStream& random, bool caustic, bool store_specular_paths,
+        std::vector<Photon>& stored);
+
+    // Check whether the material reflects or refracts light specularly
+    static bool IsSpecular(const SurfaceMaterial& material);
+
+    // Irradiance of the diffuse surface from the other surfaces, interpolated by irradianceCache
+    // or sampled by a new record; insides are the objects containing the point
+    glm::dvec3 IndirectIrradiance(const glm::dvec3& position, const glm::dvec3& normal, const std::stack<Object3D*>& insides);
+
+    // Sample the irradiance and its gradients over the hemisphere of the point
+    IrradianceRecord SampleIrradiance(const glm::dvec3& position, const glm::dvec3& normal, const std::stack<Object3D*>& insides);
+
+    // Radiance coming back along the hemisphere ray and the distance to the surface it hits (infinite if none)
+    glm::dvec3 GatherRadiance(const Ray& ray, double& distance);
+
     InsideMaterial void_material;
 
 };
+
+// Unidirectional path tracer
+// Every camera ray continues as a random path scattered by the materials: diffuse and glossy (Phong) bounces
+// are sampled by the material, mirror reflection and refraction are followed as they are
+// At every diffuse or glossy point the lights are sampled by shadow rays (next event estimation)
+// The background is the light of the sky: it is sampled both by the shadow rays and by the bounces,
+// which are weighted by multiple importance sampling (power heuristic)
+// The lights are summed or sampled from the light tree, as the direct light of RayTracer is
+// With path guiding the incident light is learned by Render in passes of 1, 2, 4, ... samples per pixel:
+// every pass records the light found by its diffuse and glossy bounces in guidingTree, and the bounces
+// of the next passes sample the learned directions mixed with the material; the last pass takes
+// the rest of the samples, and the image averages all passes by their samples
+class PathTracer : public RayTracer
+{
+public:
+    // Trace the image, in learning passes if pathGuiding is set, and write it to imageStream, if it is set
+    void Render(glm::uvec2 res) override;
+
+    int rouletteDepth = 3;  // Number of bounces after which the paths are terminated randomly by their throughput
+    bool nextEventEstimation = true;  // Sample the lights and the sky by shadow rays; otherwise only the bounces find the sky
+    bool shadowCaching = true;  // Test the last occluder of the shadow rays of a thread towards a light before the whole scene
+
+    // Shadow rays towards the point lights test only the objects listed by the cells of their light buffers;
+    // the buffers are built by Render, so the objects and the lights must not move until the next Render
+    int lightBufferResolution = 0;  // Number of cells along an edge of a face of the light buffers, 0 disables them
+    std::vector<LightBuffer> lightBuffers;  // one for each of the scene lights
+
+    bool pathGuiding = false;
+    double guidingFraction = 0.5;  // Part of the diffuse and glossy bounces sampled by the learned directions
+    double guidingSplitSamples = 4000.0;  // Records of a pass of one sample per pixel which split a spatial leaf
+    GuidingTree guidingTree;  // Light learned by the last rendered image
+
+protected:
+    glm::dvec3 TraceSample(const Ray& ray, glm::uvec2 pixel, int sample, SceneEntities* touched) override;
+
+    // Probabilities of the scattering kinds of a material at a point
+    struct Lobes
+    {
+        double diffuse = 0.0, glossy = 0.0, mirror = 0.0, refraction = 0.0;
+        glm::dvec3 mirror_color, refraction_color;  // parts of the light reflected and refracted
+    };
+    Lobes GetLobes(const SurfaceMaterial& material, const SurfacePassage& passage) const;
+
+    // Scatter the ray at the intersection by one of the lobes: sets the next ray, the factor of the throughput
+    // and the density of the direction (zero for mirror reflection and refraction)
+    // The diffuse and glossy bounces sample guide by guidingFraction of them, if it is set
+    // Returns false if the path ends
+    bool Scatter(const SurfaceMaterial& material, const Lobes& lobes, const Ray& ray, const Intersection& intersection,
+        SurfacePassage& passage, RandomStream& random, Ray& next, glm::dvec3& weight, double& pdf,
+        const DirectionalQuadtree* guide = nullptr) const;
+
+    // Reflectance of the diffuse and glossy parts of the material from direction wi to direction -view
+    glm::dvec3 Evaluate(const SurfaceMaterial& material, const glm::dvec3& normal, const glm::dvec3& view,
+        const glm::dvec3& wi) const;
+
+    // Probability density of the direction wi sampled by the diffuse and glossy parts of the lobes
+    double Pdf(const SurfaceMaterial& material, const Lobes& lobes, const glm::dvec3& normal, const glm::dvec3& view,
+        const glm::dvec3& wi) const;
+
+    // Density of the direction wi sampled by Scatter with the guide (Pdf, if there is none)
+    double GuidedPdf(const SurfaceMaterial& material, const Lobes& lobes, const glm::dvec3& normal, const glm::dvec3& view,
+        const glm::dvec3& wi, const DirectionalQuadtree* guide) const;
+
+    // Light of the point lights and the sky reaching the point through the shadow rays and reflected to -view
+    // The sky is weighted against the bounces sampled with the guide, if it is set
+    glm::dvec3 SampleLights(const SurfaceMaterial& material, const Lobes& lobes, const glm::dvec3& point,
+        const glm::dvec3& normal, const glm::dvec3& view, const std::stack<Object3D*>& insides, RandomStream& random,
+        const DirectionalQuadtree* guide = nullptr);
+
+    // Check whether nothing is between the point and the specified distance along the direction
+    // If the shadow ray goes to the light with the specified index, the object (or the mesh triangle) which blocked
+    // the last shadow ray of the thread towards it is tested first, then the candidates of the light buffer of the light,
+    // if it is built, or else the whole scene
+    bool Visible(const glm::dvec3& point, const glm::dvec3& direction, double distance, const std::stack<Object3D*>& insides,
+        int light = -1);
+
+    // Forget the occluders of the shadow rays, make room for the lights of the scene and build the light buffers;
+    // called by Render
+    void PrepareShadowRays();
+
+private:
+    // Object which blocked a shadow ray, and its triangle, if it is a mesh whose triangle stays in memory
+    struct ShadowOccluder
+    {
+        Object3D* object = nullptr;
+        Model* model = nullptr;  // model of the triangle
+        MeshTriangle triangle;
+    };
+
+    // Check whether the occluder is closer than distance along the shadow ray
+    static bool Occludes(const ShadowOccluder& occluder, const Ray& shadow, double distance);
+
+    std::vector<std::vector<ShadowOccluder>> shadowCache;  // per thread, per light
+    bool guidingTraining = false;  // the current pass records the light in guidingTree
+    std::vector<BoundingBox> guidingBounds;  // per-thread boxes of the points met by the first pass
+};
+
+// Bidirectional path tracer
+// Every sample traces a camera subpath and a light subpath from a light picked by its power and connects
+// all their vertices (next event estimation and light tracing included); the paths of the same light
+// found by different connections are weighted by multiple importance sampling (balance heuristic),
+// so light passing through glass before reaching a diffuse surface is found by the light subpaths
+// Light subpath vertices seen by the camera are splatted into one shared image by atomic additions,
+// which is added to the framebuffer after all tiles are traced; the light subpaths of any tile may reach any other, so RenderChanged renders the whole image
+// The background is found only by the camera subpaths
+class BidirectionalPathTracer : public PathTracer
+{
+public:
+    // Trace the tiles, add the splatted light and write the image to imageStream, if it is set
+    void Render(glm::uvec2 res) override;
+
+    // Render the whole image again, since every tile holds the light splatted by the others
+    int RenderChanged(const SceneEntities& changes) override;
+
+protected:
+    glm::dvec3 TraceSample(const Ray& ray, glm::uvec2 pixel, int sample, SceneEntities* touched) override;
+
+private:
+    // Vertex of a camera or a light subpath
+    struct PathVertex
+    {
+        glm::dvec3 position;
+        glm::dvec3 normal;  // facing the side the subpath came from; zero at the camera and the lights
+        glm::dvec3 incoming;  // direction of the ray which reached the vertex
+        const SurfaceMaterial* material = nullptr;  // null at the camera and the lights
+        Lobes lobes;
+        std::stack<Object3D*> insides;  // objects containing the side of the surface the subpath came from
+        glm::dvec3 beta;  // throughput of the subpath up to the vertex
+        bool delta = false;  // scattered by mirror reflection or refraction
+        double pdf_forward = 0.0;  // density per area of the vertex sampled by its subpath
+        double pdf_reverse = 0.0;  // density per area of the vertex sampled by the opposite subpath
+    };
+
+    // Continue the subpath by the ray whose direction has the specified density until it ends or has max_vertices
+    // Returns the background light found by the camera subpath
+    glm::dvec3 RandomWalk(Ray ray, glm::dvec3 beta, double pdf, int max_vertices, bool from_light,
+        RandomStream& random, std::vector<PathVertex>& path, SceneEntities* touched);
+
+    // Light of the path made of s vertices of the light subpath and t vertices of the camera subpath
+    // If t is 1, the light is splatted to the pixel where the light vertex is seen and the result is zero
+    glm::dvec3 Connect(const std::vector<PathVertex>& light_path, int s, const std::vector<PathVertex>& camera_path, int t,
+        RandomStream& random);
+
+    // Densities of the connected vertices and of their predecessors which change with the connection
+    struct ConnectionDensities
+    {
+        double light_end_forward = 0.0;  // differs from the light subpath if the light is picked by the connection
+        double light_end_reverse = 0.0, light_previous_reverse = 0.0;
+        double camera_end_reverse = 0.0, camera_previous_reverse = 0.0;
+    };
+
+    // Weight of the connection by the balance heuristic
+    double MisWeight(const std::vector<PathVertex>& light_path, int s, const std::vector<PathVertex>& camera_path, int t,
+        const ConnectionDensities& densities) const;
+
+    // Density per area at the point to (with the specified normal, zero for the camera and the lights)
+    // of the direction sampled at the point from with density pdf
+    static double ToArea(double pdf, const glm::dvec3& from, const glm::dvec3& to, const glm::dvec3& to_normal);
+
+    // Image position where the point is seen and the cosine of its direction with the camera axis
+    // Returns false if the point is not in the image
+    bool Project(const glm::dvec3& point, glm::dvec2& image_pos, double& cos_theta) const;
+
+    // Density of the camera ray directions and the importance of the camera for the cosine with the camera axis
+    double CameraPdf(double cos_theta) const;
+    double CameraImportance(double cos_theta) const;
+
+    // Pick a light by its power; returns its index and the probability
+    int PickLight(double u, double& probability) const;
+
+    glm::dmat3 cameraRotation;
+    std::vector<double> lightCdf;  // cumulative power of the lights
+    std::vector<glm::vec3> splats;  // light splatted by all threads
+};
+
+// Progressive photon mapping renderer
+// The camera rays are traced once to the diffuse surfaces, where the hit points are kept;
+// every photon pass then adds the photons near the hit points to their statistics and shrinks their radii,
+// so the memory stays fixed while the indirect light (sharp caustics included) converges
+// The direct light is computed exactly by the camera pass
+class ProgressivePhotonMapper : public RayTracer
+{
+public:
+    int passCount = 16;  // Number of photon passes run by Render
+    int photonsPerPass = 100000;  // Number of photons emitted by each pass
+    double initialRadius = 0.25;  // Gather radius of the hit points before the first pass
+    double alpha = 0.7;  // Fraction of the photons of a pass kept by the statistics, smaller values shrink the radii faster
+
+    // Trace the hit points, run passCount photon passes and write the image to imageStream, if it is set
+    void Render(glm::uvec2 res) override;
+
+    // Run more photon passes refining the last rendered image
+    void RenderPasses(int count);
+
+    // Trace the hit points again and run as many photon passes as the last image had, since the statistics
+    // of every hit point are gathered from the photons of the whole scene
+    // Returns the number of tiles of the image, or 0 if nothing was rendered yet
+    int RenderChanged(const SceneEntities& changes) override;
+
+private:
+    // Point of a diffuse surface seen by a camera ray
+    struct HitPoint
+    {
+        glm::dvec3 position;
+        glm::dvec3 normal;
+        glm::dvec3 weight;   // part of the irradiance of the point reaching the pixel
+        uint32_t pixel;      // index of the pixel, row by row
+        double radius2;      // squared gather radius
+        double photon_count; // accumulated number of photons (N)
+        glm::dvec3 flux;     // accumulated flux of the photons in the radius (tau)
+    };
+
+    // Trace the hit points and the direct light of all pixels, the hit points have no photons yet
+    void TraceCameraPass();
+
+    // Trace the camera ray with the specified weight in the pixel color
+    // Adds the hit points at the diffuse surfaces to points and the direct light to direct
+    void TraceHitPoints(Ray ray, int step, glm::dvec3 weight, uint32_t pixel, glm::dvec3& direct, std::vector<HitPoint>& points);
+
+    // Write the colors estimated by the hit points to the framebuffer
+    void UpdateFramebuffer();
+
+    std::vector<HitPoint> hitPoints;
+    std::vector<glm::dvec3> directLight;  // direct light of the pixels, row by row
+    int passesDone = 0;
+};
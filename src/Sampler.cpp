@@ -0,0 +1,300 @@
+#include "Sampler.h"
+
+#include <cmath>
+
+namespace
+{
+    // Direction numbers of the first four dimensions of Sobol sequence
+    // (primitive polynomials and initial numbers by Joe and Kuo)
+    struct SobolDirections
+    {
+        uint32_t v[4][32];
+
+        SobolDirections()
+        {
+            const int degree[4] = { 0, 1, 2, 3 };
+            const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+            const uint32_t initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+            for (int i = 0; i < 32; i++)
+                v[0][i] = 1u << (31 - i);
+
+            for (int d = 1; d < 4; d++)
+            {
+                int s = degree[d];
+                for (int i = 0; i < 32; i++)
+                {
+                    if (i < s)
+                    {
+                        v[d][i] = initial[d][i] << (31 - i);
+                        continue;
+                    }
+                    v[d][i] = v[d][i - s] ^ (v[d][i - s] >> s);
+                    for (int k = 1; k < s; k++)
+                    {
+                        if ((coefficients[d] >> (s - 1 - k)) & 1)
+                            v[d][i] ^= v[d][i - k];
+                    }
+                }
+            }
+        }
+    };
+
+    const SobolDirections sobol_directions;
+
+    uint32_t ReverseBits(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Owen scrambling of reversed bits by the hash of Laine and Karras
+    uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    uint32_t NestedUniformScramble(uint32_t x, uint32_t seed)
+    {
+        return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+    }
+
+    uint32_t HashCombine(uint32_t seed, uint32_t value)
+    {
+        return static_cast<uint32_t>(MixBits((static_cast<uint64_t>(seed) << 32) | value));
+    }
+
+    uint32_t Sobol(uint32_t index, int dimension)
+    {
+        uint32_t x = 0;
+        for (int bit = 0; index != 0; bit++, index >>= 1)
+        {
+            if (index & 1)
+                x ^= sobol_directions.v[dimension][bit];
+        }
+        return x;
+    }
+
+    // Random permutation of [0, count) (by Kensler)
+    uint32_t PermuteIndex(uint32_t i, uint32_t count, uint32_t p)
+    {
+        uint32_t w = count - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do
+        {
+            i ^= p; i *= 0xe170893du; i ^= p >> 16;
+            i ^= (i & w) >> 4; i ^= p >> 8; i *= 0x0929eb3fu;
+            i ^= p >> 23; i ^= (i & w) >> 1; i *= 1 | p >> 27;
+            i *= 0x6935fa69u; i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3u; i ^= (i & w) >> 2;
+            i *= 0xc860a3dfu; i &= w; i ^= i >> 5;
+        } while (i >= count);
+        return (i + p) % count;
+    }
+
+    uint32_t GreatestCommonDivisor(uint32_t a, uint32_t b)
+    {
+        while (b != 0)
+        {
+            uint32_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    uint64_t PixelKey(glm::uvec2 pixel)
+    {
+        return (static_cast<uint64_t>(pixel.y) << 32) | pixel.x;
+    }
+
+    const int blue_noise_size = 64;
+}
+
+double SobolSample(uint32_t index, uint32_t dimension, uint32_t seed)
+{
+    // Every four dimensions form an independently scrambled and shuffled 4D Sobol sequence
+    uint32_t group_seed = HashCombine(seed, dimension / 4);
+    uint32_t shuffled_index = NestedUniformScramble(index, group_seed);
+    uint32_t x = NestedUniformScramble(Sobol(shuffled_index, dimension % 4), HashCombine(group_seed, dimension % 4));
+    return x * (1.0 / 4294967296.0);
+}
+
+double LatticeSample(uint32_t index, uint32_t count, uint32_t dimension)
+{
+    if (count <= 1)
+        return 0.5;
+
+    // Dimensions are taken by pairs of 2D Korobov lattices with generator (1, g),
+    // where g/count approximates the golden ratio (Fibonacci lattice for Fibonacci counts)
+    uint32_t pair = dimension / 2;
+    if (pair > 0)
+        index = PermuteIndex(index % count, count, HashCombine(count, pair));
+
+    if (dimension % 2 == 0)
+        return (index % count) / static_cast<double>(count);
+
+    uint32_t g = static_cast<uint32_t>(count * 0.6180339887498949 + 0.5);
+    while (GreatestCommonDivisor(g, count) != 1)
+        g++;
+    return ((static_cast<uint64_t>(index) * g) % count) / static_cast<double>(count);
+}
+
+std::vector<float> MakeBlueNoiseTile(int size, uint64_t seed)
+{
+    const int n = size * size;
+    const double sigma = 1.5;
+
+    // Toroidal gaussian filter used to measure how dense the pattern is around every pixel
+    std::vector<float> kernel(n);
+    for (int dy = 0; dy < size; dy++)
+    {
+        for (int dx = 0; dx < size; dx++)
+        {
+            int wx = glm::min(dx, size - dx);
+            int wy = glm::min(dy, size - dy);
+            kernel[dy * size + dx] = static_cast<float>(std::exp(-(wx * wx + wy * wy) / (2.0 * sigma * sigma)));
+        }
+    }
+
+    std::vector<char> pattern(n, 0);
+    std::vector<float> energy(n, 0.0f);
+    auto set_pixel = [&](int p, bool value)
+    {
+        pattern[p] = value;
+        float sign = value ? 1.0f : -1.0f;
+        int px = p % size, py = p / size;
+        for (int qy = 0; qy < size; qy++)
+        {
+            int dy = (qy - py + size) % size;
+            for (int qx = 0; qx < size; qx++)
+                energy[qy * size + qx] += sign * kernel[dy * size + (qx - px + size) % size];
+        }
+    };
+    // Tightest cluster is the set pixel with the largest energy,
+    // largest void is the unset pixel with the smallest energy
+    auto tightest_cluster = [&]()
+    {
+        int best = -1;
+        for (int p = 0; p < n; p++)
+        {
+            if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        }
+        return best;
+    };
+    auto largest_void = [&]()
+    {
+        int best = -1;
+        for (int p = 0; p < n; p++)
+        {
+            if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        }
+        return best;
+    };
+
+    // Initial pattern: random pixels relaxed until they are evenly spread
+    int ones = glm::max(n / 10, 1);
+    for (int placed = 0, i = 0; placed < ones; i++)
+    {
+        int p = static_cast<int>(RandomBits(0, 0, 0, i, seed) % n);
+        if (!pattern[p])
+        {
+            set_pixel(p, true);
+            placed++;
+        }
+    }
+    for (int iteration = 0; iteration < n; iteration++)
+    {
+        int cluster = tightest_cluster();
+        set_pixel(cluster, false);
+        int hole = largest_void();
+        set_pixel(hole, true);
+        if (hole == cluster)
+            break;
+    }
+
+    std::vector<int> rank(n, 0);
+    std::vector<char> initial_pattern = pattern;
+    std::vector<float> initial_energy = energy;
+
+    // Ranks of the initial pixels: remove tightest clusters one by one
+    for (int r = ones - 1; r >= 0; r--)
+    {
+        int cluster = tightest_cluster();
+        set_pixel(cluster, false);
+        rank[cluster] = r;
+    }
+
+    // Ranks of the other pixels: fill largest voids one by one
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (int r = ones; r < n; r++)
+    {
+        int hole = largest_void();
+        set_pixel(hole, true);
+        rank[hole] = r;
+    }
+
+    std::vector<float> values(n);
+    for (int p = 0; p < n; p++)
+        values[p] = (rank[p] + 0.5f) / n;
+    return values;
+}
+
+void PixelSampler::Prepare()
+{
+    if (blue_noise.empty())
+        blue_noise = MakeBlueNoiseTile(blue_noise_size, seed);
+}
+
+double PixelSampler::Get(glm::uvec2 pixel, uint32_t sample, uint32_t sample_count, uint32_t dimension) const
+{
+    // Dithered sequences are shared by all pixels and shifted by blue noise,
+    // so the errors of the neighbour pixels differ as much as possible
+    bool dither = blue_noise_dither && sequence != SampleSequence::Random;
+    uint64_t key = dither ? 0 : PixelKey(pixel);
+
+    double value = 0.0;
+    switch (sequence)
+    {
+    case SampleSequence::Random:
+        return RandomUniform(PixelKey(pixel), sample, 0, dimension, seed);
+    case SampleSequence::Sobol:
+        value = SobolSample(sample, dimension, static_cast<uint32_t>(MixBits(seed ^ key)));
+        break;
+    case SampleSequence::Rank1Lattice:
+        value = LatticeSample(sample, sample_count, dimension) + RandomUniform(key, 0, 0, dimension, seed);
+        break;
+    }
+
+    if (dither)
+        value += BlueNoise(pixel, dimension);
+    return value - std::floor(value);
+}
+
+double PixelSampler::BlueNoise(glm::uvec2 pixel, uint32_t dimension) const
+{
+    if (blue_noise.empty())
+        return RandomUniform(PixelKey(pixel), 0, 0, dimension, seed);
+
+    // Every dimension reads the tile with its own offset along R2 sequence
+    uint32_t offset_x = static_cast<uint32_t>(blue_noise_size * std::fmod(dimension * 0.7548776662466927, 1.0));
+    uint32_t offset_y = static_cast<uint32_t>(blue_noise_size * std::fmod(dimension * 0.5698402909980532, 1.0));
+    uint32_t x = (pixel.x + offset_x) % blue_noise_size;
+    uint32_t y = (pixel.y + offset_y) % blue_noise_size;
+    return blue_noise[y * blue_noise_size + x];
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+/*
+    Sampler.h
+    Low-discrepancy sample sequences for pixel and secondary sampling
+    Author: Artyom Bishev
+*/
+
+#include "glm/glm.hpp"
+#include "Random.h"
+#include <vector>
+#include <cstdint>
+
+// Kinds of sample sequences
+enum class SampleSequence
+{
+    Random,       // independent random numbers
+    Sobol,        // Owen-scrambled Sobol sequence
+    Rank1Lattice  // randomly shifted rank-1 lattice
+};
+
+// Provides sample points for every pixel of the image
+// Dimension 0 and 1 are used for the position inside the pixel,
+// the other dimensions are free for secondary sampling (lights, BSDFs, e.t.c)
+class PixelSampler
+{
+public:
+    SampleSequence sequence = SampleSequence::Sobol;
+    bool blue_noise_dither = true; // shift the sequences of the neighbour pixels by blue noise
+    uint64_t seed = 0;
+
+    // Build the tables used by the sampler
+    // Must be called before the sampler is used by several threads
+    void Prepare();
+
+    // Coordinate of the specified dimension of the sample with index sample of the pixel
+    // sample_count is the number of samples taken per pixel
+    double Get(glm::uvec2 pixel, uint32_t sample, uint32_t sample_count, uint32_t dimension) const;
+
+    // Two successive dimensions starting from the specified one
+    glm::dvec2 Get2D(glm::uvec2 pixel, uint32_t sample, uint32_t sample_count, uint32_t dimension) const
+    {
+        return glm::dvec2(
+            Get(pixel, sample, sample_count, dimension),
+            Get(pixel, sample, sample_count, dimension + 1));
+    }
+
+private:
+    // Blue noise value of the pixel for the specified dimension
+    double BlueNoise(glm::uvec2 pixel, uint32_t dimension) const;
+
+    std::vector<float> blue_noise; // tile of blue noise values in [0, 1)
+};
+
+// Coordinate of the specified dimension of a point of Sobol sequence
+// scrambled by hash-based Owen scrambling with the specified seed
+double SobolSample(uint32_t index, uint32_t dimension, uint32_t seed);
+
+// Coordinate of the specified dimension of a point of rank-1 lattice of count points
+double LatticeSample(uint32_t index, uint32_t count, uint32_t dimension);
+
+// Square tile of blue noise values in [0, 1) built by void-and-cluster method
+std::vector<float> MakeBlueNoiseTile(int size, uint64_t seed = 0);
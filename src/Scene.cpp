@@ -1 +1,35 @@
-#include "Scene.h"
\ No newline at end of file
+#include "Scene.h"
+#include "Numa.h"
+
+void Scene::Swap(Scene& other)
+{
+    std::swap(bundle_file, other.bundle_file);
+    std::swap(lights, other.lights);
+    std::swap(objects, other.objects);
+    std::swap(surfaces, other.surfaces);
+    std::swap(models, other.models);
+    std::swap(surface_materials, other.surface_materials);
+    std::swap(inside_materials, other.inside_materials);
+    std::swap(replica_node_count, other.replica_node_count);
+
+    // The empty objects keep their own surfaces but take the default material of the swapped table
+    std::swap(empty_object.material, other.empty_object.material);
+}
+
+void Scene::ReplicateForNodes(int node_count)
+{
+    if (node_count == replica_node_count)
+        return;
+    replica_node_count = node_count;
+    for (auto& surface : surfaces)
+        surface.second->ReserveReplicas(node_count);
+
+    // One thread per node makes the copies, so they are allocated in the node's local memory
+    #pragma omp parallel for num_threads(node_count) schedule(static, 1)
+    for (int node = 0; node < node_count; ++node)
+    {
+        NumaPinScope pin(node);
+        for (auto& surface : surfaces)
+            surface.second->ReplicateForNode(node);
+    }
+}
@@ -4,9 +4,12 @@
 #include "Mesh.h"
 #include "BasicSurfaces.h"
 #include "Object3D.h"
+#include "MappedFile.h"
+#include "GeometryCache.h"
 
 #include <vector>
 #include <map>
+#include <set>
 #include <memory>
 
 /*
@@ -16,6 +19,41 @@
     Author: Artyom Bishev
 */
 
+// Set of scene entities, e.g. those touched by rays or changed by the user
+struct SceneEntities
+{
+    std::set<const Object3D*> objects;
+    std::set<const SurfaceMaterial*> surface_materials;
+    std::set<const InsideMaterial*> inside_materials;
+
+    // Check whether the sets have any entities in common
+    bool Intersects(const SceneEntities& other) const
+    {
+        return SetsIntersect(objects, other.objects) ||
+            SetsIntersect(surface_materials, other.surface_materials) ||
+            SetsIntersect(inside_materials, other.inside_materials);
+    }
+
+    void Clear()
+    {
+        objects.clear();
+        surface_materials.clear();
+        inside_materials.clear();
+    }
+
+private:
+    template<typename T>
+    static bool SetsIntersect(const std::set<T>& a, const std::set<T>& b)
+    {
+        for (const auto& entity : a)
+        {
+            if (b.count(entity))
+                return true;
+        }
+        return false;
+    }
+};
+
 class Scene
 {
 public:
@@ -30,21 +68,35 @@ public:
         empty_object.surface = &empty_surface;
     }
 
+    // Scene bundle the scene was loaded from; the meshes use its data, so it is destroyed last
+    std::unique_ptr<MappedFile> bundle_file;
+
+    // Clusters of the streamed meshes; the meshes remove their clusters from it, so it is destroyed after them
+    GeometryCache geometry_cache;
+
     // Lights
     std::vector<PointLight> lights;
 
     // Objects (all of them will be rendered)
     std::vector<Object3D> objects;
 
-    // Surfaces
-    std::map<std::string, std::unique_ptr<Surface>> surfaces;
+    // Surfaces (maps compare names with std::less<>, so they can be looked up by string_view)
+    std::map<std::string, std::unique_ptr<Surface>, std::less<>> surfaces;
 
     // Models
     std::vector<std::unique_ptr<Model>> models;
 
     // Materials
-    std::map<std::string, std::unique_ptr<SurfaceMaterial>> surface_materials;
-    std::map<std::string, std::unique_ptr<InsideMaterial>> inside_materials;
+    std::map<std::string, std::unique_ptr<SurfaceMaterial>, std::less<>> surface_materials;
+    std::map<std::string, std::unique_ptr<InsideMaterial>, std::less<>> inside_materials;
+
+    // Exchange the entities with the other scene; the geometry caches stay where they are,
+    // since the meshes refer to them
+    void Swap(Scene& other);
+
+    // Copy read-only acceleration structures of all surfaces to each of node_count NUMA nodes
+    // The copies are made once, later calls for the same number of nodes do nothing
+    void ReplicateForNodes(int node_count);
 
     // Object representing the empty space outside of all of the other objects
     Object3D empty_object;
@@ -52,4 +104,7 @@ public:
 private:
     // Surface of the empty_object
     Surface empty_surface;
+
+    // Number of nodes the surfaces were replicated for, 0 if they were not
+    int replica_node_count = 0;
 };
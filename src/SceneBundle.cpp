@@ -0,0 +1,441 @@
+#include "SceneBundle.h"
+#include "MappedFile.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+
+namespace
+{
+    const char bundle_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+    const uint32_t byte_order_mark = 0x01020304;
+    const size_t table_alignment = 16;
+
+    // Range of records in the file
+    struct BundleTable
+    {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    // Range of characters in the string table
+    struct BundleString
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct BundleHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;  // byte_order_mark written by the machine that compiled the bundle
+        uint64_t file_size;
+        BundleTable strings;
+        BundleTable surface_materials;
+        BundleTable inside_materials;
+        BundleTable surfaces;
+        BundleTable models;
+        BundleTable objects;
+        BundleTable lights;
+    };
+
+    struct BundleSurfaceMaterial
+    {
+        BundleString name;
+        double shininess;
+        glm::dvec3 specular;
+        glm::dvec3 diffuse;
+        glm::dvec3 reflective_color;
+        glm::dvec3 transparency_color;
+    };
+
+    struct BundleInsideMaterial
+    {
+        BundleString name;
+        double refractive_index;
+    };
+
+    enum BundleSurfaceKind : uint32_t
+    {
+        EmptySurface,
+        SphereSurface,
+        PlaneSurface,
+        MeshSurface
+    };
+
+    struct BundleSurface
+    {
+        BundleString name;
+        uint32_t kind;
+        uint32_t reserved;
+        BoundingBox bounding_box;
+        BoundingBox octree_box;
+        BundleTable cells;      // MeshOctreeCell records
+        BundleTable triangles;  // MeshTriangle records
+        BundleTable materials;  // int32_t indices in the surface material table, one for each triangle material
+    };
+
+    struct BundleModel
+    {
+        int32_t surface;           // index in the surface table, -1 for none
+        int32_t surface_material;  // index in the surface material table
+        uint32_t inverted;
+        uint32_t reserved;
+        glm::dvec3 position;
+        glm::dvec3 orientation;
+        glm::dvec3 scale;
+    };
+
+    struct BundleObject
+    {
+        int32_t model;            // index in the model table, -1 for the empty surface
+        int32_t inside_material;  // -1 for none
+    };
+
+    struct BundleLight
+    {
+        glm::dvec3 center;
+        glm::dvec3 color;
+    };
+
+    static_assert(sizeof(glm::dvec3) == 24 && sizeof(BoundingBox) == 48, "glm vectors must be tightly packed");
+
+    // Builds the file in memory
+    class BundleBuilder
+    {
+    public:
+        std::vector<char> data;
+        std::string strings;
+
+        template<typename T>
+        BundleTable AddTable(const T* records, size_t count)
+        {
+            data.resize((data.size() + table_alignment - 1) / table_alignment * table_alignment, 0);
+            BundleTable table = { data.size(), count };
+            const char* bytes = reinterpret_cast<const char*>(records);
+            data.insert(data.end(), bytes, bytes + count * sizeof(T));
+            return table;
+        }
+
+        template<typename T>
+        BundleTable AddTable(const std::vector<T>& records)
+        {
+            return AddTable(records.data(), records.size());
+        }
+
+        BundleString AddString(const std::string& value)
+        {
+            BundleString result = { strings.size(), value.size() };
+            strings += value;
+            return result;
+        }
+    };
+
+    // Gives access to the records of the mapped file, checking that they are inside of it
+    class BundleView
+    {
+    public:
+        BundleView(const char* data, size_t size) : data(data), size(size) {}
+
+        template<typename T>
+        const T* Get(const BundleTable& table) const
+        {
+            if (table.count == 0)
+                return nullptr;
+            if (table.offset % alignof(T) != 0 || table.offset > size ||
+                table.count > (size - table.offset) / sizeof(T))
+                throw std::out_of_range("table");
+            return reinterpret_cast<const T*>(data + table.offset);
+        }
+
+        std::string GetString(const BundleTable& strings, const BundleString& value) const
+        {
+            if (value.offset > strings.count || value.length > strings.count - value.offset)
+                throw std::out_of_range("string");
+            return std::string(Get<char>(strings) + value.offset, value.length);
+        }
+
+    private:
+        const char* data;
+        size_t size;
+    };
+
+    template<typename T>
+    T* GetIndexed(const std::vector<T*>& entities, int32_t index)
+    {
+        if (index < 0)
+            return nullptr;
+        if (index >= static_cast<int32_t>(entities.size()))
+            throw std::out_of_range("index");
+        return entities[index];
+    }
+}
+
+bool SceneBundle::Fail(const std::string& message)
+{
+    error = message;
+    return false;
+}
+
+bool SceneBundle::Write(Scene* scene, const std::string& filename)
+{
+    BundleBuilder builder;
+    BundleHeader header = {};
+    std::memcpy(header.magic, bundle_magic, sizeof(bundle_magic));
+    header.version = version;
+    header.byte_order = byte_order_mark;
+    builder.data.resize(sizeof(BundleHeader));
+
+    std::map<const SurfaceMaterial*, int32_t> surface_material_indices;
+    std::vector<BundleSurfaceMaterial> surface_materials;
+    for (const auto& entry : scene->surface_materials)
+    {
+        const SurfaceMaterial& material = *entry.second;
+        BundleSurfaceMaterial record = {};
+        record.name = builder.AddString(entry.first);
+        record.shininess = material.shininess;
+        record.specular = material.specular;
+        record.diffuse = material.diffuse;
+        record.reflective_color = material.reflective_color;
+        record.transparency_color = material.transparency_color;
+        surface_material_indices[entry.second.get()] = static_cast<int32_t>(surface_materials.size());
+        surface_materials.push_back(record);
+    }
+    header.surface_materials = builder.AddTable(surface_materials);
+
+    std::map<const InsideMaterial*, int32_t> inside_material_indices;
+    std::vector<BundleInsideMaterial> inside_materials;
+    for (const auto& entry : scene->inside_materials)
+    {
+        BundleInsideMaterial record = {};
+        record.name = builder.AddString(entry.first);
+        record.refractive_index = entry.second->refractive_index;
+        inside_material_indices[entry.second.get()] = static_cast<int32_t>(inside_materials.size());
+        inside_materials.push_back(record);
+    }
+    header.inside_materials = builder.AddTable(inside_materials);
+
+    std::map<const Surface*, int32_t> surface_indices;
+    std::vector<BundleSurface> surfaces;
+    for (const auto& entry : scene->surfaces)
+    {
+        BundleSurface record = {};
+        record.name = builder.AddString(entry.first);
+        record.kind = EmptySurface;
+        if (dynamic_cast<const Sphere*>(entry.second.get()))
+        {
+            record.kind = SphereSurface;
+        }
+        else if (dynamic_cast<const Plane*>(entry.second.get()))
+        {
+            record.kind = PlaneSurface;
+        }
+        else if (Mesh* mesh = dynamic_cast<Mesh*>(entry.second.get()))
+        {
+            // Deferred meshes are built now, so the bundle always has complete octrees
+            mesh->EnsureLoaded();
+            if (mesh->IsClustered())
+                return Fail("Mesh \"" + entry.first + "\" is streamed from clusters and cannot be bundled");
+            const MeshOctree* octree = mesh->GetRootOctree();
+            if (!octree)
+                return Fail("Mesh \"" + entry.first + "\" is not loaded");
+
+            record.kind = MeshSurface;
+            record.bounding_box = mesh->GetBoundingBox();
+            record.octree_box = mesh->GetOctreeBox();
+            record.cells = builder.AddTable(octree->GetCells(), octree->GetCellCount());
+            record.triangles = builder.AddTable(octree->GetTriangles(), octree->GetTriangleCount());
+
+            std::vector<int32_t> materials;
+            for (const SurfaceMaterial* material : mesh->GetMaterials())
+            {
+                auto index = surface_material_indices.find(material);
+                materials.push_back(index != surface_material_indices.end() ? index->second : -1);
+            }
+            record.materials = builder.AddTable(materials);
+        }
+        surface_indices[entry.second.get()] = static_cast<int32_t>(surfaces.size());
+        surfaces.push_back(record);
+    }
+    header.surfaces = builder.AddTable(surfaces);
+
+    std::map<const Surface*, int32_t> model_indices;
+    std::vector<BundleModel> models;
+    for (const auto& model : scene->models)
+    {
+        BundleModel record = {};
+        auto surface = surface_indices.find(model->surface);
+        record.surface = surface != surface_indices.end() ? surface->second : -1;
+        auto material = surface_material_indices.find(model->surface_material);
+        record.surface_material = material != surface_material_indices.end() ? material->second : -1;
+        record.inverted = model->inverted;
+        record.position = model->GetPosition();
+        record.orientation = model->GetOrientation();
+        record.scale = model->GetScale();
+        model_indices[model.get()] = static_cast<int32_t>(models.size());
+        models.push_back(record);
+    }
+    header.models = builder.AddTable(models);
+
+    std::vector<BundleObject> objects;
+    for (const auto& object : scene->objects)
+    {
+        BundleObject record;
+        auto model = model_indices.find(object.surface);
+        if (object.surface && model == model_indices.end())
+            return Fail("Objects must be placed by models to be written to bundles");
+        record.model = model != model_indices.end() ? model->second : -1;
+        auto material = inside_material_indices.find(object.material);
+        record.inside_material = material != inside_material_indices.end() ? material->second : -1;
+        objects.push_back(record);
+    }
+    header.objects = builder.AddTable(objects);
+
+    std::vector<BundleLight> lights;
+    for (const auto& light : scene->lights)
+        lights.push_back(BundleLight{ light.center, light.color });
+    header.lights = builder.AddTable(lights);
+
+    header.strings = builder.AddTable(builder.strings.data(), builder.strings.size());
+    header.file_size = builder.data.size();
+    std::memcpy(builder.data.data(), &header, sizeof(header));
+
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(builder.data.data(), builder.data.size());
+    if (!fout)
+        return Fail("Cannot write \"" + filename + "\"");
+    return true;
+}
+
+bool SceneBundle::Read(const std::string& filename, Scene* scene)
+{
+    auto file = std::make_unique<MappedFile>();
+    if (!file->Open(filename))
+        return Fail("Cannot open \"" + filename + "\"");
+
+    BundleHeader header;
+    if (file->GetSize() < sizeof(header))
+        return Fail("\"" + filename + "\" is not a scene bundle");
+    std::memcpy(&header, file->GetData(), sizeof(header));
+    if (std::memcmp(header.magic, bundle_magic, sizeof(bundle_magic)) != 0)
+        return Fail("\"" + filename + "\" is not a scene bundle");
+    if (header.version != version || header.byte_order != byte_order_mark)
+        return Fail("\"" + filename + "\" was compiled by another version or for another platform");
+    if (header.file_size != file->GetSize())
+        return Fail("\"" + filename + "\" is truncated");
+
+    // The bundle is read into a scene of its own, which replaces the given one only if nothing fails;
+    // that scene owns the mapping before any mesh refers to it
+    Scene loaded;
+    BundleView view(file->GetData(), file->GetSize());
+    loaded.bundle_file = std::move(file);
+    try
+    {
+        std::vector<SurfaceMaterial*> surface_materials;
+        const BundleSurfaceMaterial* surface_material_records = view.Get<BundleSurfaceMaterial>(header.surface_materials);
+        for (uint64_t i = 0; i < header.surface_materials.count; ++i)
+        {
+            // Materials which already exist, like the default ones, are updated in place,
+            // since the empty object of the scene refers to the default one
+            const BundleSurfaceMaterial& record = surface_material_records[i];
+            auto& material = loaded.surface_materials[view.GetString(header.strings, record.name)];
+            if (!material)
+                material = std::make_unique<SurfaceMaterial>();
+            material->shininess = record.shininess;
+            material->specular = record.specular;
+            material->diffuse = record.diffuse;
+            material->reflective_color = record.reflective_color;
+            material->transparency_color = record.transparency_color;
+            surface_materials.push_back(material.get());
+        }
+
+        std::vector<InsideMaterial*> inside_materials;
+        const BundleInsideMaterial* inside_material_records = view.Get<BundleInsideMaterial>(header.inside_materials);
+        for (uint64_t i = 0; i < header.inside_materials.count; ++i)
+        {
+            auto& material = loaded.inside_materials[view.GetString(header.strings, inside_material_records[i].name)];
+            if (!material)
+                material = std::make_unique<InsideMaterial>();
+            material->refractive_index = inside_material_records[i].refractive_index;
+            inside_materials.push_back(material.get());
+        }
+
+        std::vector<Surface*> surfaces;
+        const BundleSurface* surface_records = view.Get<BundleSurface>(header.surfaces);
+        for (uint64_t i = 0; i < header.surfaces.count; ++i)
+        {
+            const BundleSurface& record = surface_records[i];
+            std::string name = view.GetString(header.strings, record.name);
+            std::unique_ptr<Surface> surface;
+            switch (record.kind)
+            {
+            case SphereSurface:
+                surface = std::make_unique<Sphere>();
+                break;
+            case PlaneSurface:
+                surface = std::make_unique<Plane>();
+                break;
+            case MeshSurface:
+            {
+                // The octree is used right from the mapped file
+                auto mesh = std::make_unique<Mesh>();
+                mesh->LoadFromOctree(record.bounding_box, record.octree_box,
+                    view.Get<MeshOctreeCell>(record.cells), record.cells.count,
+                    view.Get<MeshTriangle>(record.triangles), record.triangles.count);
+                if (!mesh->GetRootOctree()->IsValid())
+                    return Fail("Mesh \"" + name + "\" of \"" + filename + "\" is corrupted");
+
+                std::vector<const SurfaceMaterial*> materials;
+                const int32_t* material_indices = view.Get<int32_t>(record.materials);
+                for (uint64_t j = 0; j < record.materials.count; ++j)
+                    materials.push_back(GetIndexed(surface_materials, material_indices[j]));
+                mesh->BindMaterials(materials);
+                surface = std::move(mesh);
+                break;
+            }
+            default:
+                surface = std::make_unique<Surface>();
+            }
+            surfaces.push_back(surface.get());
+            loaded.surfaces[name] = std::move(surface);
+        }
+
+        const BundleModel* model_records = view.Get<BundleModel>(header.models);
+        std::vector<Model*> models;
+        for (uint64_t i = 0; i < header.models.count; ++i)
+        {
+            const BundleModel& record = model_records[i];
+            auto model = std::make_unique<Model>();
+            model->surface = GetIndexed(surfaces, record.surface);
+            model->surface_material = GetIndexed(surface_materials, record.surface_material);
+            model->inverted = record.inverted != 0;
+            model->SetPosition(record.position);
+            model->SetOrientation(record.orientation);
+            model->SetScale(record.scale);
+            models.push_back(model.get());
+            loaded.models.push_back(std::move(model));
+        }
+
+        const BundleObject* object_records = view.Get<BundleObject>(header.objects);
+        for (uint64_t i = 0; i < header.objects.count; ++i)
+        {
+            Object3D object;
+            object.surface = GetIndexed(models, object_records[i].model);
+            object.material = GetIndexed(inside_materials, object_records[i].inside_material);
+            loaded.objects.push_back(object);
+        }
+
+        const BundleLight* light_records = view.Get<BundleLight>(header.lights);
+        for (uint64_t i = 0; i < header.lights.count; ++i)
+            loaded.lights.push_back(PointLight(light_records[i].center, light_records[i].color));
+    }
+    catch (const std::out_of_range&)
+    {
+        return Fail("\"" + filename + "\" is corrupted");
+    }
+    scene->Swap(loaded);
+    return true;
+}
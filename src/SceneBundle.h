@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+    SceneBundle.h
+    Compiled binary scenes: materials, objects, lights and built mesh octrees in one file,
+    which is mapped to memory when the scene is loaded
+    Author: Artyom Bishev
+*/
+
+#include "Scene.h"
+#include <string>
+
+// Writes and reads scene bundles
+// All references inside of a bundle are indices and offsets, so the mapped file is used as it is:
+// loading takes no parsing and no octree building, and the pages of the mesh data are shared
+// by all processes rendering the same bundle
+class SceneBundle
+{
+public:
+    // Version of the format, bundles of other versions are rejected
+    static const uint32_t version = 2;
+
+    // Write the scene to the file; deferred meshes are loaded first
+    bool Write(Scene* scene, const std::string& filename);
+
+    // Replace the scene by the one of the file, which the scene keeps mapped while it exists
+    // If the file cannot be read, the scene is left as it was
+    bool Read(const std::string& filename, Scene* scene);
+
+    // Description of the last error
+    const std::string& GetError() const
+    {
+        return error;
+    }
+
+private:
+    bool Fail(const std::string& message);
+
+    std::string error;
+};
@@ -1,22 +1,173 @@
 #include "SceneParser.h"
+#include "MeshClusters.h"
+#include "Paths.h"
+
+#include <charconv>
+#include <cctype>
+
+namespace
+{
+    // Nesting deeper than this is treated as recursive inclusion
+    const size_t max_include_depth = 64;
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+    }
+
+    bool IsPunctuation(char c)
+    {
+        return c == '{' || c == '}' || c == '=';
+    }
+}
+
+bool SceneLexer::Open(const std::string& arg_filename)
+{
+    filename = arg_filename;
+    if (!file.Open(filename))
+        return false;
+    position = file.GetData();
+    end = position + file.GetSize();
+    line_start = position;
+    line = 1;
+    return true;
+}
+
+void SceneLexer::SkipSpaceAndComments()
+{
+    while (position < end)
+    {
+        char c = *position;
+        if (c == '#' || (c == '/' && position + 1 < end && position[1] == '/'))
+        {
+            while (position < end && *position != '\n')
+                ++position;
+        }
+        else if (IsSpace(c))
+        {
+            ++position;
+            if (c == '\n')
+            {
+                ++line;
+                line_start = position;
+            }
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+std::string_view SceneLexer::Next()
+{
+    SkipSpaceAndComments();
+    token_line = line;
+    token_column = static_cast<int>(position - line_start) + 1;
+    if (position >= end)
+    {
+        token_kind = TokenKind::End;
+        return std::string_view();
+    }
+
+    const char* start = position;
+    if (IsPunctuation(*position))
+    {
+        token_kind = TokenKind::Punctuation;
+        ++position;
+        return std::string_view(start, 1);
+    }
+
+    if (*position == '"')
+    {
+        token_kind = TokenKind::String;
+        ++start;
+        ++position;
+        while (position < end && *position != '"' && *position != '\n')
+            ++position;
+        if (position >= end || *position != '"')
+            throw SyntaxError(Location() + ": Missing closing '\"' of the string");
+        std::string_view token(start, position - start);
+        ++position;
+        return token;
+    }
+
+    token_kind = TokenKind::Word;
+    while (position < end && !IsSpace(*position) && !IsPunctuation(*position))
+        ++position;
+    return std::string_view(start, position - start);
+}
+
+std::string_view SceneLexer::Peek()
+{
+    const char* saved_position = position;
+    const char* saved_line_start = line_start;
+    int saved_line = line, saved_token_line = token_line, saved_token_column = token_column;
+    TokenKind saved_token_kind = token_kind;
+
+    std::string_view token = Next();
+
+    position = saved_position;
+    line_start = saved_line_start;
+    line = saved_line;
+    token_line = saved_token_line;
+    token_column = saved_token_column;
+    token_kind = saved_token_kind;
+    return token;
+}
+
+std::string SceneLexer::Location() const
+{
+    return filename + ":" + std::to_string(token_line) + ":" + std::to_string(token_column);
+}
 
 void SceneParser::Parse(const std::string& arg_filename, Scene* arg_scene)
 {
-    fin.open(arg_filename);
     scene = arg_scene;
+    lexers.clear();
+    parsed_files.clear();
+    ParseFile(arg_filename);
+}
 
-    while (fin)
+void SceneParser::ParseFile(const std::string& filename)
+{
+    if (lexers.size() >= max_include_depth)
+        Error("Too deep nesting of included files, \"" + filename + "\" includes itself");
+
+    auto lexer = std::make_unique<SceneLexer>();
+    if (!lexer->Open(filename))
     {
-        ParseEntity();
+        if (lexers.empty())
+            throw SyntaxError(filename + ": cannot open file");
+        Error("Cannot open included file \"" + filename + "\"");
     }
+    parsed_files.insert(filename);
+    lexers.push_back(std::move(lexer));
+
+    for (std::string_view entity_name = NextToken(); !AtEnd(); entity_name = NextToken())
+    {
+        ParseEntity(entity_name);
+    }
+    lexers.pop_back();
 }
 
-void SceneParser::ParseEntity()
+void SceneParser::Error(const std::string& message) const
+{
+    throw SyntaxError(lexers.back()->Location() + ": " + message);
+}
+
+std::string_view SceneParser::NextToken()
+{
+    return lexers.back()->Next();
+}
+
+bool SceneParser::AtEnd() const
+{
+    return lexers.back()->GetTokenKind() == SceneLexer::TokenKind::End;
+}
+
+void SceneParser::ParseEntity(std::string_view entity_name)
 {
-    std::string entity_name;
-    fin >> entity_name;
-    if (entity_name.empty())
-        return;
     if (entity_name == "SurfaceMaterial")
     {
         ParseSurfaceMaterial();
@@ -37,51 +188,89 @@ void SceneParser::ParseEntity()
     {
         ParseLight();
     }
+    else if (entity_name == "include" || entity_name == "import")
+    {
+        std::string path = DirectoryOf(lexers.back()->GetFilename()) + ParseName();
+        if (entity_name == "include" || !parsed_files.count(path))
+            ParseFile(path);
+    }
     else
     {
-        throw SyntaxError(std::string("Wrong entity name: ") + entity_name);
+        Error(std::string("Wrong entity name: ") + std::string(entity_name));
     }
 }
 
+template<typename Handler>
+void SceneParser::ParseBlock(const char* entity_kind, Handler parse_value)
+{
+    if (NextToken() != "{")
+        Error("Open bracket '{' expected");
+
+    for (;;)
+    {
+        std::string_view left = NextToken();
+        if (AtEnd())
+            Error("Closed bracket '}' not found");
+        if (left == "}")
+            return;
+
+        if (NextToken() != "=")
+            Error("Expression divided by '=' is expected");
+        if (!parse_value(left))
+            Error(std::string("Wrong ") + entity_kind + " parameter: " + std::string(left));
+    }
+}
+
+std::string SceneParser::ParseName()
+{
+    std::string_view name = NextToken();
+    SceneLexer::TokenKind kind = lexers.back()->GetTokenKind();
+    if (kind == SceneLexer::TokenKind::End || kind == SceneLexer::TokenKind::Punctuation)
+        Error("Name expected");
+    return std::string(name);
+}
+
+double SceneParser::ParseNumber()
+{
+    std::string_view token = NextToken();
+    // from_chars does not accept the leading '+'
+    if (token.size() > 1 && token[0] == '+')
+        token.remove_prefix(1);
+
+    double value = 0.0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (token.empty() || result.ec != std::errc() || result.ptr != token.data() + token.size())
+        Error("Number expected, found '" + std::string(token) + "'");
+    return value;
+}
+
+int SceneParser::ParseInt()
+{
+    std::string_view token = NextToken();
+    int value = 0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (token.empty() || result.ec != std::errc() || result.ptr != token.data() + token.size())
+        Error("Integer expected, found '" + std::string(token) + "'");
+    return value;
+}
+
 glm::dvec3 SceneParser::ParseVec()
 {
     glm::dvec3 vec;
-    fin >> vec.x >> vec.y >> vec.z;
+    vec.x = ParseNumber();
+    vec.y = ParseNumber();
+    vec.z = ParseNumber();
     return vec;
 }
 
 void SceneParser::ParseSurfaceMaterial()
 {
-    SurfaceMaterial* m = new SurfaceMaterial;
-    std::string material_name;
-    fin >> material_name;
-
-    std::string str;
-    fin >> str;
-    if (str != "{")
-    {
-        delete m;
-        throw SyntaxError("Open bracket '{' expected");
-    }
-    while (fin)
-    {
-        std::string left;
-        fin >> left;
-        if (left == "}")
-        {
-            scene->surface_materials[material_name] = std::unique_ptr<SurfaceMaterial>(m);
-            return;
-        }
-
-        fin >> str;
-        if (str != "=")
-        {
-            delete m;
-            throw SyntaxError("Expression divided by '=' is expected");
-        }
+    auto m = std::make_unique<SurfaceMaterial>();
+    std::string material_name = ParseName();
 
+    ParseBlock("material", [&](std::string_view left) {
         if (left == "shininess") {
-            fin >> m->shininess;
+            m->shininess = ParseNumber();
         }
         else if (left == "specular") {
             m->specular = ParseVec();
@@ -96,201 +285,215 @@ void SceneParser::ParseSurfaceMaterial()
             m->transparency_color = ParseVec();
         }
         else {
-            delete m;
-            throw SyntaxError(std::string("Wrong material parameter: ") + left);
+            return false;
         }
-    }
-    throw SyntaxError("Closed bracket '}' not found");
+        return true;
+    });
+
+    // Existing materials are updated in place, since objects may already refer to them
+    auto& material = scene->surface_materials[material_name];
+    if (material)
+        *material = *m;
+    else
+        material = std::move(m);
 }
 
 void SceneParser::ParseInsideMaterial()
 {
-    InsideMaterial* m = new InsideMaterial;
-    std::string material_name;
-    fin >> material_name;
-
-    std::string str;
-    fin >> str;
-    if (str != "{")
-    {
-        delete m;
-        throw SyntaxError("Open bracket '{' expected");
-    }
-    while (fin)
-    {
-        std::string left;
-        fin >> left;
-        if (left == "}")
-        {
-            scene->inside_materials[material_name] = std::unique_ptr<InsideMaterial>(m);
-            return;
-        }
-
-        fin >> str;
-        if (str != "=")
-        {
-            delete m;
-            throw SyntaxError("Expression divided by '=' is expected");
-        }
+    auto m = std::make_unique<InsideMaterial>();
+    std::string material_name = ParseName();
 
+    ParseBlock("material", [&](std::string_view left) {
         if (left == "refractive_index") {
-            fin >> m->refractive_index;
+            m->refractive_index = ParseNumber();
         }
         else {
-            delete m;
-            throw SyntaxError(std::string("Wrong material parameter: ") + left);
+            return false;
         }
-    }
-    throw SyntaxError("Closed bracket '}' not found");
+        return true;
+    });
+
+    auto& material = scene->inside_materials[material_name];
+    if (material)
+        *material = *m;
+    else
+        material = std::move(m);
 }
 
 void SceneParser::ParseMesh()
 {
-    Mesh* m = new Mesh;
-    std::string mesh_name;
-    fin >> mesh_name;
+    auto m = std::make_unique<Mesh>();
+    std::string mesh_name = ParseName();
 
-    std::string str;
-    fin >> str;
-    if (str != "{")
-    {
-        delete m;
-        throw SyntaxError("Open bracket '{' expected");
-    }
-    while (fin)
-    {
-        std::string left;
-        fin >> left;
-        if (left == "}")
-        {
-            scene->surfaces[mesh_name] = std::unique_ptr<Mesh>(m);
-            return;
+    std::string filename, clusters_filename;
+    int index = 0;
+    bool whole_file = false;
+    int cluster_triangles = 16384;
+    bool has_bounds = false;
+    BoundingBox bounds;
+
+    ParseBlock("mesh", [&](std::string_view left) {
+        if (left == "filename") {
+            filename = ParseName();
+            // The index of the mesh inside of the file is optional, "all" loads all meshes of the file
+            std::string_view next = lexers.back()->Peek();
+            if (next == "all") {
+                NextToken();
+                whole_file = true;
+            }
+            else if (!next.empty() && (std::isdigit(static_cast<unsigned char>(next[0])) || next[0] == '-'))
+                index = ParseInt();
+        }
+        else if (left == "bounds") {
+            bounds.bounds[0] = ParseVec();
+            bounds.bounds[1] = ParseVec();
+            has_bounds = true;
         }
+        else if (left == "clusters") {
+            clusters_filename = ParseName();
+        }
+        else if (left == "cluster_triangles") {
+            cluster_triangles = ParseInt();
+            if (cluster_triangles <= 0)
+                Error("Number of triangles in a cluster must be positive");
+        }
+        else {
+            return false;
+        }
+        return true;
+    });
+
+    std::string path = "Models/" + filename;
+    auto load = [&]() {
+        return whole_file ? m->LoadAllFromFile(path) : m->LoadFromFile(path, index);
+    };
 
-        fin >> str;
-        if (str != "=")
+    // Clustered meshes are streamed from the cluster file, which is written from the mesh file
+    // the first time the scene is loaded and again whenever the mesh file changes
+    // Without the mesh file, the cluster file is used as it is
+    if (!clusters_filename.empty())
+    {
+        GeometryCache* cache = &scene->geometry_cache;
+        std::string clusters_path = "Models/" + clusters_filename;
+        MeshClusterSource source = {};
+        bool has_source = MeshClusterSource::Describe(path, whole_file ? -1 : index, source);
+        if (!m->LoadFromClusters(clusters_path, cache, has_source ? &source : nullptr) && load())
         {
-            delete m;
-            throw SyntaxError("Expression divided by '=' is expected");
+            if (!m->WriteClusters(clusters_path, cluster_triangles, source) || !m->LoadFromClusters(clusters_path, cache, &source))
+                std::cout << "Cannot write mesh clusters to \"" << clusters_path << "\", the mesh is kept in memory\n";
         }
+    }
+    // Meshes with declared bounds are loaded when the first ray reaches them
+    else if (has_bounds)
+    {
+        if (whole_file)
+            Error("Meshes with all materials of the file cannot be loaded on demand");
+        m->LoadOnDemand(path, index, bounds);
+    }
+    else
+    {
+        load();
+    }
 
-        if (left == "filename") {
-            std::string filename;
-            fin >> filename;
-            int index;
-            fin >> index;
-            m->LoadFromFile("Models\\" + filename, index);
-        }
-        else {
-            delete m;
-            throw SyntaxError(std::string("Wrong mesh parameter: ") + left);
+    BindMeshMaterials(m.get());
+    scene->surfaces[mesh_name] = std::move(m);
+}
+
+void SceneParser::BindMeshMaterials(Mesh* mesh)
+{
+    // Materials of the file are matched with the scene materials by name, the missing ones are made
+    // of the colors of the file and added to the scene, so objects may use them as well
+    std::vector<const SurfaceMaterial*> materials;
+    for (const MeshMaterial& file_material : mesh->GetFileMaterials())
+    {
+        auto& material = scene->surface_materials[file_material.name];
+        if (!material)
+        {
+            material = std::make_unique<SurfaceMaterial>();
+            material->diffuse = file_material.diffuse * (1.0 - file_material.transparency);
+            material->specular = file_material.specular;
+            if (file_material.shininess > 0.0)
+                material->shininess = file_material.shininess * 128.0;
+            material->transparency_color = glm::dvec3(file_material.transparency);
         }
+        materials.push_back(material.get());
     }
-    throw SyntaxError("Closed bracket '}' not found");
+    mesh->BindMaterials(materials);
 }
 
 void SceneParser::ParseObject()
 {
     auto m = std::make_unique<Model>();
     Object3D obj;
-    m->surface_material = scene->surface_materials["default"].get();
+    m->surface_material = scene->surface_materials.find("default")->second.get();
 
-    std::string str;
-    fin >> str;
-    if (str != "{")
-    {
-        throw SyntaxError("Open bracket '{' expected");
-    }
-    while (fin)
-    {
-        std::string left;
-        fin >> left;
-        if (left == "}")
-        {
-            obj.surface = m.get();
-            scene->objects.push_back(obj);
-            scene->models.emplace_back(std::move(m));
-            return;
-        }
-
-        fin >> str;
-        if (str != "=")
-        {
-            throw SyntaxError("Expression divided by '=' is expected");
-        }
+    // The matrices of the model are computed once, after the whole transformation is read
+    glm::dvec3 position = m->GetPosition(), orientation = m->GetOrientation(), scale = m->GetScale();
+    bool has_transform = false;
 
+    ParseBlock("object", [&](std::string_view left) {
         if (left == "position") {
-            m->SetPosition(ParseVec());
+            position = ParseVec();
+            has_transform = true;
         }
         else if (left == "orientation") {
-            m->SetOrientation(ParseVec());
+            orientation = ParseVec();
+            has_transform = true;
         }
         else if (left == "scale") {
-            m->SetScale(ParseVec());
+            scale = ParseVec();
+            has_transform = true;
         }
         else if (left == "surface") {
-            std::string obj_name;
-            fin >> obj_name;
-            if (scene->surfaces.find(obj_name) == scene->surfaces.end())
-                throw SyntaxError("No surface named" + obj_name + "found");
-            m->surface = scene->surfaces[obj_name].get();
+            std::string_view obj_name = NextToken();
+            auto surface = scene->surfaces.find(obj_name);
+            if (surface == scene->surfaces.end())
+                Error("No surface named " + std::string(obj_name) + " found");
+            m->surface = surface->second.get();
         }
         else if (left == "surface_material") {
-            std::string material_name;
-            fin >> material_name;
-            if (scene->surface_materials.find(material_name) == scene->surface_materials.end())
-                throw SyntaxError("No material named" + material_name + "found");
-            m->surface_material = scene->surface_materials[material_name].get();
+            std::string_view material_name = NextToken();
+            auto material = scene->surface_materials.find(material_name);
+            if (material == scene->surface_materials.end())
+                Error("No material named " + std::string(material_name) + " found");
+            m->surface_material = material->second.get();
         }
         else if (left == "inside_material") {
-            std::string material_name;
-            fin >> material_name;
-            if (scene->inside_materials.find(material_name) == scene->inside_materials.end())
-                throw SyntaxError("No material named" + material_name + "found");
-            obj.material = scene->inside_materials[material_name].get();
+            std::string_view material_name = NextToken();
+            auto material = scene->inside_materials.find(material_name);
+            if (material == scene->inside_materials.end())
+                Error("No material named " + std::string(material_name) + " found");
+            obj.material = material->second.get();
         }
         else {
-            throw SyntaxError(std::string("Wrong mesh parameter: ") + left);
+            return false;
         }
-    }
-    throw SyntaxError("Closed bracket '}' not found");
+        return true;
+    });
+
+    if (has_transform)
+        m->SetTransform(position, orientation, scale);
+    obj.surface = m.get();
+    scene->objects.push_back(obj);
+    scene->models.emplace_back(std::move(m));
 }
 
 void SceneParser::ParseLight()
 {
     PointLight light;
 
-    std::string str;
-    fin >> str;
-    if (str != "{")
-    {
-        throw SyntaxError("Open bracket '{' expected");
-    }
-    while (fin)
-    {
-        std::string left;
-        fin >> left;
-        if (left == "}")
-        {
-            scene->lights.push_back(light);
-            return;
-        }
-
-        fin >> str;
-        if (str != "=")
-        {
-            throw SyntaxError("Expression divided by '=' is expected");
-        }
-
+    ParseBlock("light", [&](std::string_view left) {
         if (left == "position") {
             light.center = ParseVec();
-        } 
+        }
         else if (left == "color") {
             light.color = ParseVec();
         }
         else {
-            throw SyntaxError(std::string("Wrong light parameter: ") + left);
+            return false;
         }
-    }
-    throw SyntaxError("Closed bracket '}' not found");
+        return true;
+    });
+
+    scene->lights.push_back(light);
 }
@@ -7,8 +7,12 @@
 */
 
 #include "Scene.h"
+#include "MappedFile.h"
 #include <string>
-#include <fstream>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <memory>
 #include <exception>
 #include "Material.h"
 
@@ -16,18 +20,76 @@ class SyntaxError : std::exception
 {
 public:
     SyntaxError(const std::string& msg) : msg(msg) {};
-    virtual const const char* what() const throw()
+    virtual const char* what() const throw()
     {
         return msg.c_str();
     }
     std::string msg;
 };
 
+// Splits a scene file mapped to memory into tokens
+// Tokens are separated by whitespace; '{', '}' and '=' are tokens of their own,
+// "quoted strings" may contain spaces, and comments start with '#' or '//'
+class SceneLexer
+{
+public:
+    enum class TokenKind
+    {
+        End,          // the end of the file, the token is empty
+        Word,
+        String,       // "quoted string", possibly empty
+        Punctuation
+    };
+
+    // Map the file; returns false if it cannot be opened
+    bool Open(const std::string& filename);
+
+    // Read the next token; the returned view points into the mapped file
+    // The end of the file is told by GetTokenKind, since quoted strings may be empty as well
+    // Throws SyntaxError if a quoted string is not closed on its line
+    std::string_view Next();
+
+    // Read the next token without consuming it
+    std::string_view Peek();
+
+    // "file:line:column" of the last token returned by Next
+    std::string Location() const;
+
+    // Kind of the last token returned by Next
+    TokenKind GetTokenKind() const
+    {
+        return token_kind;
+    }
+
+    const std::string& GetFilename() const
+    {
+        return filename;
+    }
+
+private:
+    void SkipSpaceAndComments();
+
+    MappedFile file;
+    std::string filename;
+    const char* position = nullptr;
+    const char* end = nullptr;
+    const char* line_start = nullptr;
+    int line = 1;
+    int token_line = 1;
+    int token_column = 1;
+    TokenKind token_kind = TokenKind::End;
+};
+
 // This class provides methods for reading 3D scenes from file
+// Besides the entities, scene files may contain the directives
+//     include "file"   - parse the file at this place
+//     import "file"    - parse the file, unless it was already included or imported
+// Paths of the included files are relative to the including file
 class SceneParser
 {
 private:
-    std::ifstream fin;
+    std::vector<std::unique_ptr<SceneLexer>> lexers;  // the innermost included file is the last
+    std::set<std::string> parsed_files;
     Scene* scene;
 
 public:
@@ -35,10 +97,32 @@ public:
     SceneParser() {}
 
     // Load scene from file to Scene*
+    // Errors are reported by SyntaxError with "file:line:column: " before the description
     void Parse(const std::string& arg_filename, Scene* arg_scene);
 
 private:
-    void ParseEntity();
+    void ParseFile(const std::string& filename);
+
+    void ParseEntity(std::string_view entity_name);
+
+    // Throw SyntaxError at the location of the last token
+    [[noreturn]] void Error(const std::string& message) const;
+
+    std::string_view NextToken();
+
+    // Check whether the last token read by NextToken is the end of the file
+    bool AtEnd() const;
+
+    // Read "{", then "key = value" pairs until "}", passing every key to parse_value,
+    // which reads the value and returns false for unknown keys
+    template<typename Handler>
+    void ParseBlock(const char* entity_kind, Handler parse_value);
+
+    std::string ParseName();
+
+    double ParseNumber();
+
+    int ParseInt();
 
     glm::dvec3 ParseVec();
 
@@ -48,6 +132,9 @@ private:
 
     void ParseMesh();
 
+    // Bind the materials of the mesh file to surface materials of the scene
+    void BindMeshMaterials(Mesh* mesh);
+
     void ParseObject();
 
     void ParseLight();
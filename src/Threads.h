@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+    Threads.h
+    Helpers for the OpenMP threads, which also work without OpenMP
+    Author: Artyom Bishev
+*/
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Largest number of threads of a parallel region
+inline int MaxThreads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Index of the calling thread in its team
+inline int ThreadIndex()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// Number of threads in the team of the calling thread
+inline int TeamSize()
+{
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
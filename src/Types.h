@@ -72,8 +72,23 @@ struct BoundingBox
 
         return glm::max(tMin.x, tMin.y, tMin.z) < glm::min(tMax.x, tMax.y, tMax.z);
     }
+    bool Contains(const BoundingBox& other) const
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (other.bounds[0][k] < bounds[0][k] || other.bounds[1][k] > bounds[1][k])
+                return false;
+        }
+        return true;
+    }
 };
 
+// Largest of the components of the color
+inline double MaxComponent(const glm::dvec3& v)
+{
+    return glm::max(v.x, glm::max(v.y, v.z));
+}
+
 inline glm::dvec3 GammaCompression(glm::dvec3 physical_color, double gamma = 2.1)
 {
     return glm::pow(physical_color, glm::dvec3(1 / gamma));